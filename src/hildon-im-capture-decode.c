@@ -0,0 +1,172 @@
+/**
+   @file: hildon-im-capture-decode.c
+
+   Prints a capture file written by the IM context when HILDON_IM_CAPTURE
+   is set, followed by message counts per type and direction.
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "hildon-im-gtk-compat.h"
+#include "hildon-im-protocol.h"
+#include "hildon-im-capture.h"
+
+static gboolean counts_only = FALSE;
+
+static GOptionEntry entries[] =
+{
+  { "counts", 'c', 0, G_OPTION_ARG_NONE, &counts_only,
+    "Only print the message counts", NULL },
+  { NULL }
+};
+
+static void
+print_data (const HildonIMCaptureRecord *record)
+{
+  guint i;
+
+  if (record->format == 32)
+  {
+    guint32 values[5];
+
+    memcpy (values, record->data, sizeof (values));
+    for (i = 0; i < G_N_ELEMENTS (values); i++)
+      printf (" %u", values[i]);
+  }
+  else
+  {
+    printf (" \"");
+    for (i = 0; i < sizeof (record->data); i++)
+    {
+      guchar c = record->data[i];
+
+      if (g_ascii_isprint (c) && c != '"' && c != '\\')
+        putchar (c);
+      else
+        printf ("\\x%02x", c);
+    }
+    putchar ('"');
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *option_context;
+  GError *error = NULL;
+  gchar *contents;
+  gsize length;
+  const HildonIMCaptureHeader *header;
+  const HildonIMCaptureRecord *records;
+  guint counts[HILDON_IM_NUM_ATOMS + 1][2];
+  guint head, first, n, i;
+  gint64 start = 0;
+
+  option_context = g_option_context_new ("FILE");
+  g_option_context_set_summary (option_context,
+      "Decodes Hildon IM traffic captured with HILDON_IM_CAPTURE.");
+  g_option_context_add_main_entries (option_context, entries, NULL);
+
+  if (!g_option_context_parse (option_context, &argc, &argv, &error) ||
+      argc != 2)
+  {
+    fprintf (stderr, "%s\n", error != NULL ? error->message :
+             "Exactly one capture file is expected");
+    return 1;
+  }
+
+  g_option_context_free (option_context);
+
+  if (!g_file_get_contents (argv[1], &contents, &length, &error))
+  {
+    fprintf (stderr, "%s\n", error->message);
+    return 1;
+  }
+
+  header = (const HildonIMCaptureHeader *) contents;
+  if (length < sizeof (*header) ||
+      header->magic != HILDON_IM_CAPTURE_MAGIC ||
+      header->version != HILDON_IM_CAPTURE_VERSION ||
+      header->record_size != sizeof (HildonIMCaptureRecord) ||
+      length < sizeof (*header) + header->n_records * sizeof (*records))
+  {
+    fprintf (stderr, "%s is not a capture file of this version\n", argv[1]);
+    return 1;
+  }
+
+  records = (const HildonIMCaptureRecord *) (header + 1);
+  head = (guint) header->head;
+
+  /* Once the ring wrapped, the oldest record follows the newest one */
+  n = MIN (head, header->n_records);
+  first = head - n;
+
+  memset (counts, 0, sizeof (counts));
+
+  if (!counts_only)
+    printf ("# pid %u, %u messages, %u kept\n", header->pid, head, n);
+
+  for (i = first; i < head; i++)
+  {
+    const HildonIMCaptureRecord *record = &records[i % header->n_records];
+    const gchar *name = hildon_im_protocol_get_atom_name (record->atom);
+    guint direction = record->direction == HILDON_IM_CAPTURE_IN ? 1 : 0;
+
+    counts[name != NULL ? record->atom : HILDON_IM_NUM_ATOMS][direction]++;
+
+    if (counts_only)
+      continue;
+
+    if (i == first)
+      start = record->time;
+
+    printf ("%12.3f %s ctx %-4u %-38s %2u",
+            (record->time - start) / 1000.0,
+            direction ? "<-" : "->",
+            record->context,
+            name != NULL ? name : "?",
+            record->format);
+    print_data (record);
+    putchar ('\n');
+  }
+
+  printf ("\n%-38s %8s %8s\n", "# message", "sent", "received");
+  for (i = 0; i <= HILDON_IM_NUM_ATOMS; i++)
+  {
+    const gchar *name = hildon_im_protocol_get_atom_name (i);
+
+    if (counts[i][0] == 0 && counts[i][1] == 0)
+      continue;
+
+    printf ("%-38s %8u %8u\n", name != NULL ? name : "?",
+            counts[i][0], counts[i][1]);
+  }
+
+  g_free (contents);
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+/**
+   @file: hildon-im-capture.c
+
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "hildon-im-capture.h"
+
+struct _HildonIMCapture
+{
+  gsize map_size;
+  HildonIMCaptureHeader *header;
+  HildonIMCaptureRecord *records;
+};
+
+HildonIMCapture *
+hildon_im_capture_new (const gchar *path, guint n_records)
+{
+  HildonIMCapture *capture;
+  gsize size;
+  void *addr;
+  gint fd;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  if (n_records == 0)
+    n_records = HILDON_IM_CAPTURE_DEFAULT_RECORDS;
+
+  size = sizeof (HildonIMCaptureHeader) +
+         n_records * sizeof (HildonIMCaptureRecord);
+
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    g_warning ("Unable to create the IM capture file %s", path);
+    return NULL;
+  }
+
+  if (ftruncate (fd, size) != 0)
+  {
+    g_warning ("Unable to size the IM capture file %s", path);
+    close (fd);
+    return NULL;
+  }
+
+  addr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  /* The mapping keeps the file alive */
+  close (fd);
+
+  if (addr == MAP_FAILED)
+  {
+    g_warning ("Unable to map the IM capture file %s", path);
+    return NULL;
+  }
+
+  capture = g_new0 (HildonIMCapture, 1);
+  capture->map_size = size;
+  capture->header = addr;
+  capture->records = (HildonIMCaptureRecord *) (capture->header + 1);
+
+  capture->header->version = HILDON_IM_CAPTURE_VERSION;
+  capture->header->n_records = n_records;
+  capture->header->record_size = sizeof (HildonIMCaptureRecord);
+  capture->header->pid = getpid ();
+  g_atomic_int_set (&capture->header->head, 0);
+
+  /* Written last, so a reader never sees a half-initialized header */
+  g_atomic_int_set ((volatile gint *) &capture->header->magic,
+                    HILDON_IM_CAPTURE_MAGIC);
+
+  return capture;
+}
+
+void
+hildon_im_capture_free (HildonIMCapture *capture)
+{
+  if (capture == NULL)
+    return;
+
+  munmap (capture->header, capture->map_size);
+  g_free (capture);
+}
+
+void
+hildon_im_capture_record (HildonIMCapture *capture,
+                          HildonIMCaptureDirection direction,
+                          guint32 context,
+                          guint atom,
+                          gint format,
+                          const void *data)
+{
+  HildonIMCaptureRecord *record;
+  guint head;
+
+  g_return_if_fail (capture != NULL);
+
+  head = (guint) g_atomic_int_get (&capture->header->head);
+  record = &capture->records[head % capture->header->n_records];
+
+  record->time = g_get_monotonic_time ();
+  record->context = context;
+  record->atom = atom;
+  record->direction = direction;
+  record->format = format;
+  memcpy (record->data, data, sizeof (record->data));
+  record->reserved = 0;
+
+  g_atomic_int_set (&capture->header->head, (gint) (head + 1));
+}
@@ -0,0 +1,132 @@
+/**
+   @file: hildon-im-capture.h
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef HILDON_IM_CAPTURE_H_
+#define HILDON_IM_CAPTURE_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define HILDON_IM_CAPTURE_MAGIC   0x48494d43 /* "HIMC" */
+#define HILDON_IM_CAPTURE_VERSION 1
+
+#define HILDON_IM_CAPTURE_DEFAULT_RECORDS 16384
+
+/**
+ * HildonIMCaptureDirection:
+ * @HILDON_IM_CAPTURE_OUT: The message was sent by this process
+ * @HILDON_IM_CAPTURE_IN: The message was received by this process
+ */
+typedef enum
+{
+  HILDON_IM_CAPTURE_OUT,
+  HILDON_IM_CAPTURE_IN
+} HildonIMCaptureDirection;
+
+/**
+ * HildonIMCaptureHeader:
+ * @magic: HILDON_IM_CAPTURE_MAGIC
+ * @version: HILDON_IM_CAPTURE_VERSION
+ * @n_records: the number of record slots following the header
+ * @record_size: sizeof (HildonIMCaptureRecord)
+ * @pid: the process that wrote the file
+ * @head: the number of records written so far; once it exceeds
+ * @n_records the oldest records have been overwritten
+ *
+ * The start of a capture file.
+ */
+typedef struct
+{
+  guint32 magic;
+  guint32 version;
+  guint32 n_records;
+  guint32 record_size;
+  guint32 pid;
+  volatile gint head;
+} HildonIMCaptureHeader;
+
+/**
+ * HildonIMCaptureRecord:
+ * @time: g_get_monotonic_time() when the message was sent or received
+ * @context: the id of the context that sent or received the message
+ * @atom: the #HildonIMAtom of the message
+ * @direction: a #HildonIMCaptureDirection
+ * @format: the ClientMessage format of the message
+ * @data: the message data
+ *
+ * One captured message.
+ */
+typedef struct
+{
+  gint64 time;
+  guint32 context;
+  guint16 atom;
+  guint8 direction;
+  guint8 format;
+  char data[20];
+  guint32 reserved;
+} HildonIMCaptureRecord;
+
+typedef struct _HildonIMCapture HildonIMCapture;
+
+/**
+ * hildon_im_capture_new:
+ * @path: the file to capture to; it is created or truncated
+ * @n_records: the number of records kept before the oldest are overwritten
+ *
+ * Maps a capture file. Records are written to shared memory only, so
+ * capturing costs a copy of the message per message.
+ *
+ * Returns: a new #HildonIMCapture, or NULL if the file could not be mapped.
+ */
+HildonIMCapture *hildon_im_capture_new (const gchar *path, guint n_records);
+
+/**
+ * hildon_im_capture_free:
+ * @capture: a #HildonIMCapture
+ *
+ * Unmaps the capture file. Its contents stay on disk.
+ */
+void hildon_im_capture_free (HildonIMCapture *capture);
+
+/**
+ * hildon_im_capture_record:
+ * @capture: a #HildonIMCapture
+ * @direction: a #HildonIMCaptureDirection
+ * @context: an id of the sending or receiving context
+ * @atom: the #HildonIMAtom of the message
+ * @format: the ClientMessage format of the message
+ * @data: the 20 bytes of message data
+ *
+ * Appends one message to the capture file.
+ */
+void hildon_im_capture_record (HildonIMCapture *capture,
+                               HildonIMCaptureDirection direction,
+                               guint32 context,
+                               guint atom,
+                               gint format,
+                               const void *data);
+
+G_END_DECLS
+
+#endif /* ifndef HILDON_IM_CAPTURE_H_ */
@@ -0,0 +1,285 @@
+/**
+   @file: hildon-im-codec-check.c
+
+   Checks the message codec and the UTF-8 chunker, and with --bench
+   times them.
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "hildon-im-gtk-compat.h"
+#include "hildon-im-codec.h"
+
+/* Rounds of each benchmark */
+#define BENCH_ROUNDS 1000000
+
+static gboolean bench = FALSE;
+static guint failures = 0;
+
+static GOptionEntry entries[] =
+{
+  { "bench", 'b', 0, G_OPTION_ARG_NONE, &bench,
+    "Also time the codec and the chunker", NULL },
+  { NULL }
+};
+
+/* Stands for the table of a display; any distinct values do */
+static Atom atoms[HILDON_IM_NUM_ATOMS];
+
+static void
+fail (const gchar *what, const gchar *text, gsize size)
+{
+  printf ("FAIL: %s, text \"%s\", chunk size %u\n",
+          what, text, (guint) size);
+  failures++;
+}
+
+/* Splits @text the way the senders do and checks every chunk */
+static void
+check_chunks (const gchar *text, gsize size)
+{
+  GString *joined = g_string_new (NULL);
+  const gchar *str = text;
+  gsize len;
+
+  do
+  {
+    len = hildon_im_codec_next_chunk (str, size);
+
+    if (len > size)
+      fail ("chunk longer than the field", text, size);
+    if (len == 0 && *str != '\0')
+      fail ("empty chunk before the end", text, size);
+    if (!g_utf8_validate (str, len, NULL))
+      fail ("chunk splits a character", text, size);
+
+    g_string_append_len (joined, str, len);
+    str += len;
+  } while (len > 0 && *str != '\0');
+
+  if (strcmp (joined->str, text) != 0)
+    fail ("chunks do not add up to the text", text, size);
+
+  g_string_free (joined, TRUE);
+}
+
+static void
+check_chunker (void)
+{
+  /* Characters of 1 to 4 bytes, each placed so that it ends before, on
+     and past the 15th and 16th byte */
+  static const gchar *characters[] =
+  {
+    "a", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80"
+  };
+  GString *text = g_string_new (NULL);
+  gsize size;
+  guint c, lead;
+
+  for (size = 15; size <= 16; size++)
+  {
+    for (c = 0; c < G_N_ELEMENTS (characters); c++)
+    {
+      for (lead = 10; lead <= 17; lead++)
+      {
+        g_string_truncate (text, 0);
+        while (text->len < lead)
+          g_string_append_c (text, 'x');
+        g_string_append (text, characters[c]);
+        g_string_append (text, characters[c]);
+        g_string_append (text, "yz");
+
+        check_chunks (text->str, size);
+      }
+    }
+
+    check_chunks ("", size);
+    check_chunks ("\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac\xe2\x82\xac"
+                  "\xe2\x82\xac\xe2\x82\xac", size);
+  }
+
+  /* A character cut at the 15th byte goes whole into the next chunk */
+  if (hildon_im_codec_next_chunk ("xxxxxxxxxxxxxx\xc3\xa9", 15) != 14)
+    fail ("2-byte character at the boundary not held back",
+          "xxxxxxxxxxxxxx\xc3\xa9", 15);
+  if (hildon_im_codec_next_chunk ("xxxxxxxxxxxxxx\xc3\xa9", 16) != 16)
+    fail ("2-byte character within the field held back",
+          "xxxxxxxxxxxxxx\xc3\xa9", 16);
+  if (hildon_im_codec_next_chunk ("xxxxxxxxxxxxx\xf0\x9f\x98\x80", 16) != 13)
+    fail ("4-byte character at the boundary not held back",
+          "xxxxxxxxxxxxx\xf0\x9f\x98\x80", 16);
+
+  g_string_free (text, TRUE);
+}
+
+static void
+check_codec (void)
+{
+  const HildonIMCodecEntry *entry;
+  guchar payload[20];
+  guchar data[20];
+  HildonIMAtom decoded;
+  XEvent event;
+  guint atom, i;
+
+  for (atom = 0; atom < HILDON_IM_NUM_ATOMS; atom++)
+  {
+    entry = hildon_im_codec_get_entry (atom);
+    if (entry == NULL || entry->kind != HILDON_IM_CODEC_MESSAGE)
+      continue;
+
+    for (i = 0; i < sizeof (payload); i++)
+      payload[i] = (guchar) (atom * 31 + i + 1);
+
+    hildon_im_codec_encode (atoms, atom, 42, payload, &event);
+
+    if (event.xclient.format != entry->format ||
+        event.xclient.message_type != atoms[atom])
+    {
+      fail ("encoded header", entry->name, 0);
+      continue;
+    }
+
+    if (!hildon_im_codec_decode (atoms, &event.xclient, &decoded, data) ||
+        decoded != atom)
+    {
+      fail ("message does not decode", entry->name, 0);
+      continue;
+    }
+
+    if (memcmp (data, payload, entry->payload_size) != 0)
+      fail ("payload changed on the way", entry->name, 0);
+
+    for (i = entry->payload_size; i < sizeof (data); i++)
+    {
+      if (data[i] != 0)
+      {
+        fail ("bytes past the payload not zero", entry->name, 0);
+        break;
+      }
+    }
+  }
+
+  event.xclient.message_type = None;
+  if (hildon_im_codec_decode (atoms, &event.xclient, &decoded, data))
+    fail ("foreign message decodes", "None", 0);
+}
+
+static void
+bench_codec (void)
+{
+  HildonIMInsertUtf8Message msg;
+  HildonIMAtom decoded;
+  XEvent event;
+  gchar data[20];
+  gint64 start;
+  guint i;
+
+  memset (&msg, 0, sizeof (msg));
+  strcpy (msg.utf8_str, "benchmark text");
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < BENCH_ROUNDS; i++)
+  {
+    hildon_im_codec_encode (atoms, HILDON_IM_INSERT_UTF8, 42, &msg, &event);
+    hildon_im_codec_decode (atoms, &event.xclient, &decoded, data);
+  }
+
+  printf ("encode + decode: %.1f ns per message\n",
+          (g_get_monotonic_time () - start) * 1000.0 / BENCH_ROUNDS);
+}
+
+static void
+bench_chunker (void)
+{
+  GString *text = g_string_new (NULL);
+  const gchar *str;
+  gsize chunks = 0;
+  gsize len;
+  gint64 start;
+  guint i;
+
+  /* ASCII mixed with 2-, 3- and 4-byte characters */
+  while (text->len < 4096)
+    g_string_append (text, "hello \xc3\xa9t\xc3\xa9 \xe2\x82\xac "
+                     "\xf0\x9f\x98\x80 ");
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < BENCH_ROUNDS / 1000; i++)
+  {
+    str = text->str;
+    while ((len = hildon_im_codec_next_chunk (str, 15)) > 0)
+    {
+      str += len;
+      chunks++;
+    }
+  }
+
+  printf ("next_chunk: %.1f ns per chunk\n",
+          (g_get_monotonic_time () - start) * 1000.0 / MAX (chunks, 1));
+
+  g_string_free (text, TRUE);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *option_context;
+  GError *error = NULL;
+  guint i;
+
+  option_context = g_option_context_new ("- check the IM message codec");
+  g_option_context_add_main_entries (option_context, entries, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error))
+  {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    g_option_context_free (option_context);
+    return 2;
+  }
+  g_option_context_free (option_context);
+
+  for (i = 0; i < HILDON_IM_NUM_ATOMS; i++)
+    atoms[i] = 1000 + i;
+
+  check_chunker ();
+  check_codec ();
+
+  if (bench)
+  {
+    bench_codec ();
+    bench_chunker ();
+  }
+
+  if (failures > 0)
+  {
+    printf ("%u checks failed\n", failures);
+    return 1;
+  }
+
+  return 0;
+}
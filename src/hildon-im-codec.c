@@ -0,0 +1,169 @@
+/**
+   @file: hildon-im-codec.c
+
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "hildon-im-gtk-compat.h"
+#include "hildon-im-codec.h"
+
+/* Fails to compile if a schema entry has a payload larger than the 20
+   data bytes of a ClientMessage or a format other than 8 or 32 */
+#define HILDON_IM_SCHEMA_ATOM(atom, name, format, size, kind) \
+  && (size) <= 20 && ((format) == 8 || (format) == 32)
+typedef char HildonIMCodecSchemaCheck[(1
+#include "hildon-im-protocol-schema.h"
+                                       ) ? 1 : -1];
+#undef HILDON_IM_SCHEMA_ATOM
+
+static const HildonIMCodecEntry codec_entries[HILDON_IM_NUM_ATOMS] =
+{
+#define HILDON_IM_SCHEMA_ATOM(atom, name, format, size, kind) \
+  { name, format, size, kind },
+#include "hildon-im-protocol-schema.h"
+#undef HILDON_IM_SCHEMA_ATOM
+};
+
+const HildonIMCodecEntry *
+hildon_im_codec_get_entry (guint atom)
+{
+  if (atom >= HILDON_IM_NUM_ATOMS)
+    return NULL;
+
+  return &codec_entries[atom];
+}
+
+void
+hildon_im_codec_set_data (XClientMessageEvent *event,
+                          gconstpointer data)
+{
+  guint32 values[5];
+  gint i;
+
+  if (event->format == 32)
+  {
+    memcpy(values, data, sizeof(values));
+    for (i = 0; i < 5; i++)
+      event->data.l[i] = values[i];
+  }
+  else
+  {
+    memcpy(event->data.b, data, sizeof(values));
+  }
+}
+
+void
+hildon_im_codec_get_data (const XClientMessageEvent *event,
+                          gpointer data)
+{
+  guint32 values[5];
+  gint i;
+
+  if (event->format == 32)
+  {
+    for (i = 0; i < 5; i++)
+      values[i] = (guint32) event->data.l[i];
+    memcpy(data, values, sizeof(values));
+  }
+  else
+  {
+    memcpy(data, event->data.b, sizeof(values));
+  }
+}
+
+void
+hildon_im_codec_encode (const Atom *atoms,
+                        HildonIMAtom atom,
+                        Window window,
+                        gconstpointer payload,
+                        XEvent *event)
+{
+  const HildonIMCodecEntry *entry;
+  char data[20];
+
+  g_return_if_fail(atom < HILDON_IM_NUM_ATOMS);
+
+  entry = &codec_entries[atom];
+
+  memset(data, 0, sizeof(data));
+  if (payload != NULL)
+    memcpy(data, payload, entry->payload_size);
+
+  memset(event, 0, sizeof(XEvent));
+  event->xclient.type = ClientMessage;
+  event->xclient.window = window;
+  event->xclient.message_type = atoms[atom];
+  event->xclient.format = entry->format;
+
+  hildon_im_codec_set_data(&event->xclient, data);
+}
+
+gboolean
+hildon_im_codec_decode (const Atom *atoms,
+                        const XClientMessageEvent *event,
+                        HildonIMAtom *atom,
+                        gpointer data)
+{
+  HildonIMAtom found;
+
+  found = hildon_im_protocol_lookup_atom(atoms, event->message_type);
+  if (found == HILDON_IM_NUM_ATOMS ||
+      codec_entries[found].kind != HILDON_IM_CODEC_MESSAGE ||
+      codec_entries[found].format != event->format)
+  {
+    return FALSE;
+  }
+
+  *atom = found;
+  hildon_im_codec_get_data(event, data);
+
+  return TRUE;
+}
+
+gsize
+hildon_im_codec_next_chunk (const gchar *text,
+                            gsize size)
+{
+  gsize n = 0;
+
+  while (n < size && text[n] != '\0')
+    n++;
+
+  /* The text goes on past the field; back off to where the character
+     cut in two starts. text[n] is a continuation byte exactly then. */
+  if (n == size)
+  {
+    while (n > 0 && (text[n] & 0xc0) == 0x80)
+      n--;
+
+    /* Not UTF-8 at all, cut it anywhere rather than loop */
+    if (n == 0)
+      n = size;
+  }
+
+  return n;
+}
@@ -0,0 +1,143 @@
+/**
+   @file: hildon-im-codec.h
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef HILDON_IM_CODEC_H_
+#define HILDON_IM_CODEC_H_
+
+#include <glib.h>
+#include <X11/Xlib.h>
+
+#include "hildon-im-protocol.h"
+
+G_BEGIN_DECLS
+
+/**
+ * HildonIMCodecKind:
+ * @HILDON_IM_CODEC_MESSAGE: The atom names a ClientMessage
+ * @HILDON_IM_CODEC_PROPERTY: The atom names a window property
+ *
+ * How a #HildonIMAtom travels.
+ */
+typedef enum
+{
+  HILDON_IM_CODEC_MESSAGE,
+  HILDON_IM_CODEC_PROPERTY
+} HildonIMCodecKind;
+
+/**
+ * HildonIMCodecEntry:
+ * @name: the X name of the atom
+ * @format: the format of the message or property, 8 or 32
+ * @payload_size: the size of the payload in bytes
+ * @kind: the #HildonIMCodecKind
+ *
+ * The schema entry of one #HildonIMAtom.
+ */
+typedef struct
+{
+  const gchar *name;
+  gint format;
+  gsize payload_size;
+  HildonIMCodecKind kind;
+} HildonIMCodecEntry;
+
+/**
+ * hildon_im_codec_get_entry:
+ * @atom: a #HildonIMAtom
+ *
+ * Returns: the schema entry of @atom, or NULL if it is out of range
+ */
+const HildonIMCodecEntry *hildon_im_codec_get_entry (guint atom);
+
+/**
+ * hildon_im_codec_encode:
+ * @atoms: the table hildon_im_protocol_get_atoms() returned for the display
+ * the event goes to
+ * @atom: the #HildonIMAtom of the message
+ * @window: the window of the event
+ * @payload: the message struct, or NULL for a message without payload
+ * @event: location to store the ClientMessage event
+ *
+ * Builds a ClientMessage with the format and payload size given by the
+ * schema. Bytes past the payload are zero.
+ */
+void hildon_im_codec_encode (const Atom *atoms,
+                             HildonIMAtom atom,
+                             Window window,
+                             gconstpointer payload,
+                             XEvent *event);
+
+/**
+ * hildon_im_codec_decode:
+ * @atoms: the table hildon_im_protocol_get_atoms() returned for the display
+ * the event came from
+ * @event: a ClientMessage event
+ * @atom: location to store the #HildonIMAtom of the message
+ * @data: location to store the 20 data bytes; format 32 data is stored
+ * as five 32-bit values
+ *
+ * Returns: TRUE if @event is a protocol message in the format of the
+ * schema.
+ */
+gboolean hildon_im_codec_decode (const Atom *atoms,
+                                 const XClientMessageEvent *event,
+                                 HildonIMAtom *atom,
+                                 gpointer data);
+
+/**
+ * hildon_im_codec_set_data:
+ * @event: a ClientMessage event whose format is set
+ * @data: 20 data bytes; format 32 data as five 32-bit values
+ *
+ * Stores @data in @event. Xlib keeps format 32 data in longs, which are
+ * wider than 32 bits on 64-bit hosts.
+ */
+void hildon_im_codec_set_data (XClientMessageEvent *event,
+                               gconstpointer data);
+
+/**
+ * hildon_im_codec_get_data:
+ * @event: a ClientMessage event
+ * @data: location to store the 20 data bytes
+ *
+ * The reverse of hildon_im_codec_set_data().
+ */
+void hildon_im_codec_get_data (const XClientMessageEvent *event,
+                               gpointer data);
+
+/**
+ * hildon_im_codec_next_chunk:
+ * @text: a nul-terminated UTF-8 string
+ * @size: the size of the chunk field, at least 4
+ *
+ * Finds how much of @text goes into the next chunk of a message split
+ * over several ClientMessages: as much as fits in @size bytes, without
+ * splitting a character.
+ *
+ * Returns: the length of the chunk in bytes, 0 only for an empty @text
+ */
+gsize hildon_im_codec_next_chunk (const gchar *text,
+                                  gsize size);
+
+G_END_DECLS
+
+#endif /* ifndef HILDON_IM_CODEC_H_ */
@@ -26,6 +26,7 @@
  */
 
 #include <string.h>
+#include <unistd.h>
 #include <libintl.h>
 #include <gtk/gtk.h>
 #if GTK_CHECK_VERSION(3,0,0)
@@ -43,6 +44,12 @@
 #include "hildon-im-context.h"
 #include "hildon-im-gtk.h"
 #include "hildon-im-common.h"
+#include "hildon-im-capture.h"
+#include "hildon-im-codec.h"
+#include "hildon-im-reassembly.h"
+#include "hildon-im-ring.h"
+#include "hildon-im-state.h"
+#include "hildon-im-transport.h"
 
 #define HILDON_IM_DEFAULT_LAUNCH_DELAY 70
 
@@ -70,6 +77,61 @@
 /* Long-press feature */
 #define DEFAULT_LONG_PRESS_TIMEOUT 600
 
+/* How often messages that did not fit in the IM ring are retried (ms) */
+#define HILDON_IM_RING_RETRY_INTERVAL 20
+
+/* Longest time (ms) a message may wait in the outgoing queue while the
+   main loop is busy; 0 waits for the next poll however long it takes */
+#define HILDON_IM_QUEUE_DEADLINE 10
+
+/* Messages of the bulk lane sent per flush; the rest waits for the next
+   main loop iteration, so urgent messages queued meanwhile go first */
+#define HILDON_IM_BULK_LANE_BUDGET 8
+
+/* Surroundings sent to an IM that confirms them (HILDON_IM_CAP_ACK)
+   before the bulk lane waits for a confirmation, and how long (ms) it
+   waits before it assumes the confirmations were lost */
+#define HILDON_IM_SURROUNDING_IN_FLIGHT 1
+#define HILDON_IM_ACK_TIMEOUT 500
+
+/* Shortest time (ms) between two cursor rectangles sent to the IM */
+#define HILDON_IM_CURSOR_INTERVAL 50
+
+/* Flushes kept around until the X server has processed them, so messages
+   sent to an IM window that was already gone can be sent again */
+#define HILDON_IM_SENT_BATCHES_MAX 8
+
+/* Messages kept while there is no IM window to send them to */
+#define HILDON_IM_HELD_MAX 64
+
+/* How soon (ms) the state page is read again after the IM was found
+   stuck inside a write */
+#define HILDON_IM_STATE_STALL_RETRY 50
+
+/* Protocol features this context implements, see HildonIMCapabilities */
+#define HILDON_IM_CONTEXT_CAPABILITIES \
+  (HILDON_IM_CAP_SHM_RING | HILDON_IM_CAP_BULK | HILDON_IM_CAP_TRACE | \
+   HILDON_IM_CAP_ACK | HILDON_IM_CAP_FOCUS | HILDON_IM_CAP_REPLACE | \
+   HILDON_IM_CAP_PREEDIT | HILDON_IM_CAP_KEY_EVENTS | HILDON_IM_CAP_CURSOR | \
+   HILDON_IM_CAP_SELECTION | HILDON_IM_CAP_STATE_PAGE)
+
+#define HILDON_IM_PEER_INFO_KEY "hildon-im-peer-info"
+
+/* Largest piece of a bulk transfer written in one XChangeProperty;
+   larger payloads are streamed piece by piece */
+#define HILDON_IM_BULK_PIECE_SIZE 65536
+
+/* Initial and largest size of text reassembled from incoming chunks or
+   bulk pieces; anything larger is dropped */
+#define HILDON_IM_REASSEMBLY_INITIAL_SIZE 256
+#define HILDON_IM_REASSEMBLY_MAX (1024 * 1024)
+
+/* Key events whose trace stamp can still be matched with an echo */
+#define HILDON_IM_TRACE_PENDING 32
+
+/* Latency histogram buckets: below 1 ms, then doubling up to 1 s and more */
+#define HILDON_IM_LATENCY_BUCKETS 12
+
 static GtkIMContextClass *parent_class;
 static GType im_context_type = 0;
 
@@ -81,12 +143,234 @@ static HildonIMTrigger trigger = HILDON_IM_TRIGGER_UNKNOWN;
 static gboolean internal_reset = FALSE;
 static gboolean enter_on_focus_pending = FALSE;
 
+/* Shared-memory ring towards the IM. It is offered once per IM window
+   and only used after that window accepted it. im_ring_overflow keeps the
+   HildonIMQueuedEvents that did not fit, in order. */
+static HildonIMRing *im_ring = NULL;
+static gboolean im_ring_unavailable = FALSE;
+static Window im_ring_offered = None;
+static Window im_ring_peer = None;
+static GQueue im_ring_overflow = G_QUEUE_INIT;
+static guint im_ring_retry_id = 0;
+
+/* Modifier, option and autocap state shared with the IM, offered and
+   accepted like the ring. im_state_last is the IM's block as it was last
+   applied, im_state_seen its sequence number. */
+static HildonIMState *im_state = NULL;
+static gboolean im_state_unavailable = FALSE;
+static Window im_state_offered = None;
+static Window im_state_peer = None;
+static guint im_state_seen = 0;
+static HildonIMStateValues im_state_last;
+
+/* The modifier bits that travel through the state page */
+#define HILDON_IM_STATE_MODIFIERS \
+  (HILDON_IM_SHIFT_STICKY_MASK | HILDON_IM_SHIFT_LOCK_MASK | \
+   HILDON_IM_LEVEL_STICKY_MASK | HILDON_IM_LEVEL_LOCK_MASK)
+
+/* The IM on a display: its window, kept current from PropertyNotify on
+   the root window and DestroyNotify on the IM window, and what it
+   implements, read together with the window. The first read is only
+   collected when the IM window is first needed. */
+typedef struct
+{
+  GdkDisplay *display;
+  const Atom *atoms;
+  HildonIMPeerQuery *query;
+  Window im_window;
+  HildonIMCapabilities caps;
+  gboolean caps_valid;
+} HildonIMPeerInfo;
+
 #if GTK_CHECK_VERSION(3,0,0)
 static GtkIMContext *current_context = NULL;
 #endif
 
 typedef struct _HildonIMContext HildonIMContext;
 
+/* Outgoing messages are queued by priority. Key events, commits and
+   commands go out first; surrounding text and committed preedit echoes
+   can wait, see hildon_im_context_get_lane(). */
+typedef enum
+{
+  HILDON_IM_LANE_URGENT,
+  HILDON_IM_LANE_BULK,
+  HILDON_IM_NUM_LANES
+} HildonIMLane;
+
+/* Messages waiting for the next flush towards the IM */
+typedef struct
+{
+  HildonIMContext *context;
+  XEvent event;
+  gulong serial;
+  HildonIMLane lane;
+  gint64 queued;
+  /* Position among all queued messages, whichever lane they are in */
+  guint64 order;
+  /* Piece of a bulk payload, written to the client window's property
+     right before the HILDON_IM_BULK notification goes out */
+  gchar *property;
+  gsize property_length;
+  /* Already in the capture; a held message may be flushed again */
+  gboolean captured;
+} HildonIMQueuedEvent;
+
+/* A text payload on its way to the IM through a property of the client
+   window, see hildon_im_context_send_bulk() */
+typedef struct
+{
+  HildonIMAtom content;
+  GString *text;
+  gsize offset;
+  XEvent *trailer;
+} HildonIMBulkOut;
+
+static GQueue out_queue[HILDON_IM_NUM_LANES] = { G_QUEUE_INIT, G_QUEUE_INIT };
+static gint64 out_queue_since = 0;
+static guint64 out_queue_order = 0;
+static GSource *out_queue_source = NULL;
+/* Set while the whole bulk lane has to go out with the next flush */
+static gboolean out_queue_draining = FALSE;
+
+/* How much the bulk lane was held back by the urgent one or by an IM
+   that fell behind, and how many messages a newer one made redundant */
+typedef struct
+{
+  guint sent;
+  guint overtaken;
+  guint deferred_flushes;
+  guint blocked_flushes;
+  guint superseded;
+  gint64 wait_total;
+  gint64 wait_max;
+} HildonIMLaneStats;
+
+static HildonIMLaneStats bulk_lane_stats;
+
+/* Surroundings the IM has not confirmed yet, see HILDON_IM_CAP_ACK */
+static guint surrounding_unacked = 0;
+static gint64 surrounding_unacked_since = 0;
+
+/* State updates of which only the newest one still queued for a context
+   is worth sending */
+typedef enum
+{
+  HILDON_IM_SUPERSEDE_NONE,
+  HILDON_IM_SUPERSEDE_INPUT_MODE,
+  HILDON_IM_SUPERSEDE_SHIFT_LOCK,
+  HILDON_IM_SUPERSEDE_SHIFT_STICKY,
+  HILDON_IM_SUPERSEDE_MOD_LOCK,
+  HILDON_IM_SUPERSEDE_MOD_STICKY,
+  HILDON_IM_SUPERSEDE_CURSOR,
+  HILDON_IM_SUPERSEDE_SURROUNDING
+} HildonIMSupersede;
+
+/* Messages sent through the X server whose delivery is not confirmed yet,
+   one entry per flush, and messages waiting for a new IM window */
+typedef struct
+{
+  Display *display;
+  Window window;
+  gulong last_serial;
+  GQueue events;
+} HildonIMSentBatch;
+
+static GQueue sent_batches = G_QUEUE_INIT;
+static GQueue held_queue = G_QUEUE_INIT;
+
+/* How messages travel to and from the IM, see hildon_im_context_get_transport().
+   Contexts are looked up by client window, which maps to the context that
+   last got the focus on it, or else was last attached to it. */
+static HildonIMTransport *im_transport = NULL;
+static gboolean im_transport_is_x11 = TRUE;
+/* The X11 transport with its own sender thread, which is told the IM
+   window but has no request serials to track on GDK's connection */
+static gboolean im_transport_threaded = FALSE;
+static GHashTable *client_windows = NULL;
+
+/* One filter per client GdkWindow, however many contexts are attached to
+   it; messages go to the one client_windows holds for the window */
+#define HILDON_IM_WINDOW_FILTER_KEY "hildon-im-window-filter"
+
+typedef struct
+{
+  GdkWindow *window;
+  Window xid;
+  const Atom *atoms;
+  GSList *contexts;
+} HildonIMWindowFilter;
+
+#if !GTK_CHECK_VERSION(3,0,0)
+/* Request serial ranges whose X errors are ignored, oldest first, see
+   hildon_im_context_trap_pop_async(). A range still open has the last
+   serial HILDON_IM_ASYNC_TRAP_OPEN. Ranges are dropped once the server
+   is known to have processed them, since their errors have been seen
+   by then. */
+typedef struct
+{
+  Display *display;
+  gulong first;
+  gulong last;
+} HildonIMAsyncTrap;
+
+#define HILDON_IM_ASYNC_TRAP_OPEN G_MAXULONG
+
+static GArray *async_traps = NULL;
+static XErrorHandler previous_x_error_handler = NULL;
+#endif
+
+/* The context whose shadow state matches the IM, and how many commands
+   were skipped because of it */
+static HildonIMContext *shadow_owner = NULL;
+static guint suppressed_commands = 0;
+
+/* Opt-in capture of the traffic with the IM, see
+   hildon_im_context_get_capture() */
+static HildonIMCapture *capture = NULL;
+static gboolean capture_checked = FALSE;
+static guint32 last_context_id = 0;
+
+/* Latency tracing, see HildonIMTraceType. The hops are measured between
+   stamped messages and added up for all contexts. */
+typedef enum
+{
+  HILDON_IM_LATENCY_KEY_TO_IM,
+  HILDON_IM_LATENCY_IN_IM,
+  HILDON_IM_LATENCY_IM_TO_CONTEXT,
+  HILDON_IM_LATENCY_TO_COMMIT,
+  HILDON_IM_LATENCY_KEY_TO_COMMIT,
+  HILDON_IM_NUM_LATENCIES
+} HildonIMLatencyHop;
+
+typedef struct
+{
+  guint count;
+  gint64 total;
+  gint64 max;
+  guint buckets[HILDON_IM_LATENCY_BUCKETS];
+} HildonIMLatency;
+
+typedef struct
+{
+  guint32 seq;
+  gint64 sent;
+  gint64 received;
+} HildonIMTraceStamp;
+
+static const gchar *latency_names[HILDON_IM_NUM_LATENCIES] =
+{
+  "key to IM",
+  "in IM",
+  "IM to context",
+  "to commit",
+  "key to commit"
+};
+
+static HildonIMLatency latencies[HILDON_IM_NUM_LATENCIES];
+static HildonIMTraceStamp trace_pending[HILDON_IM_TRACE_PENDING];
+static guint32 trace_seq = 0;
+
 struct _HildonIMContext
 {
   GtkIMContext context;
@@ -97,15 +381,16 @@ struct _HildonIMContext
   GdkWindow *client_gdk_window;
   GtkWidget *client_gtk_widget;
   gboolean is_internal_widget;
-  
-  Window im_window;
+
+  /* Protocol atoms of the client window's display */
+  const Atom *atoms;
 
   HildonIMCommitMode commit_mode;
   HildonIMCommitMode previous_commit_mode;
 
   GString *preedit_buffer;
   /* we need the incoming preedit buffer because the message might be split */
-  GString *incoming_preedit_buffer;
+  HildonIMReassembly *incoming_preedit_buffer;
   /* keep the preedit's position on GtkTextView or GtkEditable */
   GtkTextMark *text_view_preedit_mark;
   gint editable_preedit_position;
@@ -118,6 +403,11 @@ struct _HildonIMContext
   gint client_changed_signal_handler;
   gint client_hide_signal_handler;
   gint client_copy_clipboard_signal_handler;
+  gint client_selection_signal_handler[2];
+  GtkTextBuffer *client_selection_buffer;
+
+  /* Whether the client has a selection as the IM was last told, or -1 */
+  gint selection_sent;
 
   /* State */
   gboolean last_internal_change;
@@ -134,7 +424,20 @@ struct _HildonIMContext
   gint prev_cursor_x;
   gint prev_cursor_y;
 
+  /* The cursor rectangle as last given by the client, and as last sent
+     to the IM in root coordinates */
+  GdkRectangle cursor_area;
+  GdkRectangle cursor_sent;
+  Window cursor_sent_window;
+  gint64 cursor_sent_time;
+  guint cursor_timeout_id;
+
   gchar *surrounding;
+  HildonIMReassembly *incoming_surrounding;
+  HildonIMReassembly *incoming_replace;
+  /* HILDON_IM_PREEDIT chunks, apart from the inserts they may interleave
+     with */
+  HildonIMReassembly *incoming_preedit;
   guint  prev_surrounding_hash;
   guint  prev_surrounding_cursor_pos;
 
@@ -149,6 +452,35 @@ struct _HildonIMContext
   GdkEventKey *long_press_last_key_event;
 
   gboolean last_was_shift_backspace;
+
+  /* Bulk transfers through properties on the client window. bulk_out
+     holds the outgoing HildonIMBulkOuts, oldest first. While
+     bulk_out_pending is set, the IM has yet to delete the property of
+     the bulk_out_pending_content atom, so nothing else is written. */
+  GQueue bulk_out;
+  gboolean bulk_out_pending;
+  HildonIMAtom bulk_out_pending_content;
+  Window bulk_out_im_window;
+  gboolean bulk_out_events_added;
+  HildonIMReassembly *bulk_in;
+
+  /* Shadow of what the IM was last told by this context, used to skip
+     commands that would not change anything on the IM side */
+  Window shadow_im_window;
+  HildonIMInternalModifierMask shadow_known;
+  HildonIMInternalModifierMask shadow_mask;
+
+  /* Identifies the context in captured traffic */
+  guint32 id;
+
+  /* When the key event being filtered arrived, and the trace stamp of
+     the next message from the IM */
+  gint64 keypress_time;
+  gboolean trace_in_valid;
+  gboolean trace_in_handling;
+  guint32 trace_in_seq;
+  HildonIMAtom trace_in_atom;
+  gint64 trace_in_arrived;
 };
 
 /* Initialisation/finalisation functions */
@@ -203,6 +535,8 @@ static void       hildon_im_context_send_surrounding    (HildonIMContext*
                                                          self,
                                                          gboolean
                                                          send_full_line);
+static void       hildon_im_context_update_cursor       (HildonIMContext *self,
+                                                         GdkRectangle *area);
 static void       hildon_im_context_send_committed_preedit(HildonIMContext *self,
                                                            gchar* committed_preedit);
 static void       hildon_im_context_send_key_event      (HildonIMContext *self,
@@ -221,14 +555,24 @@ static void       hildon_im_context_set_use_preedit     (GtkIMContext *context,
 
 /* Useful functions */
 static Window          get_window_id                    (Atom window_atom);
+static Window          hildon_im_context_get_im_window  (GdkDisplay *display);
+static void            hildon_im_context_resend_lost    (Display *display,
+                                                         Window window,
+                                                         gulong serial);
+static void            hildon_im_context_release_held   (void);
 
 static GdkFilterReturn client_message_filter            (GdkXEvent *xevent,
                                                          GdkEvent *event,
-                                                         HildonIMContext *self);
+                                                         gpointer data);
 /* this takes care of notifying changes in the buffer */
 static void         set_preedit_buffer                  (HildonIMContext *self,
                                                          const gchar* s);
 /* commits text */
+static void hildon_im_context_trace_commit (HildonIMContext *self);
+static void hildon_im_context_replace_range (HildonIMContext *self,
+                                             gint start,
+                                             gint end,
+                                             const gchar *text);
 static gboolean     commit_text                         (HildonIMContext *self,
                                                          const gchar* s);
 
@@ -240,6 +584,51 @@ static void hildon_im_context_set_mask_state (HildonIMContext *self,
                                               gboolean was_press_and_release);
 
 static void hildon_im_context_send_event(HildonIMContext *self, XEvent *event);
+static void hildon_im_context_shadow_note(HildonIMContext *self,
+                                          HildonIMInternalModifierMask bits,
+                                          gboolean set);
+static gboolean hildon_im_context_ring_send (HildonIMQueuedEvent *queued);
+static void hildon_im_queued_event_free (HildonIMQueuedEvent *queued);
+static void hildon_im_context_offer_ring (HildonIMContext *self);
+static void hildon_im_context_offer_state (HildonIMContext *self);
+static gboolean hildon_im_context_state_publish (HildonIMContext *self);
+static gboolean hildon_im_context_state_sync (void);
+static void hildon_im_context_state_detach (void);
+static gboolean hildon_im_context_send_focus (HildonIMContext *self,
+                                              HildonIMCommand cmd);
+static void hildon_im_context_ring_doorbell (void);
+static void hildon_im_context_ring_detach (void);
+#if !GTK_CHECK_VERSION(3,0,0)
+static int hildon_im_context_x_error (Display *display,
+                                      XErrorEvent *error);
+#endif
+static void hildon_im_context_trap_push_async (Display *display);
+static HildonIMTransport *hildon_im_context_get_transport (void);
+static void hildon_im_context_use_transport (HildonIMTransport *transport);
+static void hildon_im_context_transport_closed (HildonIMTransport *transport,
+                                                gpointer user_data);
+static HildonIMCapture *hildon_im_context_get_capture (void);
+static void hildon_im_context_latency_add (HildonIMLatencyHop hop,
+                                           gint64 usec);
+static void hildon_im_context_latency_dump (void);
+static void hildon_im_context_lane_dump (void);
+static HildonIMCapabilities hildon_im_context_get_peer_caps (HildonIMContext *self);
+static void hildon_im_context_flush_queue (void);
+static gboolean hildon_im_context_changes_client (HildonIMQueuedEvent *queued);
+static void hildon_im_context_queues_free (void);
+static void hildon_im_context_trap_pop_async (Display *display);
+static gboolean hildon_im_context_send_bulk (HildonIMContext *self,
+                                             HildonIMAtom content,
+                                             const gchar *text,
+                                             XEvent *trailer);
+static void hildon_im_context_bulk_write_piece (HildonIMContext *self);
+static void hildon_im_context_bulk_out_clear (HildonIMContext *self);
+static void hildon_im_context_send_event_full (HildonIMContext *self,
+                                               XEvent *event,
+                                               const gchar *property,
+                                               gsize length);
+static void hildon_im_context_receive_bulk (HildonIMContext *self,
+                                            HildonIMBulkMessage *msg);
 
 static gboolean key_pressed (HildonIMContext *context, GdkEventKey *event);
 
@@ -296,6 +685,12 @@ hildon_im_context_register_type (GTypeModule *module )
                                                   "HildonIMContext",
                                                   &im_context_info, 0);
   }
+
+  /* The atoms are needed by the first context */
+  if (gdk_display_get_default() != NULL)
+  {
+    hildon_im_protocol_prefetch_atoms(gdk_display_get_default());
+  }
 }
 
 static void
@@ -317,8 +712,22 @@ hildon_im_context_finalize(GObject *obj)
     launch_delay_timeout_id = 0;
   }
 
+  if (imc->cursor_timeout_id != 0)
+  {
+    g_source_remove(imc->cursor_timeout_id);
+  }
+
   g_string_free (imc->preedit_buffer, TRUE);
-  g_string_free (imc->incoming_preedit_buffer, TRUE);
+  hildon_im_reassembly_free (imc->incoming_preedit_buffer);
+  hildon_im_reassembly_free (imc->incoming_surrounding);
+  hildon_im_reassembly_free (imc->incoming_replace);
+  hildon_im_reassembly_free (imc->incoming_preedit);
+  hildon_im_reassembly_free (imc->bulk_in);
+
+  if (shadow_owner == imc)
+  {
+    shadow_owner = NULL;
+  }
 
   if (imc->long_press_last_key_event != NULL)
   {
@@ -568,6 +977,8 @@ hildon_im_context_class_init (HildonIMContextClass *im_context_class)
 static void
 hildon_im_context_class_finalize(HildonIMContextClass *im_context_class)
 {
+  GSList *displays;
+  GSList *link;
   gint signal_id;
 
   signal_id = g_signal_lookup("grab-focus", GTK_TYPE_WIDGET);
@@ -575,6 +986,59 @@ hildon_im_context_class_finalize(HildonIMContextClass *im_context_class)
 
   signal_id = g_signal_lookup("unmap-event", GTK_TYPE_WIDGET);
   g_signal_remove_emission_hook(signal_id, unmap_hook_id);
+
+  /* The IM window filters must not outlive the module */
+  displays = gdk_display_manager_list_displays(gdk_display_manager_get());
+  for (link = displays; link != NULL; link = link->next)
+  {
+    g_object_set_data(G_OBJECT(link->data), HILDON_IM_PEER_INFO_KEY, NULL);
+  }
+  g_slist_free(displays);
+
+#if !GTK_CHECK_VERSION(3,0,0)
+  /* Only put the previous handler back if ours is still the one
+     installed; a handler set after ours may chain to it, and then ours
+     has to stay, ignoring nothing any more */
+  if (previous_x_error_handler != NULL)
+  {
+    XErrorHandler current = XSetErrorHandler(previous_x_error_handler);
+
+    if (current != hildon_im_context_x_error)
+    {
+      XSetErrorHandler(current);
+      g_warning("Another X error handler was installed over the IM one");
+    }
+    else
+    {
+      previous_x_error_handler = NULL;
+    }
+
+    g_array_set_size(async_traps, 0);
+  }
+#endif
+
+  hildon_im_capture_free(capture);
+  capture = NULL;
+  capture_checked = FALSE;
+
+  /* Nothing of the module may stay attached to the main loop */
+  if (launch_delay_timeout_id != 0)
+  {
+    g_source_remove(launch_delay_timeout_id);
+    launch_delay_timeout_id = 0;
+  }
+
+  hildon_im_context_queues_free();
+
+  /* The statistics cover the whole life of the module */
+  g_debug ("%u redundant IM commands suppressed", suppressed_commands);
+  hildon_im_context_latency_dump ();
+  hildon_im_context_lane_dump ();
+
+  hildon_im_transport_free(im_transport);
+  im_transport = NULL;
+  im_transport_is_x11 = TRUE;
+  im_transport_threaded = FALSE;
 }
 
 GtkIMContext *
@@ -583,45 +1047,224 @@ hildon_im_context_new(void)
   return g_object_new(im_context_type, NULL);
 }
 
-/* Retrieves the X window id of the IM */
-static Window
-get_window_id(Atom window_atom)
+/* Starts following the IM window through X events: the IM publishes its
+   window and capabilities on the root window, and a DestroyNotify tells
+   us right away when it goes away */
+static void
+hildon_im_peer_info_select_window (HildonIMPeerInfo *info, Window window,
+                                   HildonIMCapabilities caps)
+{
+  if (window != None)
+  {
+    /* Not waited for: a window that is already gone again has left a
+       stale root property, which the next IM replaces */
+    hildon_im_context_trap_push_async(GDK_DISPLAY_XDISPLAY(info->display));
+    XSelectInput(GDK_DISPLAY_XDISPLAY(info->display), window,
+                 StructureNotifyMask);
+    hildon_im_context_trap_pop_async(GDK_DISPLAY_XDISPLAY(info->display));
+  }
+  else
+  {
+    g_warning("Unable to get the window id\n");
+  }
+
+  info->im_window = window;
+  info->caps = caps;
+  info->caps_valid = TRUE;
+
+  /* A new IM does not confirm what its predecessor was sent */
+  surrounding_unacked = 0;
+
+  if (window != None)
+  {
+    hildon_im_context_release_held();
+  }
+}
+
+/* Collects the pending read of the IM window, if any */
+static void
+hildon_im_peer_info_sync (HildonIMPeerInfo *info)
 {
-  Window result = None;
-  unsigned long n=0;
-  unsigned long extra=0;
-  gint format=0;
-  gint status=0;
+  HildonIMCapabilities caps;
+  Window window;
 
-  Atom realType;
-  union
+  if (info->query != NULL)
   {
-    Window *win;
-    unsigned char *val;
-  } value;
+    window = hildon_im_protocol_query_peer_finish(info->query, &caps, NULL);
+    info->query = NULL;
+    hildon_im_peer_info_select_window(info, window, caps);
+  }
+}
 
-  gdk_error_trap_push();
-  status = XGetWindowProperty(gdk_x11_get_default_xdisplay (),
-                              GDK_ROOT_WINDOW(),
-                              window_atom, 0L, 4L, 0,
-                              XA_WINDOW, &realType, &format,
-                              &n, &extra, (unsigned char **) &value.val);
+static GdkFilterReturn
+hildon_im_peer_info_filter (GdkXEvent *xevent, GdkEvent *event, gpointer data)
+{
+  HildonIMPeerInfo *info = data;
+  XEvent *xev = (XEvent *) xevent;
 
-  if (gdk_error_trap_pop() == 0 &&
-      (status == Success && realType == XA_WINDOW
-      && format == HILDON_IM_WINDOW_ID_FORMAT && n == 1 && value.win != None))
+  if (xev->xany.display != GDK_DISPLAY_XDISPLAY(info->display))
   {
-    result = value.win[0];
-    XFree(value.val);
+    return GDK_FILTER_CONTINUE;
   }
-  else
+
+  if (xev->type == PropertyNotify &&
+      xev->xproperty.window == DefaultRootWindow(xev->xany.display))
   {
-    g_warning("Unable to get the window id\n");
+    if (xev->xproperty.atom == info->atoms[HILDON_IM_WINDOW])
+    {
+      /* A read still pending from startup may predate this change */
+      if (info->query != NULL)
+      {
+        HildonIMCapabilities caps;
+
+        hildon_im_protocol_query_peer_finish(info->query, &caps, NULL);
+      }
+
+      info->query = hildon_im_protocol_query_peer(info->display);
+      hildon_im_peer_info_sync(info);
+    }
+    else if (xev->xproperty.atom ==
+             info->atoms[HILDON_IM_PROTOCOL_VERSION])
+    {
+      info->caps_valid = FALSE;
+    }
   }
+  else if (xev->type == DestroyNotify &&
+           xev->xdestroywindow.window != None &&
+           xev->xdestroywindow.window == info->im_window)
+  {
+    if (im_ring_peer == info->im_window || im_ring_offered == info->im_window)
+    {
+      hildon_im_context_ring_detach();
+    }
 
-  return result;
+    if (im_state_peer == info->im_window ||
+        im_state_offered == info->im_window)
+    {
+      hildon_im_context_state_detach();
+    }
+
+    /* Everything the server processed after the destruction failed */
+    hildon_im_context_resend_lost(xev->xany.display, info->im_window,
+                                  xev->xany.serial);
+
+    info->im_window = None;
+    info->caps_valid = FALSE;
+  }
+
+  return GDK_FILTER_CONTINUE;
+}
+
+static void
+hildon_im_peer_info_free (HildonIMPeerInfo *info)
+{
+  HildonIMCapabilities caps;
+
+  gdk_window_remove_filter(NULL, hildon_im_peer_info_filter, info);
+
+  if (info->query != NULL)
+  {
+    hildon_im_protocol_query_peer_finish(info->query, &caps, NULL);
+  }
+
+  g_free(info);
+}
+
+static HildonIMPeerInfo *
+hildon_im_peer_info_get (GdkDisplay *display)
+{
+  HildonIMPeerInfo *info;
+  GdkWindow *root;
+
+  info = g_object_get_data(G_OBJECT(display), HILDON_IM_PEER_INFO_KEY);
+  if (info != NULL)
+  {
+    return info;
+  }
+
+  info = g_new0(HildonIMPeerInfo, 1);
+  info->display = display;
+  info->atoms = hildon_im_protocol_get_atoms(display);
+  info->im_window = None;
+  g_object_set_data_full(G_OBJECT(display), HILDON_IM_PEER_INFO_KEY,
+                         info, (GDestroyNotify) hildon_im_peer_info_free);
+
+  /* The filter is global, the IM window is not known to GDK */
+  gdk_window_add_filter(NULL, hildon_im_peer_info_filter, info);
+
+  root = gdk_screen_get_root_window(gdk_display_get_default_screen(display));
+  gdk_window_set_events(root,
+                        gdk_window_get_events(root) | GDK_PROPERTY_CHANGE_MASK);
+
+  /* Selected before the read, so no change of the window is missed */
+  info->query = hildon_im_protocol_query_peer(display);
+
+  return info;
+}
+
+/* The display of the client window, whose IM the context talks to */
+static GdkDisplay *
+hildon_im_context_get_display (HildonIMContext *self)
+{
+  if (self->client_gdk_window != NULL)
+  {
+    return gdk_window_get_display(self->client_gdk_window);
+  }
+
+  return gdk_display_get_default();
+}
+
+/* Returns the current IM window of a display without a round trip to
+   the X server, apart from collecting the first read. NULL stands for
+   the default display, the only one the shared-memory ring and the
+   state page are used on. */
+static Window
+hildon_im_context_get_im_window (GdkDisplay *display)
+{
+  HildonIMPeerInfo *info;
+
+  if (display == NULL)
+    display = gdk_display_get_default();
+
+  info = hildon_im_peer_info_get(display);
+  hildon_im_peer_info_sync(info);
+
+  return info->im_window;
+}
+
+/* Returns the IM window of the context's display */
+static Window
+hildon_im_context_get_peer_window (HildonIMContext *self)
+{
+  return hildon_im_context_get_im_window(hildon_im_context_get_display(self));
 }
 
+/* Returns the protocol features of the IM the context talks to. They are
+   read from the root window once per IM window, and again when the IM
+   publishes new ones. */
+static HildonIMCapabilities
+hildon_im_context_get_peer_caps (HildonIMContext *self)
+{
+  HildonIMPeerInfo *info =
+    hildon_im_peer_info_get(hildon_im_context_get_display(self));
+
+  hildon_im_peer_info_sync(info);
+
+  if (info->im_window == None)
+  {
+    return 0;
+  }
+
+  if (!info->caps_valid)
+  {
+    info->caps =
+      hildon_im_protocol_read_capabilities(GDK_DISPLAY_XDISPLAY(info->display),
+                                           NULL);
+    info->caps_valid = TRUE;
+  }
+
+  return info->caps;
+}
 
 static void
 hildon_get_input_mode(HildonIMContext *self, HildonGtkInputMode *input_mode,
@@ -728,15 +1371,33 @@ hildon_im_context_init(HildonIMContext *self)
   self->prev_cursor_y = None;
   self->prev_cursor_x = None;
   self->has_focus = FALSE;
+  self->selection_sent = -1;
+  self->id = ++last_context_id;
   self->surrounding = g_strdup("");
   self->preedit_buffer = g_string_new ("");
   self->show_preedit = FALSE;
   self->space_after_commit = FALSE;
   self->is_internal_widget = FALSE;
-  self->im_window = get_window_id(hildon_im_protocol_get_atom(HILDON_IM_WINDOW));
+  self->atoms = hildon_im_protocol_get_atoms(gdk_display_get_default());
+  /* Starts reading the IM window, collected once the first message is
+     sent */
+  hildon_im_peer_info_get(gdk_display_get_default());
   self->commit_mode = HILDON_IM_COMMIT_REDIRECT;
   self->previous_commit_mode = self->commit_mode;
-  self->incoming_preedit_buffer = g_string_new ("");
+  self->incoming_preedit_buffer =
+    hildon_im_reassembly_new (HILDON_IM_REASSEMBLY_INITIAL_SIZE,
+                              HILDON_IM_REASSEMBLY_MAX);
+  self->incoming_surrounding =
+    hildon_im_reassembly_new (HILDON_IM_REASSEMBLY_INITIAL_SIZE,
+                              HILDON_IM_REASSEMBLY_MAX);
+  self->incoming_replace =
+    hildon_im_reassembly_new (HILDON_IM_REASSEMBLY_INITIAL_SIZE,
+                              HILDON_IM_REASSEMBLY_MAX);
+  self->incoming_preedit =
+    hildon_im_reassembly_new (HILDON_IM_REASSEMBLY_INITIAL_SIZE,
+                              HILDON_IM_REASSEMBLY_MAX);
+  self->bulk_in = hildon_im_reassembly_new (HILDON_IM_REASSEMBLY_INITIAL_SIZE,
+                                            HILDON_IM_REASSEMBLY_MAX);
 
   self->auto_upper_enabled = FALSE;
   self->auto_upper = FALSE;
@@ -810,10 +1471,32 @@ commit_text (HildonIMContext *self, const gchar* s)
     return FALSE;
 
   g_signal_emit_by_name(self, "commit", s);
+  hildon_im_context_trace_commit(self);
 
   return TRUE;
 }
 
+/* The first commit caused by a stamped message ends its trace */
+static void
+hildon_im_context_trace_commit (HildonIMContext *self)
+{
+  if (self->trace_in_handling)
+  {
+    HildonIMTraceStamp *stamp =
+      &trace_pending[self->trace_in_seq % HILDON_IM_TRACE_PENDING];
+    gint64 now = g_get_monotonic_time();
+
+    hildon_im_context_latency_add(HILDON_IM_LATENCY_TO_COMMIT,
+                                  now - self->trace_in_arrived);
+    if (self->trace_in_seq != 0 && stamp->seq == self->trace_in_seq)
+      hildon_im_context_latency_add(HILDON_IM_LATENCY_KEY_TO_COMMIT,
+                                    now - stamp->sent);
+
+    self->trace_in_valid = FALSE;
+    self->trace_in_handling = FALSE;
+  }
+}
+
 static void
 set_preedit_buffer (HildonIMContext *self, const gchar* s)
 {
@@ -941,66 +1624,77 @@ static void
 hildon_im_clipboard_copied(HildonIMContext *self)
 {
   XEvent ev;
-  gint xerror;
-  
-  memset(&ev, 0, sizeof(ev));
-  ev.xclient.type = ClientMessage;
-  ev.xclient.window = self->im_window;
-  ev.xclient.message_type =
-    hildon_im_protocol_get_atom( HILDON_IM_CLIPBOARD_COPIED );
-  ev.xclient.format = HILDON_IM_CLIPBOARD_FORMAT;
 
-  gdk_error_trap_push();
-  XSendEvent(gdk_x11_get_default_xdisplay (), self->im_window, False, 0, &ev);
+  hildon_im_codec_encode(self->atoms, HILDON_IM_CLIPBOARD_COPIED,
+                         hildon_im_context_get_peer_window(self), NULL, &ev);
+
+  hildon_im_context_send_event(self, &ev);
+}
 
-  xerror = gdk_error_trap_pop();
-  if (xerror)
+static gboolean
+hildon_im_context_has_selection(HildonIMContext *self)
+{
+#ifdef MAEMO_CHANGES
+  return hildon_gtk_im_context_has_selection(GTK_IM_CONTEXT(self));
+#else
+  if (GTK_IS_TEXT_VIEW(self->client_gtk_widget))
   {
-    if (xerror == BadWindow)
-    {
-      self->im_window = get_window_id(hildon_im_protocol_get_atom(HILDON_IM_WINDOW));
-      ev.xclient.window = self->im_window;
-      XSendEvent(gdk_x11_get_default_xdisplay (), self->im_window, False, 0, &ev);
-    }
-    else
-    {
-      g_warning("Received the X error %d\n", xerror);
-    }
+    return gtk_text_buffer_get_has_selection(get_buffer(self->client_gtk_widget));
+  }
+
+  if (GTK_IS_EDITABLE(self->client_gtk_widget))
+  {
+    return gtk_editable_get_selection_bounds(GTK_EDITABLE(self->client_gtk_widget),
+                                             NULL, NULL);
   }
+
+  return FALSE;
+#endif
 }
 
 static void
 hildon_im_clipboard_selection_query(HildonIMContext *self)
 {
+  HildonIMClipboardSelectionReplyMessage msg;
   XEvent ev;
-  gint xerror;
-  
-  memset(&ev, 0, sizeof(ev));
-  ev.xclient.type = ClientMessage;
-  ev.xclient.window = self->im_window;
-  ev.xclient.message_type =
-    hildon_im_protocol_get_atom( HILDON_IM_CLIPBOARD_SELECTION_REPLY );
-  ev.xclient.format = HILDON_IM_CLIPBOARD_SELECTION_REPLY_FORMAT;
-#ifdef MAEMO_CHANGES
-  ev.xclient.data.l[0] = hildon_gtk_im_context_has_selection(GTK_IM_CONTEXT(self));
-#endif
 
-  gdk_error_trap_push();
-  XSendEvent(gdk_x11_get_default_xdisplay (), self->im_window, False, 0, &ev);
+  msg.has_selection = hildon_im_context_has_selection(self);
+  self->selection_sent = msg.has_selection;
 
-  xerror = gdk_error_trap_pop();
-  if (xerror)
+  hildon_im_codec_encode(self->atoms, HILDON_IM_CLIPBOARD_SELECTION_REPLY,
+                         hildon_im_context_get_peer_window(self), &msg, &ev);
+
+  hildon_im_context_send_event(self, &ev);
+}
+
+/* Tells an IM that takes pushed selection state when the client got or
+   lost its selection */
+static void
+hildon_im_context_selection_changed(HildonIMContext *self)
+{
+  if (!self->has_focus || self->is_internal_widget ||
+      !(hildon_im_context_get_peer_caps(self) & HILDON_IM_CAP_SELECTION))
   {
-    if (xerror == BadWindow)
-    {
-      self->im_window = get_window_id(hildon_im_protocol_get_atom(HILDON_IM_WINDOW));
-      ev.xclient.window = self->im_window;
-      XSendEvent(gdk_x11_get_default_xdisplay (), self->im_window, False, 0, &ev);
-    }
-    else
-    {
-      g_warning("Received the X error %d\n", xerror);
-    }
+    return;
+  }
+
+  if (self->selection_sent == (gint) hildon_im_context_has_selection(self))
+    return;
+
+  hildon_im_clipboard_selection_query(self);
+}
+
+static void
+hildon_im_context_selection_mark_set(GtkTextBuffer *buffer,
+                                     GtkTextIter *location,
+                                     GtkTextMark *mark,
+                                     HildonIMContext *self)
+{
+  /* Most marks, like the preedit one, have nothing to do with it */
+  if (mark == gtk_text_buffer_get_insert(buffer) ||
+      mark == gtk_text_buffer_get_selection_bound(buffer))
+  {
+    hildon_im_context_selection_changed(self);
   }
 }
 
@@ -1342,27 +2036,99 @@ hildon_im_context_clear_selection(HildonIMContext *self)
   }
 }
 
+/* Replaces the characters from @start to @end, counted from the cursor,
+   with @text. GTK+ text widgets take it as one edit; anything else gets
+   delete-surrounding and a commit. */
 static void
-hildon_im_context_do_backspace (HildonIMContext *self)
+hildon_im_context_replace_range (HildonIMContext *self,
+                                 gint start,
+                                 gint end,
+                                 const gchar *text)
 {
-  if (self->commit_mode == HILDON_IM_COMMIT_REDIRECT &&
-      GTK_IS_TEXT_VIEW(self->client_gtk_widget))
+  if (end < start)
   {
-    GtkTextBuffer *buffer;
-    GtkTextIter iter;
+    return;
+  }
 
-    buffer = get_buffer(self->client_gtk_widget);
-    gtk_text_buffer_get_iter_at_mark(buffer, &iter,
+  set_preedit_buffer (self, NULL);
+
+  if (GTK_IS_TEXT_VIEW(self->client_gtk_widget))
+  {
+    GtkTextView *text_view = GTK_TEXT_VIEW(self->client_gtk_widget);
+    GtkTextBuffer *buffer = get_buffer(self->client_gtk_widget);
+    GtkTextIter range_start, range_end;
+    gint cursor;
+
+    gtk_text_buffer_get_iter_at_mark(buffer, &range_start,
                                      gtk_text_buffer_get_insert(buffer));
-    gtk_text_buffer_backspace(buffer, &iter, TRUE, TRUE);
+    cursor = gtk_text_iter_get_offset(&range_start);
+
+    gtk_text_buffer_get_iter_at_offset(buffer, &range_start,
+                                       MAX(cursor + start, 0));
+    gtk_text_buffer_get_iter_at_offset(buffer, &range_end,
+                                       MAX(cursor + end, 0));
+
+    gtk_text_buffer_begin_user_action(buffer);
+    gtk_text_buffer_delete_interactive(buffer, &range_start, &range_end,
+                                       gtk_text_view_get_editable(text_view));
+    gtk_text_buffer_insert_interactive(buffer, &range_start, text, -1,
+                                       gtk_text_view_get_editable(text_view));
+    gtk_text_buffer_place_cursor(buffer, &range_start);
+    gtk_text_buffer_end_user_action(buffer);
   }
-  else if (self->commit_mode == HILDON_IM_COMMIT_REDIRECT &&
-           GTK_IS_EDITABLE(self->client_gtk_widget))
+  else if (GTK_IS_EDITABLE(self->client_gtk_widget))
   {
-    gint position = gtk_editable_get_position(GTK_EDITABLE(self->client_gtk_widget));
-    gtk_editable_delete_text(GTK_EDITABLE(self->client_gtk_widget),
-                             position - 1, position);
-  }
+    GtkEditable *editable = GTK_EDITABLE(self->client_gtk_widget);
+    gint cursor;
+
+    if (!gtk_editable_get_editable(editable))
+    {
+      return;
+    }
+
+    cursor = gtk_editable_get_position(editable);
+    start = MAX(cursor + start, 0);
+
+    gtk_editable_delete_text(editable, start, MAX(cursor + end, 0));
+    gtk_editable_insert_text(editable, text, strlen(text), &start);
+    gtk_editable_set_position(editable, start);
+  }
+  else
+  {
+    if (end > start)
+    {
+      gtk_im_context_delete_surrounding(GTK_IM_CONTEXT(self), start,
+                                        end - start);
+    }
+
+    commit_text(self, text);
+    return;
+  }
+
+  hildon_im_context_trace_commit(self);
+}
+
+static void
+hildon_im_context_do_backspace (HildonIMContext *self)
+{
+  if (self->commit_mode == HILDON_IM_COMMIT_REDIRECT &&
+      GTK_IS_TEXT_VIEW(self->client_gtk_widget))
+  {
+    GtkTextBuffer *buffer;
+    GtkTextIter iter;
+
+    buffer = get_buffer(self->client_gtk_widget);
+    gtk_text_buffer_get_iter_at_mark(buffer, &iter,
+                                     gtk_text_buffer_get_insert(buffer));
+    gtk_text_buffer_backspace(buffer, &iter, TRUE, TRUE);
+  }
+  else if (self->commit_mode == HILDON_IM_COMMIT_REDIRECT &&
+           GTK_IS_EDITABLE(self->client_gtk_widget))
+  {
+    gint position = gtk_editable_get_position(GTK_EDITABLE(self->client_gtk_widget));
+    gtk_editable_delete_text(GTK_EDITABLE(self->client_gtk_widget),
+                             position - 1, position);
+  }
   else
   {
     hildon_im_context_send_fake_key(self, GDK_BackSpace, TRUE);
@@ -1403,236 +2169,523 @@ hildon_im_context_do_del (HildonIMContext *self)
   }
 }
 
-/* Filter function to intercept and process XClientMessages */
-static GdkFilterReturn
-client_message_filter(GdkXEvent *xevent,GdkEvent *event,
-                      HildonIMContext *self)
+/* Processes one message from the IM, whichever transport it came over.
+   Returns TRUE if it was meant for the context. */
+static gboolean
+hildon_im_context_handle_message (HildonIMContext *self,
+                                  const HildonIMTransportMessage *message)
 {
-  GdkFilterReturn result = GDK_FILTER_CONTINUE;
-  XEvent *xe = (XEvent *)xevent;
+  gboolean handled = FALSE;
 
-  g_return_val_if_fail(HILDON_IS_IM_CONTEXT(self), GDK_FILTER_CONTINUE);
+  if (hildon_im_context_get_capture() != NULL)
+  {
+    hildon_im_capture_record(capture, HILDON_IM_CAPTURE_IN, self->id,
+                             message->atom, message->format, message->data);
+  }
+
+  self->trace_in_handling = self->trace_in_valid &&
+                            message->atom == self->trace_in_atom;
+
+  if (message->atom == HILDON_IM_INSERT_UTF8
+      && message->format == HILDON_IM_INSERT_UTF8_FORMAT)
+  {
+    HildonIMInsertUtf8Message *msg = (HildonIMInsertUtf8Message *) message->data;
+    gchar text[HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE + 1];
 
+    /* A chunk that fills the whole field has no terminating nul */
+    memcpy(text, msg->utf8_str, sizeof(msg->utf8_str));
+    text[sizeof(msg->utf8_str)] = '\0';
 
-  if (xe->type == DestroyNotify)
-  { 
-    self->client_gdk_window = NULL;
+    hildon_im_context_insert_utf8( self, msg->msg_flag, text );
+    handled = TRUE;
   }
-  else if (xe->type == ClientMessage)
+  else if (message->atom == HILDON_IM_COM
+      && message->format == HILDON_IM_COM_FORMAT)
   {
-    XClientMessageEvent *cme = xevent;
+    HildonIMComMessage *msg = (HildonIMComMessage *) message->data;
 
-    if (cme->message_type == hildon_im_protocol_get_atom(HILDON_IM_INSERT_UTF8)
-        && cme->format == HILDON_IM_INSERT_UTF8_FORMAT)
-    {
-      HildonIMInsertUtf8Message *msg = (HildonIMInsertUtf8Message *)&cme->data;
+    /* if autocap was suddenly deactivated, cleanup shift stickiness */
+    if ( (! (msg->options & HILDON_IM_AUTOCASE)) &&
+         (self->options & HILDON_IM_AUTOCASE) )
+      {
+        self->mask &= ~HILDON_IM_SHIFT_STICKY_MASK;
+        hildon_im_context_send_command (self, HILDON_IM_SHIFT_UNSTICKY);
+      }
 
-      hildon_im_context_insert_utf8( self, msg->msg_flag, msg->utf8_str );
-      result = GDK_FILTER_REMOVE;
-    }
-    else if (cme->message_type == hildon_im_protocol_get_atom(HILDON_IM_COM)
-        && cme->format == HILDON_IM_COM_FORMAT)
-    {
-      HildonIMComMessage *msg = (HildonIMComMessage *)&cme->data;
+    self->options = msg->options;
 
-      /* if autocap was suddenly deactivated, cleanup shift stickiness */
-      if ( (! (msg->options & HILDON_IM_AUTOCASE)) &&
-           (self->options & HILDON_IM_AUTOCASE) )
+    switch(msg->type)
+    {
+      case HILDON_IM_CONTEXT_WIDGET_CHANGED:
+        self->mask = 0;
+        /* The IM reset itself, whatever the shadow says */
+        self->shadow_known = 0;
+        break;
+      case HILDON_IM_CONTEXT_ENTER_ON_FOCUS:
+        enter_on_focus_pending = TRUE;
+        break;
+      case HILDON_IM_CONTEXT_CONFIRM_SENTENCE_START:
+        hildon_im_context_check_sentence_start(self);
+        break;
+      case HILDON_IM_CONTEXT_HANDLE_TAB:
+        hildon_im_context_send_fake_key(self, GDK_Tab, TRUE);
+        hildon_im_context_send_fake_key(self, GDK_Tab, FALSE);
+        break;
+      case HILDON_IM_CONTEXT_HANDLE_BACKSPACE:
+        hildon_im_context_do_backspace (self);
+        break;
+      case HILDON_IM_CONTEXT_HANDLE_SPACE:
+        hildon_im_context_insert_utf8(self, HILDON_IM_MSG_CONTINUE, " ");
+        break;
+      case HILDON_IM_CONTEXT_BUFFERED_MODE:
+        set_preedit_buffer (self, NULL);
+        self->commit_mode = HILDON_IM_COMMIT_BUFFERED;
+        break;
+      case HILDON_IM_CONTEXT_DIRECT_MODE:
+        set_preedit_buffer (self, NULL);
+        self->commit_mode = HILDON_IM_COMMIT_DIRECT;
+        break;
+      case HILDON_IM_CONTEXT_REDIRECT_MODE:
+        set_preedit_buffer (self, NULL);
+        self->commit_mode = HILDON_IM_COMMIT_REDIRECT;
+        hildon_im_context_clear_selection(self);
+        break;
+      case HILDON_IM_CONTEXT_SURROUNDING_MODE:
+        set_preedit_buffer (self, NULL);
+        self->commit_mode = HILDON_IM_COMMIT_SURROUNDING;
+        break;
+      case HILDON_IM_CONTEXT_PREEDIT_MODE:
+        set_preedit_buffer (self, NULL);
+        /* Preedit is a temporary mode that will be reset after
+         * the next text has been received.
+         */
+        self->previous_commit_mode = self->commit_mode;
+        self->commit_mode = HILDON_IM_COMMIT_PREEDIT;
+        break;
+      case HILDON_IM_CONTEXT_REQUEST_SURROUNDING:
+        hildon_im_context_send_surrounding(self, FALSE);
+        if (self->is_url_entry)
+        {
+          hildon_im_context_send_command(self, HILDON_IM_SELECT_ALL);
+        }
+        break;
+      case HILDON_IM_CONTEXT_REQUEST_SURROUNDING_FULL:
+        hildon_im_context_send_surrounding(self, TRUE);
+        if (self->is_url_entry)
         {
-          self->mask &= ~HILDON_IM_SHIFT_STICKY_MASK;
-          hildon_im_context_send_command (self, HILDON_IM_SHIFT_UNSTICKY);
+          hildon_im_context_send_command(self, HILDON_IM_SELECT_ALL);
         }
+        break;
+      case HILDON_IM_CONTEXT_FLUSH_PREEDIT:
+        hildon_im_context_commit_preedit_data(self);
+        break;
+      case HILDON_IM_CONTEXT_CANCEL_PREEDIT:
+        set_preedit_buffer (self, NULL);
+        break;
+#ifdef MAEMO_CHANGES
+      case HILDON_IM_CONTEXT_CLIPBOARD_COPY:
+          hildon_gtk_im_context_copy(GTK_IM_CONTEXT(self));
+        break;
+      case HILDON_IM_CONTEXT_CLIPBOARD_CUT:
+          hildon_gtk_im_context_cut(GTK_IM_CONTEXT(self));
+        break;
+      case HILDON_IM_CONTEXT_CLIPBOARD_PASTE:
+          hildon_gtk_im_context_paste(GTK_IM_CONTEXT(self));
+        break;
+#elif GTK_CHECK_VERSION(3,0,0)
+      case HILDON_IM_CONTEXT_CLIPBOARD_COPY:
+      {
+        if (GTK_IS_ENTRY(self->client_gtk_widget))
+          g_signal_emit_by_name(self, "copy-clipboard", 0);
 
-      self->options = msg->options;
+        break;
+      }
+      case HILDON_IM_CONTEXT_CLIPBOARD_CUT:
+      {
+        if (GTK_IS_ENTRY(self->client_gtk_widget))
+          g_signal_emit_by_name(self, "cut-clipboard", 0);
 
-      switch(msg->type)
+        break;
+      }
+      case HILDON_IM_CONTEXT_CLIPBOARD_PASTE:
       {
-        case HILDON_IM_CONTEXT_WIDGET_CHANGED:
-          self->mask = 0;
-          break;
-        case HILDON_IM_CONTEXT_ENTER_ON_FOCUS:
-          enter_on_focus_pending = TRUE;
-          break;
-        case HILDON_IM_CONTEXT_CONFIRM_SENTENCE_START:
-          hildon_im_context_check_sentence_start(self);
-          break;
-        case HILDON_IM_CONTEXT_HANDLE_TAB:
-          hildon_im_context_send_fake_key(self, GDK_Tab, TRUE);
-          hildon_im_context_send_fake_key(self, GDK_Tab, FALSE);
-          break;
-        case HILDON_IM_CONTEXT_HANDLE_BACKSPACE:
-          hildon_im_context_do_backspace (self);
-          break;
-        case HILDON_IM_CONTEXT_HANDLE_SPACE:
-          hildon_im_context_insert_utf8(self, HILDON_IM_MSG_CONTINUE, " ");
-          break;
-        case HILDON_IM_CONTEXT_BUFFERED_MODE:
-          set_preedit_buffer (self, NULL);
-          self->commit_mode = HILDON_IM_COMMIT_BUFFERED;
-          break;
-        case HILDON_IM_CONTEXT_DIRECT_MODE:
-          set_preedit_buffer (self, NULL);
-          self->commit_mode = HILDON_IM_COMMIT_DIRECT;
-          break;
-        case HILDON_IM_CONTEXT_REDIRECT_MODE:
-          set_preedit_buffer (self, NULL);
-          self->commit_mode = HILDON_IM_COMMIT_REDIRECT;
-          hildon_im_context_clear_selection(self);
-          break;
-        case HILDON_IM_CONTEXT_SURROUNDING_MODE:
-          set_preedit_buffer (self, NULL);
-          self->commit_mode = HILDON_IM_COMMIT_SURROUNDING;
-          break;
-        case HILDON_IM_CONTEXT_PREEDIT_MODE:
-          set_preedit_buffer (self, NULL);
-          /* Preedit is a temporary mode that will be reset after
-           * the next text has been received.
-           */
-          self->previous_commit_mode = self->commit_mode;
-          self->commit_mode = HILDON_IM_COMMIT_PREEDIT;
-          break;
-        case HILDON_IM_CONTEXT_REQUEST_SURROUNDING:
-          hildon_im_context_send_surrounding(self, FALSE);
-          if (self->is_url_entry)
-          {
-            hildon_im_context_send_command(self, HILDON_IM_SELECT_ALL);
-          }
-          break;
-        case HILDON_IM_CONTEXT_REQUEST_SURROUNDING_FULL:
-          hildon_im_context_send_surrounding(self, TRUE);
-          if (self->is_url_entry)
-          {
-            hildon_im_context_send_command(self, HILDON_IM_SELECT_ALL);
-          }
-          break;
-        case HILDON_IM_CONTEXT_FLUSH_PREEDIT:
-          hildon_im_context_commit_preedit_data(self);
-          break;
-        case HILDON_IM_CONTEXT_CANCEL_PREEDIT:
-          set_preedit_buffer (self, NULL);
-          break;
-#ifdef MAEMO_CHANGES
-        case HILDON_IM_CONTEXT_CLIPBOARD_COPY:
-            hildon_gtk_im_context_copy(GTK_IM_CONTEXT(self));
-          break;
-        case HILDON_IM_CONTEXT_CLIPBOARD_CUT:
-            hildon_gtk_im_context_cut(GTK_IM_CONTEXT(self));
-          break;
-        case HILDON_IM_CONTEXT_CLIPBOARD_PASTE:
-            hildon_gtk_im_context_paste(GTK_IM_CONTEXT(self));
-          break;
-#elif GTK_CHECK_VERSION(3,0,0)
-        case HILDON_IM_CONTEXT_CLIPBOARD_COPY:
-        {
-          if (GTK_IS_ENTRY(self->client_gtk_widget))
-            g_signal_emit_by_name(self, "copy-clipboard", 0);
+        if (GTK_IS_ENTRY(self->client_gtk_widget))
+          g_signal_emit_by_name(self, "paste-clipboard", 0);
 
-          break;
-        }
-        case HILDON_IM_CONTEXT_CLIPBOARD_CUT:
+        break;
+      }
+#endif
+      case HILDON_IM_CONTEXT_CLIPBOARD_SELECTION_QUERY:
+          hildon_im_clipboard_selection_query(self);
+        break;
+      case HILDON_IM_CONTEXT_OPTION_CHANGED:
+        break;
+      case HILDON_IM_CONTEXT_SPACE_AFTER_COMMIT:
+        self->space_after_commit = TRUE;
+        break;
+      case HILDON_IM_CONTEXT_NO_SPACE_AFTER_COMMIT:
+        self->space_after_commit = FALSE;
+        break;
+      case HILDON_IM_CONTEXT_SHIFT_LOCKED:
+        self->mask |= HILDON_IM_SHIFT_LOCK_MASK;
+        hildon_im_context_shadow_note(self, HILDON_IM_SHIFT_LOCK_MASK, TRUE);
+        break;
+      case HILDON_IM_CONTEXT_SHIFT_UNLOCKED:
+        self->mask &= ~HILDON_IM_SHIFT_LOCK_MASK;
+        hildon_im_context_shadow_note(self, HILDON_IM_SHIFT_LOCK_MASK, FALSE);
+      case HILDON_IM_CONTEXT_SHIFT_UNSTICKY:
+        self->mask &= ~HILDON_IM_SHIFT_STICKY_MASK;
+        hildon_im_context_shadow_note(self, HILDON_IM_SHIFT_STICKY_MASK, FALSE);
+        break;
+      case HILDON_IM_CONTEXT_LEVEL_LOCKED:
+        self->mask |= HILDON_IM_LEVEL_LOCK_MASK;
+        hildon_im_context_shadow_note(self, HILDON_IM_LEVEL_LOCK_MASK, TRUE);
+        break;
+      case HILDON_IM_CONTEXT_LEVEL_UNLOCKED:
+        self->mask &= ~HILDON_IM_LEVEL_LOCK_MASK;
+        hildon_im_context_shadow_note(self, HILDON_IM_LEVEL_LOCK_MASK, FALSE);
+      case HILDON_IM_CONTEXT_LEVEL_UNSTICKY:
+        self->mask &= ~HILDON_IM_LEVEL_STICKY_MASK;
+        hildon_im_context_shadow_note(self, HILDON_IM_LEVEL_STICKY_MASK, FALSE);
+        break;
+      case HILDON_IM_CONTEXT_SURROUNDING_ACK:
+        if (surrounding_unacked > 0)
         {
-          if (GTK_IS_ENTRY(self->client_gtk_widget))
-            g_signal_emit_by_name(self, "cut-clipboard", 0);
-
-          break;
+          surrounding_unacked--;
+          surrounding_unacked_since = g_get_monotonic_time();
         }
-        case HILDON_IM_CONTEXT_CLIPBOARD_PASTE:
-        {
-          if (GTK_IS_ENTRY(self->client_gtk_widget))
-            g_signal_emit_by_name(self, "paste-clipboard", 0);
+        break;
+      default:
+        g_warning("Invalid communication message from IM");
+        break;
+    }
+    handled = TRUE;
+  }
+  else if (message->atom == HILDON_IM_SURROUNDING_CONTENT
+      && message->format == HILDON_IM_SURROUNDING_CONTENT_FORMAT)
+  {
+    HildonIMSurroundingContentMessage *msg =
+      (HildonIMSurroundingContentMessage *) message->data;
+    HildonIMReassemblyStatus status;
 
-          break;
-        }
-#endif
-        case HILDON_IM_CONTEXT_CLIPBOARD_SELECTION_QUERY:
-            hildon_im_clipboard_selection_query(self);
-          break;
-        case HILDON_IM_CONTEXT_OPTION_CHANGED:
-          break;
-        case HILDON_IM_CONTEXT_SPACE_AFTER_COMMIT:
-          self->space_after_commit = TRUE;
-          break;
-        case HILDON_IM_CONTEXT_NO_SPACE_AFTER_COMMIT:
-          self->space_after_commit = FALSE;
-          break;
-        case HILDON_IM_CONTEXT_SHIFT_LOCKED:
-          self->mask |= HILDON_IM_SHIFT_LOCK_MASK;
-          break;
-        case HILDON_IM_CONTEXT_SHIFT_UNLOCKED:
-          self->mask &= ~HILDON_IM_SHIFT_LOCK_MASK;
-        case HILDON_IM_CONTEXT_SHIFT_UNSTICKY:
-          self->mask &= ~HILDON_IM_SHIFT_STICKY_MASK;
-          break;
-        case HILDON_IM_CONTEXT_LEVEL_LOCKED:
-          self->mask |= HILDON_IM_LEVEL_LOCK_MASK;
-          break;
-        case HILDON_IM_CONTEXT_LEVEL_UNLOCKED:
-          self->mask &= ~HILDON_IM_LEVEL_LOCK_MASK;
-        case HILDON_IM_CONTEXT_LEVEL_UNSTICKY:
-          self->mask &= ~HILDON_IM_LEVEL_STICKY_MASK;
-          break;
-        default:
-          g_warning("Invalid communication message from IM");
-          break;
-      }
-      result = GDK_FILTER_REMOVE;
+    /* The END chunk only terminates the content, it carries no text */
+    status = hildon_im_reassembly_feed(self->incoming_surrounding,
+                                       msg->msg_flag, msg->surrounding,
+                                       msg->msg_flag == HILDON_IM_MSG_END ?
+                                       0 : sizeof(msg->surrounding));
+
+    if (status == HILDON_IM_REASSEMBLY_COMPLETE)
+    {
+      g_free(self->surrounding);
+      self->surrounding =
+        hildon_im_reassembly_steal(self->incoming_surrounding, NULL);
+      hildon_im_context_commit_surrounding(self);
     }
-    else if (cme->message_type == hildon_im_protocol_get_atom(HILDON_IM_SURROUNDING_CONTENT)
-        && cme->format == HILDON_IM_SURROUNDING_CONTENT_FORMAT)
+    else if (status == HILDON_IM_REASSEMBLY_DROPPED)
     {
-      HildonIMSurroundingContentMessage *msg =
-        (HildonIMSurroundingContentMessage *)&cme->data;
-      gchar *new_surrounding;
+      g_warning("Dropped an oversized surrounding from the IM");
+    }
 
-      if (msg->msg_flag == HILDON_IM_MSG_START && self->surrounding)
-      {
-        g_free(self->surrounding);
-        self->surrounding = g_strdup("");
-      }
+    handled = TRUE;
+  }
+  else if (message->atom == HILDON_IM_REPLACE
+      && message->format == HILDON_IM_REPLACE_FORMAT)
+  {
+    HildonIMReplaceMessage *msg = (HildonIMReplaceMessage *) message->data;
+    HildonIMReassemblyStatus status;
 
-      if (msg->msg_flag == HILDON_IM_MSG_END && self->surrounding)
-      {
-        hildon_im_context_commit_surrounding(self);
-        result = GDK_FILTER_REMOVE;
-      }
-      else
-      {
-        new_surrounding = g_strconcat(self->surrounding,
-                                      msg->surrounding, NULL);
-        
-        g_free(self->surrounding);
-        self->surrounding = new_surrounding;
+    status = hildon_im_reassembly_feed(self->incoming_replace,
+                                       msg->msg_flag, msg->utf8_str,
+                                       sizeof(msg->utf8_str));
 
-        result = GDK_FILTER_REMOVE;
-      }
+    if (status == HILDON_IM_REASSEMBLY_COMPLETE)
+    {
+      hildon_im_context_replace_range(self, msg->start, msg->end,
+          hildon_im_reassembly_peek(self->incoming_replace, NULL));
+      hildon_im_reassembly_reset(self->incoming_replace);
+    }
+    else if (status == HILDON_IM_REASSEMBLY_DROPPED)
+    {
+      g_warning("Dropped an oversized replacement from the IM");
     }
-    else if (cme->message_type == hildon_im_protocol_get_atom(HILDON_IM_SURROUNDING)
-        && cme->format == HILDON_IM_SURROUNDING_FORMAT)
+
+    handled = TRUE;
+  }
+  else if (message->atom == HILDON_IM_PREEDIT
+      && message->format == HILDON_IM_PREEDIT_FORMAT)
+  {
+    HildonIMPreeditMessage *msg = (HildonIMPreeditMessage *) message->data;
+    HildonIMReassemblyStatus status;
+
+    status = hildon_im_reassembly_feed(self->incoming_preedit,
+                                       msg->msg_flag, msg->utf8_str,
+                                       sizeof(msg->utf8_str));
+
+    if (status == HILDON_IM_REASSEMBLY_COMPLETE)
     {
-      HildonIMSurroundingMessage *msg =
-        (HildonIMSurroundingMessage *)&cme->data;
+      gsize length;
+      const gchar *text =
+        hildon_im_reassembly_peek(self->incoming_preedit, &length);
 
-      hildon_im_context_set_client_cursor_location(self,
-                                                   msg->offset_is_relative,
-                                                   msg->cursor_offset);
-      result = GDK_FILTER_REMOVE;
+      /* Unlike HILDON_IM_CONTEXT_PREEDIT_MODE, the commit mode stays */
+      if (!(msg->flags & HILDON_IM_PREEDIT_APPEND))
+        set_preedit_buffer(self, NULL);
+      if (length != 0)
+        set_preedit_buffer(self, text);
 
+      hildon_im_reassembly_reset(self->incoming_preedit);
+      self->changed_count = 0;
+      self->last_internal_change = TRUE;
+    }
+    else if (status == HILDON_IM_REASSEMBLY_DROPPED)
+    {
+      g_warning("Dropped an oversized preedit from the IM");
     }
-    else if (cme->message_type ==
-             hildon_im_protocol_get_atom (HILDON_IM_LONG_PRESS_SETTINGS))
+
+    handled = TRUE;
+  }
+  else if (message->atom == HILDON_IM_SURROUNDING
+      && message->format == HILDON_IM_SURROUNDING_FORMAT)
+  {
+    HildonIMSurroundingMessage *msg =
+      (HildonIMSurroundingMessage *) message->data;
+
+    hildon_im_context_set_client_cursor_location(self,
+                                                 msg->offset_is_relative,
+                                                 msg->cursor_offset);
+    handled = TRUE;
+
+  }
+  else if (message->atom == HILDON_IM_BULK
+      && message->format == HILDON_IM_BULK_FORMAT)
+  {
+    HildonIMBulkMessage *msg = (HildonIMBulkMessage *) message->data;
+
+    if (msg->content == HILDON_IM_INSERT_UTF8)
     {
-      HildonIMLongPressSettingsMessage *msg =
-        (HildonIMLongPressSettingsMessage *) &cme->data;
+      hildon_im_context_receive_bulk(self, msg);
+    }
 
-      self->enable_long_press = msg->enable_long_press;
-      self->long_press_timeout = (msg->long_press_timeout > 0)
-        ? msg->long_press_timeout : DEFAULT_LONG_PRESS_TIMEOUT;
+    handled = TRUE;
+  }
+  else if (message->atom == HILDON_IM_SHM_RING
+      && message->format == HILDON_IM_SHM_RING_FORMAT)
+  {
+    HildonIMShmRingMessage *msg = (HildonIMShmRingMessage *) message->data;
 
-      result = GDK_FILTER_REMOVE;
+    if (msg->type == HILDON_IM_SHM_RING_ACCEPT &&
+        im_ring != NULL && im_ring_offered != None &&
+        im_ring_offered == hildon_im_context_get_im_window(NULL))
+    {
+      im_ring_peer = im_ring_offered;
+    }
+    else if (msg->type == HILDON_IM_SHM_RING_CLOSE)
+    {
+      hildon_im_context_ring_detach();
     }
+
+    handled = TRUE;
   }
-  
-  return result;
+  else if (message->atom == HILDON_IM_STATE
+      && message->format == HILDON_IM_STATE_FORMAT)
+  {
+    HildonIMStateMessage *msg = (HildonIMStateMessage *) message->data;
+
+    if (msg->type == HILDON_IM_STATE_ACCEPT &&
+        im_state != NULL && im_state_offered != None &&
+        im_state_offered == hildon_im_context_get_im_window(NULL))
+    {
+      im_state_peer = im_state_offered;
+      hildon_im_context_state_publish(self);
+      hildon_im_context_state_sync();
+    }
+    else if (msg->type == HILDON_IM_STATE_CHANGED)
+    {
+      hildon_im_context_state_sync();
+    }
+    else if (msg->type == HILDON_IM_STATE_CLOSE)
+    {
+      hildon_im_context_state_detach();
+    }
+
+    handled = TRUE;
+  }
+  else if (message->atom == HILDON_IM_LONG_PRESS_SETTINGS)
+  {
+    HildonIMLongPressSettingsMessage *msg =
+      (HildonIMLongPressSettingsMessage *) message->data;
+
+    self->enable_long_press = msg->enable_long_press;
+    self->long_press_timeout = (msg->long_press_timeout > 0)
+      ? msg->long_press_timeout : DEFAULT_LONG_PRESS_TIMEOUT;
+
+    handled = TRUE;
+  }
+  else if (message->atom == HILDON_IM_TRACE
+      && message->format == HILDON_IM_TRACE_FORMAT)
+  {
+    HildonIMTraceMessage *msg = (HildonIMTraceMessage *) message->data;
+    HildonIMTraceStamp *stamp =
+      &trace_pending[msg->seq % HILDON_IM_TRACE_PENDING];
+    gint64 time = ((gint64) msg->time_hi << 32) | msg->time_lo;
+
+    if (msg->seq == 0 || stamp->seq != msg->seq)
+      stamp = NULL;
+
+    if (msg->type == HILDON_IM_TRACE_ECHO && stamp != NULL)
+    {
+      hildon_im_context_latency_add(HILDON_IM_LATENCY_KEY_TO_IM,
+                                    time - stamp->sent);
+      stamp->received = time;
+    }
+    else if (msg->type == HILDON_IM_TRACE_STAMP)
+    {
+      self->trace_in_arrived = g_get_monotonic_time();
+      hildon_im_context_latency_add(HILDON_IM_LATENCY_IM_TO_CONTEXT,
+                                    self->trace_in_arrived - time);
+      if (stamp != NULL && stamp->received != 0)
+        hildon_im_context_latency_add(HILDON_IM_LATENCY_IN_IM,
+                                      time - stamp->received);
+
+      self->trace_in_valid = TRUE;
+      self->trace_in_seq = msg->seq;
+      self->trace_in_atom = msg->atom;
+    }
+
+    handled = TRUE;
+  }
+
+  self->trace_in_handling = FALSE;
+
+  return handled;
+}
+
+static void
+hildon_im_window_filter_free (HildonIMWindowFilter *filter)
+{
+  gdk_window_remove_filter(filter->window, client_message_filter, filter);
+  g_slist_free(filter->contexts);
+  g_free(filter);
+}
+
+/* Shares the filter of @window with @self and makes @self the context
+   the window's messages go to */
+static void
+hildon_im_window_filter_attach (HildonIMContext *self, GdkWindow *window)
+{
+  HildonIMWindowFilter *filter;
+
+  filter = g_object_get_data(G_OBJECT(window), HILDON_IM_WINDOW_FILTER_KEY);
+  if (filter == NULL)
+  {
+    filter = g_new0(HildonIMWindowFilter, 1);
+    filter->window = window;
+    filter->xid = GDK_WINDOW_XID(window);
+    filter->atoms = self->atoms;
+
+    gdk_window_add_filter(window, client_message_filter, filter);
+    g_object_set_data_full(G_OBJECT(window), HILDON_IM_WINDOW_FILTER_KEY,
+                           filter,
+                           (GDestroyNotify) hildon_im_window_filter_free);
+  }
+
+  filter->contexts = g_slist_prepend(filter->contexts, self);
+
+  if (client_windows == NULL)
+    client_windows = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(client_windows, GUINT_TO_POINTER(filter->xid), self);
+}
+
+/* Takes @self off the filter of @window. The window's messages go to
+   another context still attached, and the filter goes with the last one. */
+static void
+hildon_im_window_filter_detach (HildonIMContext *self, GdkWindow *window)
+{
+  HildonIMWindowFilter *filter;
+
+  filter = g_object_get_data(G_OBJECT(window), HILDON_IM_WINDOW_FILTER_KEY);
+  if (filter == NULL)
+  {
+    return;
+  }
+
+  filter->contexts = g_slist_remove(filter->contexts, self);
+
+  if (g_hash_table_lookup(client_windows,
+                          GUINT_TO_POINTER(filter->xid)) == self)
+  {
+    if (filter->contexts != NULL)
+      g_hash_table_insert(client_windows, GUINT_TO_POINTER(filter->xid),
+                          filter->contexts->data);
+    else
+      g_hash_table_remove(client_windows, GUINT_TO_POINTER(filter->xid));
+  }
+
+  if (filter->contexts == NULL)
+  {
+    g_object_set_data(G_OBJECT(window), HILDON_IM_WINDOW_FILTER_KEY, NULL);
+  }
+}
+
+/* Filter function to intercept and process XClientMessages of a client
+   window. Only events about IM atoms go further than an atom lookup. */
+static GdkFilterReturn
+client_message_filter(GdkXEvent *xevent, GdkEvent *event, gpointer data)
+{
+  HildonIMWindowFilter *filter = data;
+  XEvent *xe = (XEvent *)xevent;
+  HildonIMContext *self;
+  GSList *l;
+
+  if (xe->type == ClientMessage)
+  {
+    HildonIMTransportMessage message;
+
+    self = g_hash_table_lookup(client_windows, GUINT_TO_POINTER(filter->xid));
+
+    if (self != NULL &&
+        hildon_im_transport_x11_decode(filter->atoms, &xe->xclient, &message) &&
+        hildon_im_context_handle_message(self, &message))
+    {
+      return GDK_FILTER_REMOVE;
+    }
+  }
+  else if (xe->type == PropertyNotify)
+  {
+    if (xe->xproperty.state == PropertyDelete &&
+        hildon_im_protocol_lookup_atom(filter->atoms, xe->xproperty.atom) !=
+          HILDON_IM_NUM_ATOMS)
+    {
+      for (l = filter->contexts; l != NULL; l = l->next)
+      {
+        self = l->data;
+
+        if (self->bulk_out_pending &&
+            xe->xproperty.atom ==
+              self->atoms[self->bulk_out_pending_content])
+        {
+          self->bulk_out_pending = FALSE;
+          hildon_im_context_bulk_write_piece(self);
+        }
+      }
+    }
+  }
+  else if (xe->type == DestroyNotify)
+  {
+    for (l = filter->contexts; l != NULL; l = l->next)
+    {
+      self = l->data;
+      self->client_gdk_window = NULL;
+    }
+
+    g_hash_table_remove(client_windows, GUINT_TO_POINTER(filter->xid));
+
+    /* Frees the filter; GDK has already moved past it */
+    g_object_set_data(G_OBJECT(filter->window), HILDON_IM_WINDOW_FILTER_KEY,
+                      NULL);
+  }
+
+  return GDK_FILTER_CONTINUE;
 }
 /* Virtual functions */
 
@@ -1722,10 +2775,26 @@ hildon_im_context_set_client_window(GtkIMContext *context,
     self->client_copy_clipboard_signal_handler = 0;
   }
 
+  if (self->client_selection_buffer != NULL)
+  {
+    g_signal_handler_disconnect(self->client_selection_buffer,
+                                self->client_selection_signal_handler[0]);
+    g_object_unref(self->client_selection_buffer);
+    self->client_selection_buffer = NULL;
+  }
+  else if (self->client_selection_signal_handler[0] > 0)
+  {
+    g_signal_handler_disconnect(self->client_gtk_widget,
+                                self->client_selection_signal_handler[0]);
+    g_signal_handler_disconnect(self->client_gtk_widget,
+                                self->client_selection_signal_handler[1]);
+  }
+  self->client_selection_signal_handler[0] = 0;
+  self->client_selection_signal_handler[1] = 0;
+
   if (self->client_gdk_window != NULL) {
     /* Need to clean up old window unhook gdk_event_filter etc */
-    gdk_window_remove_filter(self->client_gdk_window,
-                             (GdkFilterFunc)client_message_filter, self );
+    hildon_im_window_filter_detach(self, self->client_gdk_window);
 
     if (window == NULL && !self->is_internal_widget)
     {
@@ -1733,6 +2802,12 @@ hildon_im_context_set_client_window(GtkIMContext *context,
     }
   }
 
+  hildon_im_context_bulk_out_clear(self);
+  hildon_im_reassembly_reset(self->bulk_in);
+  hildon_im_reassembly_reset(self->incoming_surrounding);
+  hildon_im_reassembly_reset(self->incoming_replace);
+  hildon_im_reassembly_reset(self->incoming_preedit);
+
   self->is_url_entry = FALSE;
   self->committed_preedit = FALSE;
   self->client_gdk_window = window;
@@ -1747,7 +2822,8 @@ hildon_im_context_set_client_window(GtkIMContext *context,
     /* Filter the window for ClientMessages*/
     gpointer widget;
 
-    gdk_window_add_filter(window, (GdkFilterFunc)client_message_filter, self);
+    self->atoms = hildon_im_protocol_get_atoms(gdk_window_get_display(window));
+    hildon_im_window_filter_attach(self, window);
 
     /* If the widget contents change, we want to know about it. */
     gdk_window_get_user_data(window, &widget);
@@ -1775,6 +2851,20 @@ hildon_im_context_set_client_window(GtkIMContext *context,
           self->text_view_preedit_mark = gtk_text_buffer_create_mark (
                                 get_buffer(widget),
                                 "preedit", &start, FALSE);
+
+          self->client_selection_buffer = g_object_ref(get_buffer(widget));
+          self->client_selection_signal_handler[0] =
+            g_signal_connect(self->client_selection_buffer, "mark-set",
+              G_CALLBACK(hildon_im_context_selection_mark_set), self);
+        }
+        else if (GTK_IS_ENTRY(widget))
+        {
+          self->client_selection_signal_handler[0] =
+            g_signal_connect_swapped(widget, "notify::selection-bound",
+              G_CALLBACK(hildon_im_context_selection_changed), self);
+          self->client_selection_signal_handler[1] =
+            g_signal_connect_swapped(widget, "notify::cursor-position",
+              G_CALLBACK(hildon_im_context_selection_changed), self);
         }
 
         /* The commit mode depends on the type of widget */
@@ -1839,10 +2929,25 @@ hildon_im_context_focus_in(GtkIMContext *context)
   current_context = context;
 #endif
 
-  hildon_im_context_send_command(self, HILDON_IM_SETCLIENT);
+  /* The IM answers the context that has the focus on a shared window */
+  if (self->client_gdk_window != NULL)
+  {
+    g_hash_table_insert(client_windows,
+                        GUINT_TO_POINTER(GDK_WINDOW_XID(self->client_gdk_window)),
+                        self);
+  }
+
+  if (!hildon_im_context_send_focus(self, HILDON_IM_SETCLIENT))
+  {
+    hildon_im_context_send_command(self, HILDON_IM_SETCLIENT);
+
+    hildon_im_context_send_command (self, HILDON_IM_SHIFT_UNSTICKY);
+    hildon_im_context_send_command (self, HILDON_IM_MOD_UNSTICKY);
+  }
 
-  hildon_im_context_send_command (self, HILDON_IM_SHIFT_UNSTICKY);
-  hildon_im_context_send_command (self, HILDON_IM_MOD_UNSTICKY);
+  /* The IM only knows the selection state of the previous client */
+  self->selection_sent = -1;
+  hildon_im_context_selection_changed(self);
 
   if (enter_on_focus_pending)
   {
@@ -1873,6 +2978,16 @@ hildon_im_context_focus_out(GtkIMContext *context)
 
   self->has_focus = FALSE;
 
+  /* Another application may take the IM while we are unfocused, so the
+     cursor rectangle and the selection are sent again on focus in */
+  self->cursor_sent_window = None;
+  self->selection_sent = -1;
+  if (self->cursor_timeout_id != 0)
+  {
+    g_source_remove(self->cursor_timeout_id);
+    self->cursor_timeout_id = 0;
+  }
+
   set_preedit_buffer (self, NULL);
 
   /* clear any long-press data */
@@ -2730,6 +3845,8 @@ hildon_im_context_filter_keypress(GtkIMContext *context, GdkEventKey *event)
   g_return_val_if_fail(HILDON_IS_IM_CONTEXT(context), FALSE);
   self = HILDON_IM_CONTEXT(context);
 
+  self->keypress_time = g_get_monotonic_time();
+
   /* When the widget isn't yet fully initialized, keys shouldn't
    * be processed in order to avoid eventual X errors. */
   if (!self->has_focus)
@@ -2901,32 +4018,117 @@ hildon_im_context_set_cursor_location(GtkIMContext *context,
 
   self->prev_cursor_y = area->y;
   self->prev_cursor_x = area->x;
+
+  hildon_im_context_update_cursor(self, area);
 }
 
-static gint
-hildon_im_context_get_insert (HildonIMContext *self, gint cursor_position)
+/* Sends the cursor rectangle in root coordinates, unless the IM already
+   has it */
+static void
+hildon_im_context_send_cursor (HildonIMContext *self)
 {
-  gint insert = -1;
+  HildonIMCursorMessage msg;
+  GdkRectangle rect;
+  Window client;
+  XEvent event;
+  gint x, y;
 
-  if (GTK_IS_TEXT_VIEW (self->client_gtk_widget))
+  if (self->client_gdk_window == NULL)
+    return;
+
+  client = GDK_WINDOW_XID(self->client_gdk_window);
+
+  /* The window may have moved with the cursor staying put */
+  rect = self->cursor_area;
+  gdk_window_get_origin(self->client_gdk_window, &x, &y);
+  rect.x += x;
+  rect.y += y;
+
+  if (self->cursor_sent_window == client &&
+      rect.x == self->cursor_sent.x && rect.y == self->cursor_sent.y &&
+      rect.width == self->cursor_sent.width &&
+      rect.height == self->cursor_sent.height)
   {
-    GtkTextIter selection_begin, cursor;
-    GtkTextBuffer *buffer = NULL;
-    GtkTextMark *cursor_mark = NULL;
-    gchar *slice = NULL;
+    return;
+  }
 
-    buffer = get_buffer (self->client_gtk_widget);
-    if (buffer != NULL &&
-        gtk_text_buffer_get_selection_bounds (buffer, &selection_begin, NULL))
-    {
-      cursor_mark = gtk_text_buffer_get_insert (buffer);
-      gtk_text_buffer_get_iter_at_mark (buffer, &cursor, cursor_mark);
-      if (!gtk_text_iter_equal (&cursor, &selection_begin))
-      {
-        slice = gtk_text_iter_get_visible_slice (&selection_begin, &cursor);
+  self->cursor_sent = rect;
+  self->cursor_sent_window = client;
+  self->cursor_sent_time = g_get_monotonic_time();
 
-        if (slice != NULL)
-          insert = cursor_position - g_utf8_strlen (slice, -1);
+  msg.input_window = client;
+  msg.x = rect.x;
+  msg.y = rect.y;
+  msg.width = rect.width;
+  msg.height = rect.height;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_CURSOR, None, &msg, &event);
+
+  hildon_im_context_send_event(self, &event);
+}
+
+static gboolean
+hildon_im_context_cursor_timeout (gpointer data)
+{
+  HildonIMContext *self = HILDON_IM_CONTEXT(data);
+
+  self->cursor_timeout_id = 0;
+  hildon_im_context_send_cursor(self);
+
+  return FALSE;
+}
+
+/* Passes a new cursor rectangle on to the IM, holding it back until
+   HILDON_IM_CURSOR_INTERVAL has passed since the last one; only the
+   latest rectangle of that time is sent */
+static void
+hildon_im_context_update_cursor (HildonIMContext *self, GdkRectangle *area)
+{
+  gint64 elapsed;
+
+  if (!(hildon_im_context_get_peer_caps(self) & HILDON_IM_CAP_CURSOR))
+    return;
+
+  self->cursor_area = *area;
+
+  if (self->cursor_timeout_id != 0)
+    return;
+
+  elapsed = (g_get_monotonic_time() - self->cursor_sent_time) / 1000;
+  if (elapsed < HILDON_IM_CURSOR_INTERVAL)
+  {
+    self->cursor_timeout_id =
+      g_timeout_add(HILDON_IM_CURSOR_INTERVAL - elapsed,
+                    hildon_im_context_cursor_timeout, self);
+    return;
+  }
+
+  hildon_im_context_send_cursor(self);
+}
+
+static gint
+hildon_im_context_get_insert (HildonIMContext *self, gint cursor_position)
+{
+  gint insert = -1;
+
+  if (GTK_IS_TEXT_VIEW (self->client_gtk_widget))
+  {
+    GtkTextIter selection_begin, cursor;
+    GtkTextBuffer *buffer = NULL;
+    GtkTextMark *cursor_mark = NULL;
+    gchar *slice = NULL;
+
+    buffer = get_buffer (self->client_gtk_widget);
+    if (buffer != NULL &&
+        gtk_text_buffer_get_selection_bounds (buffer, &selection_begin, NULL))
+    {
+      cursor_mark = gtk_text_buffer_get_insert (buffer);
+      gtk_text_buffer_get_iter_at_mark (buffer, &cursor, cursor_mark);
+      if (!gtk_text_iter_equal (&cursor, &selection_begin))
+      {
+        slice = gtk_text_iter_get_visible_slice (&selection_begin, &cursor);
+
+        if (slice != NULL)
+          insert = cursor_position - g_utf8_strlen (slice, -1);
       }
     }
   }
@@ -2942,6 +4144,31 @@ hildon_im_context_get_insert (HildonIMContext *self, gint cursor_position)
   return insert;
 }
 
+/* Whether the cursor is where autocap applies, unless shift is locked */
+static gboolean
+hildon_im_context_is_sentence_start (HildonIMContext *self)
+{
+  gchar *surrounding = NULL;
+  gint cpos = 0;
+  gboolean start;
+
+  if (self->mask & HILDON_IM_SHIFT_LOCK_MASK)
+  {
+    return FALSE;
+  }
+
+  hildon_im_context_get_surrounding (GTK_IM_CONTEXT (self),
+                                     &surrounding,
+                                     &cpos);
+
+  cpos = hildon_im_context_get_insert (self, cpos);
+  start = hildon_im_common_check_auto_cap (surrounding, cpos);
+
+  g_free (surrounding);
+
+  return start;
+}
+
 /* Updates the IM with the autocap state at the active cursor position */
 static void
 hildon_im_context_check_sentence_start (HildonIMContext *self)
@@ -2956,37 +4183,10 @@ hildon_im_context_check_sentence_start (HildonIMContext *self)
   }
   else
   {
-    /* gboolean shift_is_sticky; */
-    gboolean shift_is_locked;
     gboolean old_auto_upper;
 
-    /* shift_is_sticky = self->mask & HILDON_IM_SHIFT_STICKY_MASK; */
-    shift_is_locked = self->mask & HILDON_IM_SHIFT_LOCK_MASK;
-
     old_auto_upper = self->auto_upper;
-
-    if (shift_is_locked)
-    {
-      self->auto_upper = FALSE;
-    }
-    else
-    {
-      gchar *surrounding = NULL;
-      gint cpos = 0;
-
-      hildon_im_context_get_surrounding (GTK_IM_CONTEXT (self),
-                                         &surrounding,
-                                         &cpos);
-
-      cpos = hildon_im_context_get_insert (self, cpos);
-
-      if (hildon_im_common_check_auto_cap (surrounding, cpos))
-        self->auto_upper = TRUE;
-      else
-        self->auto_upper = FALSE;
-
-      g_free (surrounding);
-    }
+    self->auto_upper = hildon_im_context_is_sentence_start (self);
 
     if ( (! old_auto_upper) && self->auto_upper)
       hildon_im_context_send_command (self, HILDON_IM_SHIFT_STICKY);
@@ -3006,6 +4206,7 @@ hildon_im_context_insert_utf8(HildonIMContext *self, gint flag,
   gchar *surrounding, *text_clean = (gchar*) text;
   gchar tmp[3] = { 0, 0, 0};
   gboolean has_surrounding, free_text = FALSE;
+  HildonIMReassemblyStatus status;
 
   g_return_if_fail( HILDON_IS_IM_CONTEXT(self) );
   
@@ -3013,266 +4214,2190 @@ hildon_im_context_insert_utf8(HildonIMContext *self, gint flag,
    * After this text has been received, the commit mode is reset. */
   if (self->commit_mode == HILDON_IM_COMMIT_PREEDIT)
   {
-    switch(flag)
+    status = hildon_im_reassembly_feed(self->incoming_preedit_buffer,
+                                       flag, text, strlen(text));
+    if (flag == HILDON_IM_MSG_END)
     {
-    case HILDON_IM_MSG_START:
-      g_string_truncate(self->incoming_preedit_buffer, 0);
-      g_string_append(self->incoming_preedit_buffer, text);
-      break;
-    case HILDON_IM_MSG_CONTINUE:
-      g_string_append(self->incoming_preedit_buffer, text);
-      break;
-    case HILDON_IM_MSG_END:
-      g_string_append(self->incoming_preedit_buffer, text);
-      set_preedit_buffer (self, self->incoming_preedit_buffer->str);
-      g_string_truncate(self->incoming_preedit_buffer, 0);
+      if (status == HILDON_IM_REASSEMBLY_COMPLETE)
+        set_preedit_buffer (self,
+            hildon_im_reassembly_peek(self->incoming_preedit_buffer, NULL));
+      else
+        g_warning("Dropped an oversized preedit from the IM");
+
+      hildon_im_reassembly_reset(self->incoming_preedit_buffer);
       self->commit_mode = self->previous_commit_mode;
       self->changed_count = 0;
       self->last_internal_change = TRUE;
-      break;
     }
     return;
   }
   else
   {
-    set_preedit_buffer (self, NULL);
+    set_preedit_buffer (self, NULL);
+  }
+  
+  if (self->options & HILDON_IM_AUTOCORRECT)
+  {
+    has_surrounding = gtk_im_context_get_surrounding (
+        GTK_IM_CONTEXT(self),
+        &surrounding, &cpos);
+
+    if (has_surrounding)
+    {
+      if (surrounding [cpos] == 0)
+      {
+        if (surrounding [cpos - 1] == ' ')
+        {
+          to_copy = hildon_im_autocorrection_check_character (text);
+
+          if (to_copy > 0)
+          {
+            memcpy (tmp, text, to_copy);
+            text_clean = g_strconcat (tmp, " ", text + to_copy, NULL);
+            gtk_im_context_delete_surrounding (GTK_IM_CONTEXT(self),
+                -1, 1);
+            free_text = TRUE;
+          }
+        }
+      }
+      g_free (surrounding);
+    }
+  }
+
+  /* This last "commit" signal adds the actual text. We're assuming it sends
+     0 or 1 "changed" signals (we try to guarantee that by sending a "" commit
+     above to delete highlights).
+
+     If we get more than one "changed" signal, it means that the
+     application's "changed" signal handler went and changed the text
+     as a result of the change, and we need to clear IM. */
+  self->changed_count = 0;
+  self->last_internal_change = TRUE;
+  commit_text (self, text_clean);
+
+  if (free_text == TRUE)
+  {
+    g_free (text_clean);
+  }
+  /* If last_internal_change is still TRUE, it means set_cursor_location()
+     wasn't called yet. This happens at least with GtkEntry where it's called
+     in idle handler. */
+
+  if (self->last_internal_change && self->changed_count > 1)
+  {
+    /* External change seen, clear IM in set_cursor_location() handler */
+    self->last_internal_change = FALSE;
+    self->prev_cursor_y = self->prev_cursor_x = -1;
+  }
+}
+
+static void
+hildon_im_context_send_input_mode (HildonIMContext *self)
+{
+  XEvent event;
+  Window window;
+  HildonIMInputModeMessage msg;
+  HildonGtkInputMode input_mode = 0;
+  HildonGtkInputMode default_input_mode = 0;
+
+  window = hildon_im_context_get_peer_window(self);
+
+  if (window == None)
+  {
+    g_warning("hildon_im_context_send_input_mode: Could not get the window id.\n");
+    return;
+  }
+
+#if defined(MAEMO_CHANGES) || GTK_CHECK_VERSION(3,0,0)
+  hildon_get_input_mode (self, &input_mode, &default_input_mode);
+#endif
+
+  msg.input_mode = input_mode;
+  msg.default_input_mode = default_input_mode;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_INPUT_MODE, window,
+                         &msg, &event);
+
+  hildon_im_context_send_event (self, &event);
+}
+
+/* Forgets the shadow state unless it still describes this context's view
+   of the current IM window */
+static void
+hildon_im_context_shadow_validate (HildonIMContext *self)
+{
+  Window im_window = hildon_im_context_get_peer_window(self);
+
+  if (shadow_owner == self &&
+      self->shadow_im_window == im_window &&
+      im_window != None)
+  {
+    return;
+  }
+
+  shadow_owner = self;
+  self->shadow_im_window = im_window;
+  self->shadow_known = 0;
+  self->shadow_mask = 0;
+}
+
+/* Records a modifier state the IM is known to have */
+static void
+hildon_im_context_shadow_note (HildonIMContext *self,
+                               HildonIMInternalModifierMask bits,
+                               gboolean set)
+{
+  hildon_im_context_shadow_validate (self);
+
+  self->shadow_known |= bits;
+  if (set)
+    self->shadow_mask |= bits;
+  else
+    self->shadow_mask &= ~bits;
+}
+
+/* Checks a command against the shadow state and records its effect.
+   Returns TRUE if the IM is already in the state the command asks for.
+   Only modifier commands are ever redundant: the IM, or another
+   application using it, can change the client and the visibility without
+   telling us, so those commands always go out. */
+static gboolean
+hildon_im_context_command_is_redundant (HildonIMContext *self,
+                                        HildonIMCommand cmd)
+{
+  HildonIMInternalModifierMask bit;
+  gboolean set;
+
+  hildon_im_context_shadow_validate (self);
+
+  switch (cmd)
+  {
+    case HILDON_IM_SETCLIENT:
+    case HILDON_IM_SETNSHOW:
+    case HILDON_IM_SHOW:
+    case HILDON_IM_HIDE:
+      /* The IM may reset its modifiers for any of them */
+      self->shadow_known = 0;
+      return FALSE;
+    case HILDON_IM_SHIFT_LOCKED:
+      bit = HILDON_IM_SHIFT_LOCK_MASK;
+      set = TRUE;
+      break;
+    case HILDON_IM_SHIFT_UNLOCKED:
+      bit = HILDON_IM_SHIFT_LOCK_MASK;
+      set = FALSE;
+      break;
+    case HILDON_IM_MOD_LOCKED:
+      bit = HILDON_IM_LEVEL_LOCK_MASK;
+      set = TRUE;
+      break;
+    case HILDON_IM_MOD_UNLOCKED:
+      bit = HILDON_IM_LEVEL_LOCK_MASK;
+      set = FALSE;
+      break;
+    case HILDON_IM_SHIFT_STICKY:
+      bit = HILDON_IM_SHIFT_STICKY_MASK;
+      set = TRUE;
+      break;
+    case HILDON_IM_SHIFT_UNSTICKY:
+      bit = HILDON_IM_SHIFT_STICKY_MASK;
+      set = FALSE;
+      break;
+    case HILDON_IM_MOD_STICKY:
+      bit = HILDON_IM_LEVEL_STICKY_MASK;
+      set = TRUE;
+      break;
+    case HILDON_IM_MOD_UNSTICKY:
+      bit = HILDON_IM_LEVEL_STICKY_MASK;
+      set = FALSE;
+      break;
+    default:
+      return FALSE;
+  }
+
+  if ((self->shadow_known & bit) && ((self->shadow_mask & bit) != 0) == set)
+    return TRUE;
+
+  hildon_im_context_shadow_note (self, bit, set);
+
+  return FALSE;
+}
+
+/* Returns the window the IM will be set transient to */
+static guint32
+hildon_im_context_get_app_window (HildonIMContext *self,
+                                  GdkWindow *input_window)
+{
+  /* When the client widget is a child of GtkPlug, the application can
+     override the ID of the window the IM will be set transient to */
+  if (self->client_gtk_widget != NULL &&
+      GTK_IS_PLUG(gtk_widget_get_toplevel(self->client_gtk_widget)))
+  {
+    GtkPlug *plug = (GtkPlug *)gtk_widget_get_toplevel(self->client_gtk_widget);
+    guint32 transient_window_xid;
+
+    transient_window_xid =
+      GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(plug),
+                                         "hildon_im_transient_xid"));
+    if (transient_window_xid)
+      return transient_window_xid;
+  }
+
+  return GDK_WINDOW_XID(gdk_window_get_toplevel(input_window));
+}
+
+/* Sends what the IM needs when a client gets the focus in one message,
+   followed by the short surrounding, if the IM understands it. Returns
+   FALSE if the separate messages are to be sent instead. */
+static gboolean
+hildon_im_context_send_focus (HildonIMContext *self, HildonIMCommand cmd)
+{
+  XEvent event;
+  HildonIMFocusMessage msg;
+  HildonGtkInputMode input_mode = 0;
+  HildonGtkInputMode default_input_mode = 0;
+  HildonIMInternalModifierMask modifiers;
+  Window client;
+
+  if (self->client_gdk_window == NULL ||
+      !(hildon_im_context_get_peer_caps(self) & HILDON_IM_CAP_FOCUS))
+  {
+    return FALSE;
+  }
+
+  client = GDK_WINDOW_XID(self->client_gdk_window);
+
+  /* The modifiers the bundle carries are all the IM is known to have */
+  hildon_im_context_command_is_redundant(self, cmd);
+
+  hildon_im_context_offer_ring (self);
+  hildon_im_context_offer_state (self);
+
+#if defined(MAEMO_CHANGES) || GTK_CHECK_VERSION(3,0,0)
+  hildon_get_input_mode (self, &input_mode, &default_input_mode);
+#endif
+
+  self->auto_upper_enabled =
+    ( (self->options & HILDON_IM_AUTOCASE) != 0 &&
+      (input_mode & HILDON_GTK_INPUT_MODE_AUTOCAP) != 0);
+
+  /* Showing the IM also checks the autocap state, as
+     hildon_im_context_check_sentence_start() would */
+  if (cmd == HILDON_IM_SETNSHOW && self->has_focus)
+  {
+    self->auto_upper = self->auto_upper_enabled &&
+                       hildon_im_context_is_sentence_start (self);
+  }
+
+  /* Focusing a client clears the sticky modifiers, autocap aside */
+  modifiers = self->mask &
+              (HILDON_IM_SHIFT_LOCK_MASK | HILDON_IM_LEVEL_LOCK_MASK);
+  if (cmd == HILDON_IM_SETNSHOW && self->auto_upper)
+  {
+    modifiers |= HILDON_IM_SHIFT_STICKY_MASK;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.input_window = client;
+  msg.app_window = hildon_im_context_get_app_window(self,
+                                                   self->client_gdk_window);
+  msg.input_mode = input_mode;
+  msg.default_input_mode = default_input_mode;
+  msg.cmd = cmd;
+  msg.trigger = trigger;
+  msg.modifiers = modifiers;
+  if (self->client_gtk_widget != NULL)
+    msg.flags |= HILDON_IM_FOCUS_SURROUNDING;
+  if (self->auto_upper_enabled)
+    msg.flags |= HILDON_IM_FOCUS_AUTOCAP;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_FOCUS, None, &msg, &event);
+
+  hildon_im_context_send_event(self, &event);
+
+  hildon_im_context_shadow_note(self,
+                                HILDON_IM_SHIFT_STICKY_MASK |
+                                HILDON_IM_SHIFT_LOCK_MASK |
+                                HILDON_IM_LEVEL_STICKY_MASK |
+                                HILDON_IM_LEVEL_LOCK_MASK, FALSE);
+  hildon_im_context_shadow_note(self, modifiers, TRUE);
+
+  hildon_im_context_send_surrounding(self, FALSE);
+
+  return TRUE;
+}
+
+/* Sends a client message with the specified command to the IM window */
+static void
+hildon_im_context_send_command(HildonIMContext *self,
+                               HildonIMCommand cmd)
+{
+  XEvent event;
+  HildonIMActivateMessage msg;
+  GdkWindow *input_window = NULL;
+
+  g_return_if_fail (self != NULL);
+
+  if (self->client_gdk_window != NULL)
+  {
+    input_window = self->client_gdk_window;
+  }
+  else
+  {
+    return;
+  }
+
+  if (hildon_im_context_command_is_redundant(self, cmd))
+  {
+    suppressed_commands++;
+    return;
+  }
+
+  /* The IM picks modifier changes up from the state page */
+  if (cmd >= HILDON_IM_SHIFT_LOCKED && cmd <= HILDON_IM_MOD_UNSTICKY &&
+      hildon_im_context_state_publish (self))
+  {
+    return;
+  }
+
+  if (cmd == HILDON_IM_SETCLIENT || cmd == HILDON_IM_SETNSHOW)
+  {
+    hildon_im_context_offer_ring (self);
+    hildon_im_context_offer_state (self);
+    hildon_im_context_send_input_mode (self);
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  if (cmd != HILDON_IM_HIDE)
+  {
+    msg.input_window = GDK_WINDOW_XID(input_window);
+    msg.app_window = hildon_im_context_get_app_window(self, input_window);
+  }
+
+  msg.cmd = cmd;
+  msg.trigger = trigger;
+  msg.capabilities = HILDON_IM_CONTEXT_CAPABILITIES;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_ACTIVATE,
+                         hildon_im_context_get_peer_window(self), &msg, &event);
+
+  hildon_im_context_send_event(self, &event);
+}
+
+/* Sends a shared-memory ring control message straight to the IM window */
+static void
+hildon_im_context_send_ring_control (HildonIMContext *self,
+                                     HildonIMShmRingCommand type)
+{
+  HildonIMShmRingMessage msg;
+  XEvent event;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = type;
+  if (self->client_gdk_window != NULL)
+    msg.input_window = GDK_WINDOW_XID(self->client_gdk_window);
+
+  if (type == HILDON_IM_SHM_RING_ANNOUNCE)
+  {
+    msg.pid = getpid();
+    msg.fd = hildon_im_ring_get_fd(im_ring);
+    msg.n_slots = hildon_im_ring_get_n_slots(im_ring);
+  }
+
+  hildon_im_codec_encode(self->atoms, HILDON_IM_SHM_RING,
+                         hildon_im_context_get_im_window(NULL), &msg, &event);
+
+  /* A vanished IM window shows up as DestroyNotify, no need to wait for
+     the error */
+  hildon_im_context_trap_push_async(gdk_x11_get_default_xdisplay ());
+  XSendEvent(gdk_x11_get_default_xdisplay (), event.xclient.window, False, 0, &event);
+  hildon_im_context_trap_pop_async(gdk_x11_get_default_xdisplay ());
+}
+
+static void
+hildon_im_context_ring_detach (void)
+{
+  HildonIMQueuedEvent *queued;
+
+  im_ring_peer = None;
+  im_ring_offered = None;
+
+  if (im_ring_retry_id != 0)
+  {
+    g_source_remove(im_ring_retry_id);
+    im_ring_retry_id = 0;
+  }
+
+  /* What never made it into the ring goes out as ClientMessages with the
+     next flush, or is held if the IM window is gone */
+  if (!g_queue_is_empty(&im_ring_overflow) &&
+      g_queue_is_empty(&out_queue[HILDON_IM_LANE_URGENT]))
+  {
+    out_queue_since = g_get_monotonic_time();
+  }
+
+  while ((queued = g_queue_pop_tail(&im_ring_overflow)) != NULL)
+  {
+    g_queue_push_head(&out_queue[queued->lane], queued);
+  }
+}
+
+/* Wakes the IM up to drain the ring. This is also the only X request the
+   ring path makes, so it is where a vanished IM is noticed. */
+static void
+hildon_im_context_ring_doorbell (void)
+{
+  HildonIMShmRingMessage msg;
+  XEvent event;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = HILDON_IM_SHM_RING_DOORBELL;
+  hildon_im_codec_encode(hildon_im_protocol_get_atoms(gdk_display_get_default()),
+                         HILDON_IM_SHM_RING, im_ring_peer, &msg, &event);
+
+  /* If the IM went away with the ring, its DestroyNotify detaches the
+     ring and the contexts offer it again to the next IM */
+  hildon_im_context_trap_push_async(gdk_x11_get_default_xdisplay ());
+  XSendEvent(gdk_x11_get_default_xdisplay (), im_ring_peer, False, 0, &event);
+  hildon_im_context_trap_pop_async(gdk_x11_get_default_xdisplay ());
+}
+
+/* Fills a ring slot with a message. Returns FALSE for messages that
+   cannot go through the ring. */
+static gboolean
+hildon_im_context_ring_slot (HildonIMQueuedEvent *queued,
+                             HildonIMRingSlot *slot)
+{
+  HildonIMAtom atom;
+
+  atom = hildon_im_protocol_lookup_atom(queued->context->atoms,
+                                        queued->event.xclient.message_type);
+  if (atom == HILDON_IM_NUM_ATOMS || atom == HILDON_IM_SHM_RING)
+  {
+    return FALSE;
+  }
+
+  memset(slot, 0, sizeof(*slot));
+  slot->atom = atom;
+  slot->format = queued->event.xclient.format;
+  hildon_im_codec_get_data(&queued->event.xclient, slot->data);
+
+  return TRUE;
+}
+
+/* Moves messages that did not fit in the ring into it, in order */
+static gboolean
+hildon_im_context_ring_retry (gpointer data)
+{
+  HildonIMRingSlot slot;
+  gboolean need_doorbell = FALSE;
+  gboolean rang = FALSE;
+
+  while (!g_queue_is_empty(&im_ring_overflow))
+  {
+    hildon_im_context_ring_slot(g_queue_peek_head(&im_ring_overflow), &slot);
+
+    if (!hildon_im_ring_push(im_ring, slot.atom, slot.format, slot.data,
+                             &need_doorbell))
+    {
+      break;
+    }
+
+    hildon_im_queued_event_free(g_queue_pop_head(&im_ring_overflow));
+    rang = rang || need_doorbell;
+  }
+
+  /* Keep knocking while the IM is behind, it may have died */
+  if (rang || !g_queue_is_empty(&im_ring_overflow))
+    hildon_im_context_ring_doorbell();
+
+  if (im_ring_peer == None || g_queue_is_empty(&im_ring_overflow))
+  {
+    im_ring_retry_id = 0;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Offers the shared-memory ring to the IM, once per IM window */
+static void
+hildon_im_context_offer_ring (HildonIMContext *self)
+{
+  Window im_window = hildon_im_context_get_im_window(NULL);
+
+  if (!im_transport_is_x11 ||
+      hildon_im_context_get_display(self) != gdk_display_get_default() ||
+      im_window == None ||
+      im_window == im_ring_offered ||
+      im_ring_unavailable ||
+      !(hildon_im_context_get_peer_caps(self) & HILDON_IM_CAP_SHM_RING))
+  {
+    return;
+  }
+
+  if (im_ring == NULL)
+  {
+    im_ring = hildon_im_ring_new(HILDON_IM_RING_DEFAULT_SLOTS);
+
+    if (im_ring == NULL)
+    {
+      im_ring_unavailable = TRUE;
+      return;
+    }
+  }
+
+  /* Whatever the previous IM left unread is meaningless to the new one */
+  hildon_im_context_ring_detach();
+  hildon_im_ring_reset(im_ring);
+  im_ring_offered = im_window;
+
+  hildon_im_context_send_ring_control(self, HILDON_IM_SHM_RING_ANNOUNCE);
+}
+
+/* Sends a state page control message straight to the IM window */
+static void
+hildon_im_context_send_state_control (HildonIMContext *self,
+                                      HildonIMStateCommand type)
+{
+  HildonIMStateMessage msg;
+  XEvent event;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = type;
+  if (self->client_gdk_window != NULL)
+    msg.input_window = GDK_WINDOW_XID(self->client_gdk_window);
+
+  if (type == HILDON_IM_STATE_ANNOUNCE)
+  {
+    msg.pid = getpid();
+    msg.fd = hildon_im_state_get_fd(im_state);
+  }
+
+  hildon_im_codec_encode(self->atoms, HILDON_IM_STATE,
+                         hildon_im_context_get_im_window(NULL), &msg, &event);
+
+  hildon_im_context_trap_push_async(gdk_x11_get_default_xdisplay ());
+  XSendEvent(gdk_x11_get_default_xdisplay (), event.xclient.window, False, 0, &event);
+  hildon_im_context_trap_pop_async(gdk_x11_get_default_xdisplay ());
+}
+
+static void
+hildon_im_context_state_detach (void)
+{
+  im_state_peer = None;
+  im_state_offered = None;
+  im_state_seen = 0;
+  memset(&im_state_last, 0, sizeof(im_state_last));
+}
+
+/* Offers the state page to the IM, once per IM window */
+static void
+hildon_im_context_offer_state (HildonIMContext *self)
+{
+  Window im_window = hildon_im_context_get_im_window(NULL);
+
+  if (!im_transport_is_x11 ||
+      hildon_im_context_get_display(self) != gdk_display_get_default() ||
+      im_window == None ||
+      im_window == im_state_offered ||
+      im_state_unavailable ||
+      !(hildon_im_context_get_peer_caps(self) & HILDON_IM_CAP_STATE_PAGE))
+  {
+    return;
+  }
+
+  if (im_state == NULL)
+  {
+    im_state = hildon_im_state_new();
+
+    if (im_state == NULL)
+    {
+      im_state_unavailable = TRUE;
+      return;
+    }
+  }
+
+  /* The previous IM's state means nothing to the new one */
+  hildon_im_context_state_detach();
+  hildon_im_state_reset(im_state);
+  im_state_offered = im_window;
+
+  hildon_im_context_send_state_control(self, HILDON_IM_STATE_ANNOUNCE);
+}
+
+/* Writes the modifiers the IM is asked to have into the context's block
+   of the state page, in place of a modifier command. Only bits the
+   context has asked for since the IM last reset its modifiers are set;
+   the IM acts on the bits that changed since it last read the block.
+   Returns FALSE if the page is not in use and the command has to be
+   sent. */
+static gboolean
+hildon_im_context_state_publish (HildonIMContext *self)
+{
+  HildonIMStateValues values;
+  HildonIMStateMessage msg;
+  XEvent event;
+  gboolean need_notify = FALSE;
+
+  if (im_state_peer == None ||
+      im_state_peer != hildon_im_context_get_im_window(NULL) ||
+      self->client_gdk_window == NULL ||
+      hildon_im_context_get_display(self) != gdk_display_get_default())
+  {
+    return FALSE;
+  }
+
+  hildon_im_context_shadow_validate (self);
+
+  memset(&values, 0, sizeof(values));
+  values.input_window = GDK_WINDOW_XID(self->client_gdk_window);
+  values.mask = self->shadow_mask & self->shadow_known &
+                HILDON_IM_STATE_MODIFIERS;
+  values.options = self->options;
+  if (self->auto_upper_enabled)
+    values.flags |= HILDON_IM_STATE_AUTOCAP;
+
+  hildon_im_state_write(im_state, HILDON_IM_STATE_SIDE_CONTEXT, &values,
+                        &need_notify);
+
+  /* An IM that is awake reads the page before it sleeps again */
+  if (need_notify)
+  {
+    memset(&msg, 0, sizeof(msg));
+    msg.input_window = values.input_window;
+    msg.type = HILDON_IM_STATE_CHANGED;
+    hildon_im_codec_encode(self->atoms, HILDON_IM_STATE,
+                           hildon_im_context_get_im_window(NULL), &msg, &event);
+
+    hildon_im_context_send_event(self, &event);
+  }
+
+  return TRUE;
+}
+
+/* Applies what the IM changed in its block of the state page, the way
+   the modifier and option #HildonIMComMessages are applied. Returns
+   FALSE if there was nothing new to read, also when the IM is stuck
+   halfway through a write. */
+static gboolean
+hildon_im_context_state_sync (void)
+{
+  HildonIMStateValues values;
+  HildonIMContext *self = NULL;
+  guint32 changed;
+  guint seq;
+
+  if (im_state_peer == None)
+    return FALSE;
+
+  /* The IM may be gone without its DestroyNotify processed yet */
+  if (im_state_peer != hildon_im_context_get_im_window(NULL))
+  {
+    hildon_im_context_state_detach();
+    return FALSE;
+  }
+
+  seq = hildon_im_state_read(im_state, HILDON_IM_STATE_SIDE_IM, &values,
+                             im_state_seen);
+  if (seq == im_state_seen)
+    return FALSE;
+
+  im_state_seen = seq;
+
+  if (client_windows != NULL && values.input_window != None)
+  {
+    self = g_hash_table_lookup(client_windows,
+                               GUINT_TO_POINTER(values.input_window));
+  }
+
+  /* A new client starts out from the bits the IM set for it */
+  if (values.input_window == im_state_last.input_window)
+    changed = values.mask ^ im_state_last.mask;
+  else
+    changed = values.mask;
+  changed &= HILDON_IM_STATE_MODIFIERS;
+
+  im_state_last = values;
+
+  if (self == NULL)
+    return TRUE;
+
+  if (changed != 0)
+  {
+    self->mask = (self->mask & ~changed) | (values.mask & changed);
+    hildon_im_context_shadow_note(self, changed & values.mask, TRUE);
+    hildon_im_context_shadow_note(self, changed & ~values.mask, FALSE);
+  }
+
+  if (values.options != (guint32) self->options)
+  {
+    /* if autocap was suddenly deactivated, cleanup shift stickiness */
+    if ( (! (values.options & HILDON_IM_AUTOCASE)) &&
+         (self->options & HILDON_IM_AUTOCASE) )
+      {
+        self->mask &= ~HILDON_IM_SHIFT_STICKY_MASK;
+        hildon_im_context_send_command (self, HILDON_IM_SHIFT_UNSTICKY);
+      }
+
+    self->options = values.options;
+  }
+
+  return TRUE;
+}
+
+/* Queues a message for the IM in the shared-memory ring instead of sending
+   it through the X server. Returns FALSE if the caller has to send it as a
+   ClientMessage; otherwise the ring took @queued over. Format 32 data is
+   stored as five 32-bit values. */
+static gboolean
+hildon_im_context_ring_send (HildonIMQueuedEvent *queued)
+{
+  HildonIMRingSlot slot;
+  gboolean need_doorbell = FALSE;
+
+  if (im_ring_peer == None ||
+      im_ring_peer != hildon_im_context_get_im_window(NULL))
+  {
+    return FALSE;
+  }
+
+  if (!hildon_im_context_ring_slot(queued, &slot))
+  {
+    return FALSE;
+  }
+
+  /* Once something had to wait, everything after it waits too; mixing in
+     ClientMessages here would let the IM see them out of order. The
+     message itself is kept, so that it can still go out as a
+     ClientMessage if the ring is closed. */
+  if (!g_queue_is_empty(&im_ring_overflow) ||
+      !hildon_im_ring_push(im_ring, slot.atom, slot.format, slot.data,
+                           &need_doorbell))
+  {
+    g_queue_push_tail(&im_ring_overflow, queued);
+
+    if (im_ring_retry_id == 0)
+    {
+      hildon_im_context_ring_doorbell();
+      if (im_ring_peer != None)
+        im_ring_retry_id = g_timeout_add(HILDON_IM_RING_RETRY_INTERVAL,
+                                         hildon_im_context_ring_retry, NULL);
+    }
+
+    return TRUE;
+  }
+
+  hildon_im_queued_event_free(queued);
+
+  if (need_doorbell)
+  {
+    hildon_im_context_ring_doorbell();
+  }
+
+  return TRUE;
+}
+
+#if !GTK_CHECK_VERSION(3,0,0)
+static int
+hildon_im_context_x_error (Display *display, XErrorEvent *error)
+{
+  HildonIMAsyncTrap *trap;
+  guint i;
+
+  for (i = 0; async_traps != NULL && i < async_traps->len; i++)
+  {
+    trap = &g_array_index(async_traps, HildonIMAsyncTrap, i);
+    if (trap->display == display &&
+        error->serial >= trap->first && error->serial <= trap->last)
+    {
+      return 0;
+    }
+  }
+
+  return previous_x_error_handler(display, error);
+}
+
+/* Forgets the closed ranges the X server of @display is known to have
+   processed */
+static void
+hildon_im_context_trap_prune (Display *display)
+{
+  gulong processed = LastKnownRequestProcessed(display);
+  HildonIMAsyncTrap *trap;
+  guint i = 0;
+
+  while (i < async_traps->len)
+  {
+    trap = &g_array_index(async_traps, HildonIMAsyncTrap, i);
+    if (trap->display == display &&
+        trap->last != HILDON_IM_ASYNC_TRAP_OPEN && trap->last <= processed)
+      g_array_remove_index(async_traps, i);
+    else
+      i++;
+  }
+}
+#endif
+
+/* Like gdk_error_trap_push(), for requests to @display whose errors are
+   ignored. The matching pop does not wait for the X server; errors are
+   matched to the trapped requests by serial whenever they arrive. */
+static void
+hildon_im_context_trap_push_async (Display *display)
+{
+#if GTK_CHECK_VERSION(3,0,0)
+  gdk_error_trap_push();
+#else
+  HildonIMAsyncTrap trap;
+
+  if (previous_x_error_handler == NULL)
+  {
+    previous_x_error_handler = XSetErrorHandler(hildon_im_context_x_error);
+  }
+
+  if (async_traps == NULL)
+  {
+    async_traps = g_array_new(FALSE, FALSE, sizeof(HildonIMAsyncTrap));
+  }
+
+  hildon_im_context_trap_prune(display);
+
+  /* Errors of requests sent while the range is open match it too */
+  trap.display = display;
+  trap.first = NextRequest(display);
+  trap.last = HILDON_IM_ASYNC_TRAP_OPEN;
+  g_array_append_val(async_traps, trap);
+#endif
+}
+
+static void
+hildon_im_context_trap_pop_async (Display *display)
+{
+#if GTK_CHECK_VERSION(3,0,0)
+  gdk_error_trap_pop_ignored();
+#else
+  HildonIMAsyncTrap *trap;
+  guint i;
+
+  /* Pushes nest, so this closes the innermost range still open */
+  for (i = async_traps->len; i > 0; i--)
+  {
+    trap = &g_array_index(async_traps, HildonIMAsyncTrap, i - 1);
+    if (trap->display == display && trap->last == HILDON_IM_ASYNC_TRAP_OPEN)
+    {
+      trap->last = NextRequest(display) - 1;
+      break;
+    }
+  }
+#endif
+  XFlush(display);
+}
+
+static void
+hildon_im_queued_event_free (HildonIMQueuedEvent *queued)
+{
+  g_object_unref(queued->context);
+  g_free(queued->property);
+  g_free(queued);
+}
+
+static void
+hildon_im_sent_batch_free (HildonIMSentBatch *sent)
+{
+  HildonIMQueuedEvent *queued;
+
+  while ((queued = g_queue_pop_head(&sent->events)) != NULL)
+  {
+    hildon_im_queued_event_free(queued);
+  }
+
+  g_free(sent);
+}
+
+/* Keeps what one flush sent to an IM window until the X server is known
+   to have processed it */
+static void
+hildon_im_context_sent_close (HildonIMSentBatch *sent)
+{
+  sent->last_serial = NextRequest(sent->display) - 1;
+  g_queue_push_tail(&sent_batches, sent);
+}
+
+/* Forgets the flushes the X server is known to have processed */
+static void
+hildon_im_context_retire_sent (void)
+{
+  HildonIMSentBatch *sent;
+
+  while ((sent = g_queue_peek_head(&sent_batches)) != NULL &&
+         (g_queue_get_length(&sent_batches) > HILDON_IM_SENT_BATCHES_MAX ||
+          LastKnownRequestProcessed(sent->display) >= sent->last_serial))
+  {
+    hildon_im_sent_batch_free(g_queue_pop_head(&sent_batches));
+  }
+}
+
+/* Whether a message describes the client's state, which an IM started
+   later still needs. Key events and one-off commands are stale by then
+   and are not worth replaying. */
+static gboolean
+hildon_im_context_is_state (HildonIMQueuedEvent *queued)
+{
+  HildonIMContext *self = queued->context;
+  Atom message_type = queued->event.xclient.message_type;
+  HildonIMActivateMessage *msg =
+    (HildonIMActivateMessage *) &queued->event.xclient.data;
+
+  if (message_type == self->atoms[HILDON_IM_ACTIVATE])
+  {
+    return msg->cmd != HILDON_IM_DESTROY &&
+           msg->cmd != HILDON_IM_CLEAR &&
+           msg->cmd != HILDON_IM_SELECT_ALL;
+  }
+
+  return message_type == self->atoms[HILDON_IM_FOCUS] ||
+         message_type == self->atoms[HILDON_IM_INPUT_MODE] ||
+         message_type == self->atoms[HILDON_IM_CURSOR] ||
+         message_type == self->atoms[HILDON_IM_SURROUNDING] ||
+         message_type == self->atoms[HILDON_IM_SURROUNDING_CONTENT] ||
+         message_type == self->atoms[HILDON_IM_BULK];
+}
+
+/* Keeps a state message until there is an IM window again */
+static void
+hildon_im_context_hold (HildonIMQueuedEvent *queued)
+{
+  if (!hildon_im_context_is_state(queued))
+  {
+    hildon_im_queued_event_free(queued);
+    return;
+  }
+
+  g_queue_push_tail(&held_queue, queued);
+
+  while (g_queue_get_length(&held_queue) > HILDON_IM_HELD_MAX)
+  {
+    hildon_im_queued_event_free(g_queue_pop_head(&held_queue));
+  }
+}
+
+/* Called for the DestroyNotify of an IM window. Messages for it that the
+   server processed after @serial hit a destroyed window, so the state
+   among them is held for the IM's successor, ahead of anything held
+   since. Flushes to the IMs of other displays are kept. */
+static void
+hildon_im_context_resend_lost (Display *display, Window window, gulong serial)
+{
+  GQueue lost = G_QUEUE_INIT;
+  HildonIMSentBatch *sent;
+  HildonIMQueuedEvent *queued;
+  GList *link;
+  GList *next;
+
+  for (link = sent_batches.head; link != NULL; link = next)
+  {
+    next = link->next;
+    sent = link->data;
+
+    if (sent->display != display)
+      continue;
+
+    while (sent->window == window &&
+           (queued = g_queue_pop_head(&sent->events)) != NULL)
+    {
+      if (queued->serial > serial && hildon_im_context_is_state(queued))
+        g_queue_push_tail(&lost, queued);
+      else
+        hildon_im_queued_event_free(queued);
+    }
+
+    g_queue_delete_link(&sent_batches, link);
+    hildon_im_sent_batch_free(sent);
+  }
+
+  while ((queued = g_queue_pop_tail(&lost)) != NULL)
+  {
+    g_queue_push_head(&held_queue, queued);
+  }
+
+  while (g_queue_get_length(&held_queue) > HILDON_IM_HELD_MAX)
+  {
+    hildon_im_queued_event_free(g_queue_pop_head(&held_queue));
+  }
+}
+
+/* Puts the held messages back in front of their outgoing lanes once a
+   new IM window is known; they go out with the next flush */
+static void
+hildon_im_context_release_held (void)
+{
+  HildonIMQueuedEvent *queued;
+
+  if (g_queue_is_empty(&held_queue))
+  {
+    return;
+  }
+
+  if (g_queue_is_empty(&out_queue[HILDON_IM_LANE_URGENT]))
+  {
+    out_queue_since = g_get_monotonic_time();
+  }
+
+  while ((queued = g_queue_pop_tail(&held_queue)) != NULL)
+  {
+    g_queue_push_head(&out_queue[queued->lane], queued);
+  }
+}
+
+static void
+hildon_im_context_transport_receive (HildonIMTransport *transport,
+                                     const HildonIMTransportMessage *message,
+                                     gpointer user_data)
+{
+  HildonIMContext *self;
+
+  self = g_hash_table_lookup(client_windows, GUINT_TO_POINTER(message->window));
+  if (self != NULL)
+  {
+    hildon_im_context_handle_message(self, message);
+  }
+}
+
+static void
+hildon_im_context_transport_bulk (HildonIMTransport *transport,
+                                  guint32 window,
+                                  HildonIMAtom content,
+                                  const gchar *text,
+                                  gsize length,
+                                  gpointer user_data)
+{
+  HildonIMContext *self;
+
+  self = g_hash_table_lookup(client_windows, GUINT_TO_POINTER(window));
+  if (self != NULL && content == HILDON_IM_INSERT_UTF8)
+  {
+    /* The whole text arrives at once, as a single END chunk would */
+    hildon_im_reassembly_reset(self->incoming_preedit_buffer);
+    hildon_im_context_insert_utf8(self, HILDON_IM_MSG_END, text);
+  }
+}
+
+/* Returns where the traffic with the IM is captured to, or NULL. Capture
+   is enabled by setting HILDON_IM_CAPTURE to a path; each process writes
+   to <path>.<pid>, see hildon-im-capture-decode. */
+static HildonIMCapture *
+hildon_im_context_get_capture (void)
+{
+  const gchar *spec;
+  gchar *path;
+
+  if (G_LIKELY(capture_checked))
+  {
+    return capture;
+  }
+
+  capture_checked = TRUE;
+
+  spec = g_getenv("HILDON_IM_CAPTURE");
+  if (spec != NULL && spec[0] != '\0')
+  {
+    path = g_strdup_printf("%s.%d", spec, (gint) getpid());
+    capture = hildon_im_capture_new(path, HILDON_IM_CAPTURE_DEFAULT_RECORDS);
+    g_free(path);
+  }
+
+  return capture;
+}
+
+/* Returns the transport towards the IM, which all contexts share. It is
+   the one last given with hildon_im_transport_set_for_display() for the
+   default display, else X11 unless HILDON_IM_TRANSPORT is
+   "socket:<path>" and that socket accepts the connection, or
+   "x11-thread" to send from a thread of its own. */
+static HildonIMTransport *
+hildon_im_context_get_transport (void)
+{
+  HildonIMTransport *chosen;
+  const gchar *spec;
+
+  /* The application may replace the transport at any time */
+  chosen = hildon_im_transport_steal_for_display(gdk_display_get_default());
+  if (chosen != NULL)
+  {
+    hildon_im_transport_free(im_transport);
+    im_transport = chosen;
+    hildon_im_context_use_transport(im_transport);
+  }
+
+  if (im_transport != NULL)
+  {
+    return im_transport;
+  }
+
+  spec = g_getenv("HILDON_IM_TRANSPORT");
+  if (spec != NULL && g_str_has_prefix(spec, "socket:"))
+  {
+    im_transport = hildon_im_transport_socket_new(spec + strlen("socket:"));
+  }
+  else if (g_strcmp0(spec, "x11-thread") == 0)
+  {
+    im_transport = hildon_im_transport_x11_thread_new(gdk_display_get_default());
+  }
+
+  if (im_transport == NULL)
+  {
+    im_transport = hildon_im_transport_x11_new(gdk_display_get_default());
+  }
+
+  hildon_im_context_use_transport(im_transport);
+
+  return im_transport;
+}
+
+/* Sets up the context side of a new transport */
+static void
+hildon_im_context_use_transport (HildonIMTransport *transport)
+{
+  const gchar *name = hildon_im_transport_get_name(transport);
+
+  im_transport_is_x11 = strcmp(name, "x11") == 0;
+  im_transport_threaded = strcmp(name, "x11-thread") == 0;
+  hildon_im_transport_set_receive_func(transport,
+                                       hildon_im_context_transport_receive,
+                                       hildon_im_context_transport_bulk,
+                                       NULL);
+  hildon_im_transport_set_closed_func(transport,
+                                      hildon_im_context_transport_closed,
+                                      NULL);
+}
+
+/* The IM on the other end of the transport went away. The X server is
+   the only way left to reach an IM, which has not heard of the clients
+   yet, so the focused contexts introduce theirs again. */
+static void
+hildon_im_context_transport_closed (HildonIMTransport *transport,
+                                    gpointer user_data)
+{
+  GHashTableIter iter;
+  gpointer value;
+  HildonIMContext *self;
+
+  if (transport != im_transport)
+  {
+    return;
+  }
+
+  g_warning("Lost the \"%s\" IM transport, going back to X11",
+            hildon_im_transport_get_name(transport));
+
+  hildon_im_transport_free(im_transport);
+  im_transport = hildon_im_transport_x11_new(gdk_display_get_default());
+  hildon_im_context_use_transport(im_transport);
+
+  hildon_im_context_release_held();
+
+  g_hash_table_iter_init(&iter, client_windows);
+  while (g_hash_table_iter_next(&iter, NULL, &value))
+  {
+    self = value;
+    if (self->has_focus &&
+        !hildon_im_context_send_focus(self, HILDON_IM_SETCLIENT))
+    {
+      hildon_im_context_send_command(self, HILDON_IM_SETCLIENT);
+    }
+  }
+}
+
+/* Hands a queued message to the transport. Transports that do not go
+   through X do not know the IM window, so they get the client window the
+   message is about. Returns FALSE if the transport could not take it. */
+static gboolean
+hildon_im_context_transport_send (HildonIMTransport *transport,
+                                  HildonIMQueuedEvent *queued)
+{
+  HildonIMTransportMessage message;
+
+  if (!hildon_im_transport_x11_decode(queued->context->atoms,
+                                      &queued->event.xclient, &message))
+  {
+    return TRUE;
+  }
+
+  if (!im_transport_is_x11 && !im_transport_threaded)
+  {
+    message.window = queued->context->client_gdk_window != NULL ?
+      GDK_WINDOW_XID(queued->context->client_gdk_window) : None;
+  }
+
+  return hildon_im_transport_send(transport, &message);
+}
+
+/* Tells which state update a message is, if any */
+static HildonIMSupersede
+hildon_im_context_get_supersede (HildonIMContext *self, const XEvent *event)
+{
+  const HildonIMActivateMessage *msg;
+
+  if (event->xclient.message_type == self->atoms[HILDON_IM_INPUT_MODE])
+  {
+    return HILDON_IM_SUPERSEDE_INPUT_MODE;
+  }
+
+  if (event->xclient.message_type == self->atoms[HILDON_IM_CURSOR])
+  {
+    return HILDON_IM_SUPERSEDE_CURSOR;
+  }
+
+  if (event->xclient.message_type == self->atoms[HILDON_IM_SURROUNDING] ||
+      event->xclient.message_type == self->atoms[HILDON_IM_SURROUNDING_CONTENT])
+  {
+    return HILDON_IM_SUPERSEDE_SURROUNDING;
+  }
+
+  if (event->xclient.message_type != self->atoms[HILDON_IM_ACTIVATE])
+  {
+    return HILDON_IM_SUPERSEDE_NONE;
+  }
+
+  msg = (const HildonIMActivateMessage *) &event->xclient.data;
+  switch (msg->cmd)
+  {
+    case HILDON_IM_SHIFT_LOCKED:
+    case HILDON_IM_SHIFT_UNLOCKED:
+      return HILDON_IM_SUPERSEDE_SHIFT_LOCK;
+    case HILDON_IM_SHIFT_STICKY:
+    case HILDON_IM_SHIFT_UNSTICKY:
+      return HILDON_IM_SUPERSEDE_SHIFT_STICKY;
+    case HILDON_IM_MOD_LOCKED:
+    case HILDON_IM_MOD_UNLOCKED:
+      return HILDON_IM_SUPERSEDE_MOD_LOCK;
+    case HILDON_IM_MOD_STICKY:
+    case HILDON_IM_MOD_UNSTICKY:
+      return HILDON_IM_SUPERSEDE_MOD_STICKY;
+    default:
+      return HILDON_IM_SUPERSEDE_NONE;
+  }
+}
+
+/* Returns the position just after the newest queued message that makes
+   the IM switch clients, or 0 if there is none */
+static guint64
+hildon_im_context_client_switch_order (void)
+{
+  GQueue *queues[2];
+  GList *link;
+  HildonIMQueuedEvent *queued;
+  guint i;
+
+  queues[0] = &out_queue[HILDON_IM_LANE_URGENT];
+  queues[1] = &held_queue;
+
+  for (i = 0; i < G_N_ELEMENTS(queues); i++)
+  {
+    for (link = queues[i]->tail; link != NULL; link = link->prev)
+    {
+      queued = link->data;
+      if (hildon_im_context_changes_client(queued))
+        return queued->order + 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Drops the state updates of @self that a newer one of the same kind
+   makes redundant and that were not sent yet. Input modes and modifier
+   states apply to the key events that follow them, so no update queued
+   before a key event of @self is dropped. The IM applies updates to the
+   client it last switched to, so none queued before a switch of any
+   context is dropped either. */
+static void
+hildon_im_context_drop_superseded (HildonIMContext *self,
+                                   HildonIMSupersede supersede)
+{
+  GQueue *queues[2];
+  GList *link;
+  GList *prev;
+  HildonIMQueuedEvent *queued;
+  guint64 barrier;
+  guint i;
+
+  queues[0] = &out_queue[supersede == HILDON_IM_SUPERSEDE_SURROUNDING ?
+                         HILDON_IM_LANE_BULK : HILDON_IM_LANE_URGENT];
+  queues[1] = &held_queue;
+
+  barrier = hildon_im_context_client_switch_order();
+
+  for (i = 0; i < G_N_ELEMENTS(queues); i++)
+  {
+    for (link = queues[i]->tail; link != NULL; link = prev)
+    {
+      prev = link->prev;
+      queued = link->data;
+
+      if (queued->order < barrier)
+        return;
+
+      if (queued->context != self)
+        continue;
+
+      if (supersede != HILDON_IM_SUPERSEDE_SURROUNDING &&
+          (queued->event.xclient.message_type ==
+             self->atoms[HILDON_IM_KEY_EVENT] ||
+           queued->event.xclient.message_type ==
+             self->atoms[HILDON_IM_KEY_EVENTS]))
+      {
+        return;
+      }
+
+      if (hildon_im_context_get_supersede(self, &queued->event) == supersede)
+      {
+        g_queue_delete_link(queues[i], link);
+        hildon_im_queued_event_free(queued);
+        bulk_lane_stats.superseded++;
+      }
+    }
+  }
+}
+
+/* Whether the bulk lane waits for the IM to confirm surroundings. An IM
+   that does not confirm them within HILDON_IM_ACK_TIMEOUT is assumed to
+   have dropped the confirmations. */
+static gboolean
+hildon_im_context_bulk_blocked (gint64 now)
+{
+  if (surrounding_unacked < HILDON_IM_SURROUNDING_IN_FLIGHT)
+  {
+    return FALSE;
+  }
+
+  if (now - surrounding_unacked_since >= HILDON_IM_ACK_TIMEOUT * 1000)
+  {
+    surrounding_unacked = 0;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Whether a queued message makes the IM switch to a client */
+static gboolean
+hildon_im_context_changes_client (HildonIMQueuedEvent *queued)
+{
+  HildonIMActivateMessage *msg =
+    (HildonIMActivateMessage *) &queued->event.xclient.data;
+
+  if (queued->event.xclient.message_type ==
+        queued->context->atoms[HILDON_IM_FOCUS])
+  {
+    return TRUE;
+  }
+
+  return queued->event.xclient.message_type ==
+           queued->context->atoms[HILDON_IM_ACTIVATE] &&
+         (msg->cmd == HILDON_IM_SETCLIENT || msg->cmd == HILDON_IM_SETNSHOW);
+}
+
+/* Moves the head of the bulk lane to the batch */
+static void
+hildon_im_context_take_bulk (GQueue *batch, gint64 now)
+{
+  HildonIMQueuedEvent *queued;
+  gint64 wait;
+
+  queued = g_queue_pop_head(&out_queue[HILDON_IM_LANE_BULK]);
+  wait = now - queued->queued;
+
+  bulk_lane_stats.sent++;
+  bulk_lane_stats.wait_total += wait;
+  bulk_lane_stats.wait_max = MAX(bulk_lane_stats.wait_max, wait);
+
+  /* The header ends a surrounding, which the IM may confirm */
+  if (queued->event.xclient.message_type ==
+        queued->context->atoms[HILDON_IM_SURROUNDING] &&
+      (hildon_im_context_get_peer_caps(queued->context) & HILDON_IM_CAP_ACK))
+  {
+    if (surrounding_unacked++ == 0)
+      surrounding_unacked_since = now;
+  }
+
+  g_queue_push_tail(batch, queued);
+}
+
+/* Whether the bulk messages queued before an urgent one have to go out
+   ahead of it. The IM takes surroundings and committed preedits to be
+   about the client it was last told of, and a committed preedit has to
+   reach it before the keys typed after it. */
+static gboolean
+hildon_im_context_must_follow_bulk (HildonIMQueuedEvent *queued)
+{
+  HildonIMContext *self = queued->context;
+  Atom message_type = queued->event.xclient.message_type;
+  HildonIMQueuedEvent *earlier;
+  GList *link;
+
+  if (hildon_im_context_changes_client(queued))
+  {
+    return TRUE;
+  }
+
+  if (message_type != self->atoms[HILDON_IM_KEY_EVENT] &&
+      message_type != self->atoms[HILDON_IM_KEY_EVENTS])
+  {
+    return FALSE;
+  }
+
+  for (link = out_queue[HILDON_IM_LANE_BULK].head; link != NULL;
+       link = link->next)
+  {
+    earlier = link->data;
+    if (earlier->order > queued->order)
+      break;
+
+    if (earlier->event.xclient.message_type ==
+          earlier->context->atoms[HILDON_IM_PREEDIT_COMMITTED] ||
+        earlier->event.xclient.message_type ==
+          earlier->context->atoms[HILDON_IM_PREEDIT_COMMITTED_CONTENT])
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/* Takes the urgent lane and at most HILDON_IM_BULK_LANE_BUDGET messages
+   of the bulk lane for one flush. Urgent messages go first, except that
+   the bulk messages an urgent one must not overtake go right before it,
+   whatever the budget. The rest of the bulk lane is left alone while the
+   IM is behind on surroundings, so newer ones can still replace what is
+   queued, unless the lane is being drained. */
+static void
+hildon_im_context_take_batch (GQueue *batch)
+{
+  GQueue *bulk = &out_queue[HILDON_IM_LANE_BULK];
+  GQueue urgent = out_queue[HILDON_IM_LANE_URGENT];
+  HildonIMQueuedEvent *queued;
+  HildonIMQueuedEvent *head;
+  gint64 now;
+  guint n;
+
+  g_queue_init(&out_queue[HILDON_IM_LANE_URGENT]);
+  out_queue_since = 0;
+  now = g_get_monotonic_time();
+
+  while ((queued = g_queue_pop_head(&urgent)) != NULL)
+  {
+    if (!g_queue_is_empty(bulk) &&
+        hildon_im_context_must_follow_bulk(queued))
+    {
+      while ((head = g_queue_peek_head(bulk)) != NULL &&
+             head->order < queued->order)
+      {
+        hildon_im_context_take_bulk(batch, now);
+      }
+    }
+    else if (!g_queue_is_empty(bulk))
+    {
+      bulk_lane_stats.overtaken++;
+    }
+
+    g_queue_push_tail(batch, queued);
+  }
+
+  if (g_queue_is_empty(bulk))
+  {
+    return;
+  }
+
+  for (n = 0; !g_queue_is_empty(bulk) &&
+              (out_queue_draining ||
+               (n < HILDON_IM_BULK_LANE_BUDGET &&
+                !hildon_im_context_bulk_blocked(now))); n++)
+  {
+    hildon_im_context_take_bulk(batch, now);
+  }
+
+  if (!g_queue_is_empty(bulk))
+  {
+    if (hildon_im_context_bulk_blocked(now))
+      bulk_lane_stats.blocked_flushes++;
+    else
+      bulk_lane_stats.deferred_flushes++;
+  }
+}
+
+/* Records the messages of a batch in the capture, as they go out. Key
+   records merged and messages superseded while queued are thus seen
+   the way the IM gets them. */
+static void
+hildon_im_context_capture_batch (GQueue *batch)
+{
+  HildonIMTransportMessage message;
+  HildonIMQueuedEvent *queued;
+  GList *link;
+
+  if (hildon_im_context_get_capture() == NULL)
+    return;
+
+  for (link = batch->head; link != NULL; link = link->next)
+  {
+    queued = link->data;
+
+    if (queued->captured)
+      continue;
+    queued->captured = TRUE;
+
+    if (hildon_im_transport_x11_decode(queued->context->atoms,
+                                       &queued->event.xclient, &message))
+    {
+      hildon_im_capture_record(capture, HILDON_IM_CAPTURE_OUT,
+                               queued->context->id, message.atom,
+                               message.format, message.data);
+    }
+  }
+}
+
+/* Flushes both lanes completely, for what must not overtake anything
+   still queued */
+static void
+hildon_im_context_drain_queue (void)
+{
+  out_queue_draining = TRUE;
+  hildon_im_context_flush_queue();
+  out_queue_draining = FALSE;
+}
+
+/* Sends what hildon_im_context_send_event() queued during this main loop
+   iteration, urgent messages first. The X sends share one error trap that
+   does not wait for the server; a send that hit a destroyed IM window is
+   noticed through the window's DestroyNotify and repeated to the next IM. */
+static void
+hildon_im_context_flush_queue (void)
+{
+  GdkDisplay *default_display = gdk_display_get_default();
+  GQueue batch = G_QUEUE_INIT;
+  HildonIMSentBatch *sent = NULL;
+  HildonIMQueuedEvent *queued;
+  gboolean knock = FALSE;
+  gboolean is_focus;
+
+  HildonIMTransport *transport;
+
+  hildon_im_context_retire_sent();
+
+  if (g_queue_is_empty(&out_queue[HILDON_IM_LANE_URGENT]) &&
+      g_queue_is_empty(&out_queue[HILDON_IM_LANE_BULK]))
+  {
+    return;
+  }
+
+  /* Anything sent while flushing goes into the next batch */
+  hildon_im_context_take_batch(&batch);
+  hildon_im_context_capture_batch(&batch);
+
+  transport = hildon_im_context_get_transport();
+  if (!im_transport_is_x11)
+  {
+    while ((queued = g_queue_pop_head(&batch)) != NULL)
+    {
+      if (im_transport_threaded)
+      {
+        Window window = hildon_im_context_get_im_window(NULL);
+
+        if (window == None)
+        {
+          hildon_im_context_hold(queued);
+          continue;
+        }
+
+        queued->event.xclient.window = window;
+        hildon_im_transport_x11_set_target(transport, window);
+      }
+
+      /* State is kept for the transport the IM comes back on */
+      if (!hildon_im_context_transport_send(transport, queued))
+        hildon_im_context_hold(queued);
+      else
+        hildon_im_queued_event_free(queued);
+    }
+
+    return;
+  }
+
+  hildon_im_context_trap_push_async(GDK_DISPLAY_XDISPLAY(default_display));
+
+  while ((queued = g_queue_pop_head(&batch)) != NULL)
+  {
+    GdkDisplay *gdk_display = hildon_im_context_get_display(queued->context);
+    Display *display = GDK_DISPLAY_XDISPLAY(gdk_display);
+    gboolean is_default = gdk_display == default_display;
+    Window window = hildon_im_context_get_im_window(gdk_display);
+
+    if (window == None)
+    {
+      hildon_im_context_hold(queued);
+      continue;
+    }
+
+    queued->event.xclient.window = window;
+
+    /* The trap around the flush only covers the default display */
+    if (!is_default)
+      hildon_im_context_trap_push_async(display);
+
+    /* Written only now, so that no payload queued after this one can
+       replace the property before the IM has read it */
+    if (queued->property != NULL)
+    {
+      HildonIMBulkMessage *bulk =
+        (HildonIMBulkMessage *) &queued->event.xclient.data;
+
+      XChangeProperty(display, bulk->input_window,
+                      queued->context->atoms[bulk->content],
+                      gdk_x11_get_xatom_by_name_for_display(gdk_display,
+                                                            "UTF8_STRING"),
+                      8, PropModeReplace, (unsigned char *) queued->property,
+                      queued->property_length);
+    }
+
+    /* A focus change always reaches the X server once, so an IM that
+       died while it was draining the ring does not go unnoticed */
+    is_focus = hildon_im_context_changes_client(queued);
+
+    if (is_default && hildon_im_context_ring_send(queued))
+    {
+      knock = knock || is_focus;
+      continue;
+    }
+
+    if (sent != NULL && (sent->display != display || sent->window != window))
+    {
+      hildon_im_context_sent_close(sent);
+      sent = NULL;
+    }
+
+    if (sent == NULL)
+    {
+      sent = g_new0(HildonIMSentBatch, 1);
+      sent->display = display;
+      sent->window = window;
+      g_queue_init(&sent->events);
+    }
+
+    queued->serial = NextRequest(display);
+    if (is_default)
+    {
+      hildon_im_transport_x11_set_target(transport, window);
+      hildon_im_context_transport_send(transport, queued);
+    }
+    else
+    {
+      /* The transport only talks to the default display */
+      XSendEvent(display, window, False, 0, &queued->event);
+      hildon_im_context_trap_pop_async(display);
+    }
+    g_queue_push_tail(&sent->events, queued);
+  }
+
+  hildon_im_context_trap_pop_async(GDK_DISPLAY_XDISPLAY(default_display));
+
+  if (sent != NULL)
+  {
+    hildon_im_context_sent_close(sent);
+  }
+
+  if (knock && im_ring_peer != None)
+  {
+    hildon_im_context_ring_doorbell();
+  }
+}
+
+/* Drops everything queued towards the IM, with the context references the
+   messages hold, and detaches the outgoing queue source. The ring and the
+   state page are unmapped; the IM notices when the window it was given
+   them by goes away. */
+static void
+hildon_im_context_queues_free (void)
+{
+  HildonIMQueuedEvent *queued;
+  HildonIMSentBatch *sent;
+  guint i;
+
+  if (out_queue_source != NULL)
+  {
+    g_source_destroy(out_queue_source);
+    g_source_unref(out_queue_source);
+    out_queue_source = NULL;
+  }
+
+  if (im_ring_retry_id != 0)
+  {
+    g_source_remove(im_ring_retry_id);
+    im_ring_retry_id = 0;
+  }
+
+  while ((queued = g_queue_pop_head(&im_ring_overflow)) != NULL)
+    hildon_im_queued_event_free(queued);
+
+  for (i = 0; i < HILDON_IM_NUM_LANES; i++)
+  {
+    while ((queued = g_queue_pop_head(&out_queue[i])) != NULL)
+      hildon_im_queued_event_free(queued);
+  }
+  out_queue_since = 0;
+
+  while ((queued = g_queue_pop_head(&held_queue)) != NULL)
+    hildon_im_queued_event_free(queued);
+
+  while ((sent = g_queue_pop_head(&sent_batches)) != NULL)
+    hildon_im_sent_batch_free(sent);
+
+  hildon_im_context_ring_detach();
+  hildon_im_ring_free(im_ring);
+  im_ring = NULL;
+  im_ring_unavailable = FALSE;
+
+  hildon_im_context_state_detach();
+  hildon_im_state_free(im_state);
+  im_state = NULL;
+  im_state_unavailable = FALSE;
+}
+
+/* Flushes the outgoing queue right before the main loop polls. The source
+   has a higher priority than GDK's event source, so replies read by the
+   flush are still seen by GDK's prepare in the same iteration. While the
+   bulk lane is not empty the poll does not block, so its remainder goes
+   out in the next iteration, after any input that arrived meanwhile,
+   unless it waits for the IM, which is given until the ack timeout. */
+static gboolean
+out_queue_prepare (GSource *source, gint *timeout)
+{
+  gboolean state_stalled = FALSE;
+  gint64 now;
+
+  /* Tell the IM to notify us of state changes from here on, and pick up
+     whatever it wrote while we were awake. An IM stuck inside a write
+     cannot notify us, so it is looked at again after a while instead. */
+  if (im_state_peer != None)
+  {
+    hildon_im_context_state_sync();
+    while (im_state_peer != None &&
+           !hildon_im_state_sleep(im_state, HILDON_IM_STATE_SIDE_CONTEXT,
+                                  im_state_seen))
+    {
+      if (!hildon_im_context_state_sync())
+      {
+        state_stalled = im_state_peer != None;
+        break;
+      }
+    }
+  }
+
+  hildon_im_context_flush_queue();
+
+  if (g_queue_is_empty(&out_queue[HILDON_IM_LANE_BULK]))
+  {
+    *timeout = state_stalled ? HILDON_IM_STATE_STALL_RETRY : -1;
+    return FALSE;
+  }
+
+  now = g_get_monotonic_time();
+  if (hildon_im_context_bulk_blocked(now))
+  {
+    *timeout = (surrounding_unacked_since + HILDON_IM_ACK_TIMEOUT * 1000 -
+                now) / 1000 + 1;
+  }
+  else
+  {
+    *timeout = 0;
+  }
+
+  if (state_stalled)
+    *timeout = MIN(*timeout, HILDON_IM_STATE_STALL_RETRY);
+
+  return FALSE;
+}
+
+static gboolean
+out_queue_check (GSource *source)
+{
+  /* Awake again; the IM's writes are read in the next prepare */
+  if (im_state_peer != None)
+    hildon_im_state_wake(im_state, HILDON_IM_STATE_SIDE_CONTEXT);
+
+  return FALSE;
+}
+
+static gboolean
+out_queue_dispatch (GSource *source, GSourceFunc callback, gpointer data)
+{
+  return TRUE;
+}
+
+static GSourceFuncs out_queue_funcs =
+{
+  out_queue_prepare,
+  out_queue_check,
+  out_queue_dispatch,
+  NULL
+};
+
+/* Text the IM only needs eventually; everything else may be waited for */
+static HildonIMLane
+hildon_im_context_get_lane (HildonIMContext *self, Atom message_type)
+{
+  if (message_type == self->atoms[HILDON_IM_SURROUNDING] ||
+      message_type == self->atoms[HILDON_IM_SURROUNDING_CONTENT] ||
+      message_type == self->atoms[HILDON_IM_PREEDIT_COMMITTED] ||
+      message_type == self->atoms[HILDON_IM_PREEDIT_COMMITTED_CONTENT] ||
+      message_type == self->atoms[HILDON_IM_BULK])
+  {
+    return HILDON_IM_LANE_BULK;
+  }
+
+  return HILDON_IM_LANE_URGENT;
+}
+
+/* Queues a message for the IM. It is sent, together with everything else
+   queued in the same main loop iteration, before the main loop sleeps
+   again, or right away once the oldest urgent message is older than
+   HILDON_IM_QUEUE_DEADLINE. Within a lane messages keep their order. */
+static void
+hildon_im_context_send_event(HildonIMContext *self, XEvent *event)
+{
+  hildon_im_context_send_event_full(self, event, NULL, 0);
+}
+
+/* Like hildon_im_context_send_event(), for a HILDON_IM_BULK notification
+   whose piece is written to the property when it goes out */
+static void
+hildon_im_context_send_event_full(HildonIMContext *self, XEvent *event,
+                                  const gchar *property, gsize length)
+{
+  HildonIMQueuedEvent *queued;
+  HildonIMSupersede supersede;
+  GQueue *lane;
+  gint64 now;
+
+  g_return_if_fail(event);
+
+  /* A surrounding is several messages, which its sender drops together */
+  supersede = hildon_im_context_get_supersede(self, event);
+  if (supersede != HILDON_IM_SUPERSEDE_NONE &&
+      supersede != HILDON_IM_SUPERSEDE_SURROUNDING)
+  {
+    hildon_im_context_drop_superseded(self, supersede);
   }
-  
-  if (self->options & HILDON_IM_AUTOCORRECT)
-  {
-    has_surrounding = gtk_im_context_get_surrounding (
-        GTK_IM_CONTEXT(self),
-        &surrounding, &cpos);
 
-    if (has_surrounding)
-    {
-      if (surrounding [cpos] == 0)
-      {
-        if (surrounding [cpos - 1] == ' ')
-        {
-          to_copy = hildon_im_autocorrection_check_character (text);
+  if (out_queue_source == NULL)
+  {
+    out_queue_source = g_source_new(&out_queue_funcs, sizeof(GSource));
+    g_source_set_priority(out_queue_source, G_PRIORITY_HIGH);
+    g_source_attach(out_queue_source, NULL);
+  }
 
-          if (to_copy > 0)
-          {
-            memcpy (tmp, text, to_copy);
-            text_clean = g_strconcat (tmp, " ", text + to_copy, NULL);
-            gtk_im_context_delete_surrounding (GTK_IM_CONTEXT(self),
-                -1, 1);
-            free_text = TRUE;
-          }
-        }
-      }
-      g_free (surrounding);
-    }
+  queued = g_new0(HildonIMQueuedEvent, 1);
+  queued->context = g_object_ref(self);
+  queued->event = *event;
+  queued->event.xclient.type = ClientMessage;
+  if (property != NULL)
+  {
+    queued->property = g_memdup(property, length);
+    queued->property_length = length;
   }
 
-  /* This last "commit" signal adds the actual text. We're assuming it sends
-     0 or 1 "changed" signals (we try to guarantee that by sending a "" commit
-     above to delete highlights).
+  now = g_get_monotonic_time();
+  queued->queued = now;
+  queued->order = out_queue_order++;
+  queued->lane = hildon_im_context_get_lane(self, event->xclient.message_type);
+  lane = &out_queue[queued->lane];
 
-     If we get more than one "changed" signal, it means that the
-     application's "changed" signal handler went and changed the text
-     as a result of the change, and we need to clear IM. */
-  self->changed_count = 0;
-  self->last_internal_change = TRUE;
-  commit_text (self, text_clean);
+  if (queued->lane == HILDON_IM_LANE_URGENT && g_queue_is_empty(lane))
+    out_queue_since = now;
 
-  if (free_text == TRUE)
-  {
-    g_free (text_clean);
-  }
-  /* If last_internal_change is still TRUE, it means set_cursor_location()
-     wasn't called yet. This happens at least with GtkEntry where it's called
-     in idle handler. */
+  g_queue_push_tail(lane, queued);
 
-  if (self->last_internal_change && self->changed_count > 1)
+  if (HILDON_IM_QUEUE_DEADLINE > 0 && out_queue_since != 0 &&
+      now - out_queue_since >= HILDON_IM_QUEUE_DEADLINE * 1000)
   {
-    /* External change seen, clear IM in set_cursor_location() handler */
-    self->last_internal_change = FALSE;
-    self->prev_cursor_y = self->prev_cursor_x = -1;
+    hildon_im_context_flush_queue();
   }
 }
 
+/* Whether text payloads for the IM can go through a window property.
+   The shared-memory ring is cheaper still, so it takes precedence. */
+static gboolean
+hildon_im_context_can_send_bulk (HildonIMContext *self)
+{
+  Window im_window = hildon_im_context_get_peer_window(self);
+
+  return self->client_gdk_window != NULL &&
+         im_window != None &&
+         (hildon_im_context_get_peer_caps(self) & HILDON_IM_CAP_BULK) &&
+         im_ring_peer != im_window;
+}
+
 static void
-hildon_im_context_send_input_mode (HildonIMContext *self)
+hildon_im_bulk_out_free (HildonIMBulkOut *out)
 {
-  XEvent event;
-  Window window;
-  HildonIMInputModeMessage *msg;
-  HildonGtkInputMode input_mode = 0;
-  HildonGtkInputMode default_input_mode = 0;
+  g_string_free(out->text, TRUE);
+  g_free(out->trailer);
+  g_free(out);
+}
 
-  window = get_window_id(hildon_im_protocol_get_atom(HILDON_IM_WINDOW));
+/* Selects PropertyNotify on the client window only while payloads are on
+   their way, and only if nobody else had selected it */
+static void
+hildon_im_context_bulk_out_watch (HildonIMContext *self, gboolean watch)
+{
+  GdkEventMask events;
 
-  if (window == None)
+  if (self->client_gdk_window == NULL)
   {
-    g_warning("hildon_im_context_send_input_mode: Could not get the window id.\n");
+    self->bulk_out_events_added = FALSE;
     return;
   }
 
-#if defined(MAEMO_CHANGES) || GTK_CHECK_VERSION(3,0,0)
-  hildon_get_input_mode (self, &input_mode, &default_input_mode);
-#endif
+  events = gdk_window_get_events(self->client_gdk_window);
+  if (watch && !(events & GDK_PROPERTY_CHANGE_MASK))
+  {
+    gdk_window_set_events(self->client_gdk_window,
+                          events | GDK_PROPERTY_CHANGE_MASK);
+    self->bulk_out_events_added = TRUE;
+  }
+  else if (!watch && self->bulk_out_events_added)
+  {
+    gdk_window_set_events(self->client_gdk_window,
+                          events & ~GDK_PROPERTY_CHANGE_MASK);
+    self->bulk_out_events_added = FALSE;
+  }
+}
 
-  memset(&event, 0, sizeof(XEvent));
-  event.xclient.type = ClientMessage;
-  event.xclient.window = window;
-  event.xclient.message_type =
-          hildon_im_protocol_get_atom (HILDON_IM_INPUT_MODE);
-  event.xclient.format = HILDON_IM_INPUT_MODE_FORMAT;
+static void
+hildon_im_context_bulk_out_clear (HildonIMContext *self)
+{
+  HildonIMBulkOut *out;
 
-  msg = (HildonIMInputModeMessage *) &event.xclient.data;
-  msg->input_mode = input_mode;
-  msg->default_input_mode = default_input_mode;
+  while ((out = g_queue_pop_head(&self->bulk_out)) != NULL)
+  {
+    hildon_im_bulk_out_free(out);
+  }
 
-  hildon_im_context_send_event (self, &event);
+  self->bulk_out_pending = FALSE;
+  hildon_im_context_bulk_out_watch(self, FALSE);
 }
 
-/* Sends a client message with the specified command to the IM window */
+/* Hands the next piece of the oldest payload to the IM, unless it has yet
+   to read the previous one; the IM deletes the property once it has. The
+   piece travels with its notification and is only written to the
+   property when that is flushed. The trailer goes out after the last
+   piece. */
 static void
-hildon_im_context_send_command(HildonIMContext *self,
-                               HildonIMCommand cmd)
+hildon_im_context_bulk_write_piece (HildonIMContext *self)
 {
+  HildonIMBulkOut *out;
+  HildonIMBulkMessage msg;
+  HildonIMBulkType type;
   XEvent event;
-  gint xerror;
-  HildonIMActivateMessage *msg;
-  GdkWindow *input_window = NULL;
+  gsize len;
 
-  g_return_if_fail (self != NULL);
+  if (self->bulk_out_pending)
+  {
+    return;
+  }
 
-  if (self->client_gdk_window != NULL)
+  out = g_queue_peek_head(&self->bulk_out);
+  if (out == NULL)
   {
-    input_window = self->client_gdk_window;
+    hildon_im_context_bulk_out_watch(self, FALSE);
+    return;
   }
-  else
+
+  /* The IM changed under a streamed transfer; it will ask again */
+  if (!hildon_im_context_can_send_bulk(self) ||
+      (out->offset > 0 &&
+       self->bulk_out_im_window != hildon_im_context_get_peer_window(self)))
   {
+    hildon_im_context_bulk_out_clear(self);
     return;
   }
 
-  memset(&event, 0, sizeof(XEvent));
-  event.xclient.type = ClientMessage;
-  event.xclient.window = self->im_window;
-  event.xclient.message_type =
-          hildon_im_protocol_get_atom(HILDON_IM_ACTIVATE);
-  event.xclient.format = HILDON_IM_ACTIVATE_FORMAT;
+  len = MIN(out->text->len - out->offset, HILDON_IM_BULK_PIECE_SIZE);
+
+  if (out->offset == 0)
+    type = len == out->text->len ?
+      HILDON_IM_BULK_WHOLE : HILDON_IM_BULK_INCR_START;
+  else if (out->offset + len == out->text->len)
+    type = HILDON_IM_BULK_INCR_END;
+  else
+    type = HILDON_IM_BULK_INCR_CONTINUE;
 
-  msg = (HildonIMActivateMessage *) &event.xclient.data;
+  memset(&msg, 0, sizeof(msg));
+  msg.input_window = GDK_WINDOW_XID(self->client_gdk_window);
+  msg.type = type;
+  msg.content = out->content;
+  msg.length = out->text->len;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_BULK, None, &msg, &event);
 
-  if (cmd == HILDON_IM_SETCLIENT || cmd == HILDON_IM_SETNSHOW)
+  hildon_im_context_send_event_full(self, &event,
+                                    out->text->str + out->offset, len);
+
+  self->bulk_out_pending = TRUE;
+  self->bulk_out_pending_content = out->content;
+  self->bulk_out_im_window = hildon_im_context_get_peer_window(self);
+  out->offset += len;
+
+  if (type == HILDON_IM_BULK_WHOLE || type == HILDON_IM_BULK_INCR_END)
   {
-    hildon_im_context_send_input_mode (self);
+    if (out->trailer != NULL)
+      hildon_im_context_send_event(self, out->trailer);
+
+    hildon_im_bulk_out_free(g_queue_pop_head(&self->bulk_out));
   }
+}
 
-  if (cmd != HILDON_IM_HIDE)
-  {
-    msg->input_window = GDK_WINDOW_XID(input_window);
+/* Sends the text in one property write instead of 16-byte ClientMessages.
+   Returns FALSE if the IM cannot take it, the caller then sends chunks. */
+static gboolean
+hildon_im_context_send_bulk (HildonIMContext *self,
+                             HildonIMAtom content,
+                             const gchar *text,
+                             XEvent *trailer)
+{
+  HildonIMTransport *transport = hildon_im_context_get_transport();
+  HildonIMBulkOut *out;
+  GList *link;
+  GList *next;
 
-    /* When the client widget is a child of GtkPlug, the application can
-       override the ID of the window the IM will be set transient to */
-    if (self->client_gtk_widget != NULL &&
-        GTK_IS_PLUG(gtk_widget_get_toplevel(self->client_gtk_widget)))
-    {
-      GtkPlug *plug = (GtkPlug *)gtk_widget_get_toplevel(self->client_gtk_widget);
-      guint32 transient_window_xid;
+  if (!im_transport_is_x11)
+  {
+    /* The payload must not overtake what is still queued */
+    hildon_im_context_drain_queue();
 
-      transient_window_xid =
-        GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(plug),
-                                           "hildon_im_transient_xid"));
-      if (transient_window_xid)
-        msg->app_window = transient_window_xid;
-      else
-        msg->app_window = GDK_WINDOW_XID(gdk_window_get_toplevel(input_window));
-    }
-    else
+    if (self->client_gdk_window == NULL ||
+        !hildon_im_transport_send_bulk(transport,
+                                       GDK_WINDOW_XID(self->client_gdk_window),
+                                       content, text, strlen(text)))
     {
-      msg->app_window = GDK_WINDOW_XID(gdk_window_get_toplevel(input_window));
+      return FALSE;
     }
-  }
 
-  msg->cmd = cmd;
-  msg->trigger = trigger;
-
-  /*trap X errors.  We need this, because if the IM window is destroyed for some
-   *reason (segfault etc), then it's possible that the IM window id
-   *is invalid.
-   */
-  gdk_error_trap_push();
+    if (trailer != NULL)
+      hildon_im_context_send_event(self, trailer);
 
-  XSendEvent(gdk_x11_get_default_xdisplay (), self->im_window, False, 0, &event);
-  /* TODO this call can cause a hang, see NB#97380 */
+    return TRUE;
+  }
 
-  xerror = gdk_error_trap_pop();
-  if (xerror)
+  if (!hildon_im_context_can_send_bulk(self))
   {
-    if (xerror == BadWindow)
-    {
-      self->im_window = get_window_id(hildon_im_protocol_get_atom(HILDON_IM_WINDOW));
-      event.xclient.window = self->im_window;
-      XSendEvent(gdk_x11_get_default_xdisplay (), self->im_window, False, 0, &event);
-    }
-    else
-    {
-      g_warning("Received the X error %d\n", xerror);
-    }
+    return FALSE;
   }
-}
-
-static char *
-get_next_packet_start(char *str)
-{
-  char *candidate, *good;
 
-  candidate = good = str;
+  /* The previous IM is not going to read what it was given */
+  if (self->bulk_out_pending &&
+      self->bulk_out_im_window != hildon_im_context_get_peer_window(self))
+  {
+    hildon_im_context_bulk_out_clear(self);
+  }
 
-  while (*candidate)
+  /* A newer surrounding replaces one that has not started yet */
+  for (link = self->bulk_out.head; link != NULL; link = next)
   {
-    candidate++;
-    if (candidate - str >= HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE)
+    next = link->next;
+    out = link->data;
+
+    if (content == HILDON_IM_SURROUNDING_CONTENT &&
+        out->content == content && out->offset == 0)
     {
-      return good;
+      g_queue_delete_link(&self->bulk_out, link);
+      hildon_im_bulk_out_free(out);
     }
-    good = candidate;
   }
 
-  /* The whole string is small enough */
-  return candidate;
+  out = g_new0(HildonIMBulkOut, 1);
+  out->content = content;
+  out->text = g_string_new(text);
+  if (trailer != NULL)
+    out->trailer = g_memdup(trailer, sizeof(XEvent));
+  g_queue_push_tail(&self->bulk_out, out);
+
+  hildon_im_context_bulk_out_watch(self, TRUE);
+  hildon_im_context_bulk_write_piece(self);
+
+  return TRUE;
 }
 
+/* Reads a payload the IM left in a property of the client window */
 static void
-hildon_im_context_send_event(HildonIMContext *self, XEvent *event)
+hildon_im_context_receive_bulk (HildonIMContext *self,
+                                HildonIMBulkMessage *msg)
 {
-  gint xerror;
+  Atom type;
+  gint format = 0;
+  gint status;
+  unsigned long n = 0;
+  unsigned long after = 0;
+  unsigned char *data = NULL;
+  gint flag;
+  HildonIMReassemblyStatus reassembled;
 
-  g_return_if_fail(event);
+  if (self->client_gdk_window == NULL)
+  {
+    return;
+  }
 
-  if(self->im_window != None )
+  /* Deleting the property is what asks the IM for the next piece */
+  gdk_error_trap_push();
+  status = XGetWindowProperty(GDK_WINDOW_XDISPLAY(self->client_gdk_window),
+                              GDK_WINDOW_XID(self->client_gdk_window),
+                              self->atoms[msg->content],
+                              0L, msg->length / 4 + 1, True,
+                              AnyPropertyType, &type, &format,
+                              &n, &after, &data);
+
+  if (gdk_error_trap_pop() != 0 || status != Success || format != 8)
+  {
+    g_warning("Unable to read the bulk payload\n");
+    if (status == Success && data != NULL)
+      XFree(data);
+    hildon_im_reassembly_reset(self->bulk_in);
+    return;
+  }
+
+  switch (msg->type)
   {
-    event->xclient.type = ClientMessage;
-    event->xclient.window = self->im_window;
+    case HILDON_IM_BULK_WHOLE:
+      hildon_im_reassembly_reset(self->bulk_in);
+      flag = HILDON_IM_MSG_END;
+      break;
+    case HILDON_IM_BULK_INCR_START:
+      flag = HILDON_IM_MSG_START;
+      break;
+    case HILDON_IM_BULK_INCR_CONTINUE:
+      flag = HILDON_IM_MSG_CONTINUE;
+      break;
+    default:
+      flag = HILDON_IM_MSG_END;
+      break;
+  }
 
-    /* trap X errors. Sometimes we recieve a badwindow error,
-     * because the input_window id is wrong.
-     * 
-     * TODO this code is replicated in too many places in this file
-     */
-    gdk_error_trap_push();
+  reassembled = hildon_im_reassembly_feed(self->bulk_in, flag,
+                                          (gchar *) data, n);
+  XFree(data);
 
-    XSendEvent(gdk_x11_get_default_xdisplay (), self->im_window, False, 0, event);
+  /* The total length is announced, so the rest is allocated in one go */
+  if (flag == HILDON_IM_MSG_START)
+    hildon_im_reassembly_reserve(self->bulk_in, msg->length);
 
-    xerror = gdk_error_trap_pop();
-    if( xerror )
-    {
-      if( xerror == BadWindow )
-      {
-        self->im_window = get_window_id(hildon_im_protocol_get_atom(HILDON_IM_WINDOW));
-        event->xclient.window = self->im_window;
-        XSendEvent(gdk_x11_get_default_xdisplay (), self->im_window, False, 0, event);
-      }
-      else
-      {
-        g_warning("Received the X error %d\n", xerror);
-      }
-    }
+  if (reassembled == HILDON_IM_REASSEMBLY_COMPLETE)
+  {
+    /* The whole text arrives at once, as a single END chunk would */
+    hildon_im_reassembly_reset(self->incoming_preedit_buffer);
+    hildon_im_context_insert_utf8(self, HILDON_IM_MSG_END,
+                                  hildon_im_reassembly_peek(self->bulk_in, NULL));
+    hildon_im_reassembly_reset(self->bulk_in);
+  }
+  else if (reassembled == HILDON_IM_REASSEMBLY_DROPPED)
+  {
+    g_warning("Dropped an oversized bulk payload from the IM");
   }
 }
 
@@ -3422,22 +6547,28 @@ get_short_surrounding (HildonIMContext *self, gint *offset)
   return short_surrounding;
 }
 
+static void
+hildon_im_context_init_surrounding_header(HildonIMContext *self, gint offset,
+                                          XEvent *event)
+{
+  HildonIMSurroundingMessage surrounding_msg;
+
+  /* The cursor offset in the surrounding */
+  memset(&surrounding_msg, 0, sizeof(surrounding_msg));
+  surrounding_msg.commit_mode = self->commit_mode;
+  surrounding_msg.cursor_offset = offset;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_SURROUNDING, None,
+                         &surrounding_msg, event);
+}
+
 static void
 hildon_im_context_send_surrounding_header(HildonIMContext *self, gint offset)
 {
-  HildonIMSurroundingMessage *surrounding_msg=NULL;
   XEvent event;
 
   g_return_if_fail(HILDON_IS_IM_CONTEXT(self));
 
-  /* Send the cursor offset in the surrounding */
-  memset( &event, 0, sizeof(XEvent) );
-  event.xclient.message_type = hildon_im_protocol_get_atom(HILDON_IM_SURROUNDING);
-  event.xclient.format = HILDON_IM_SURROUNDING_FORMAT;
-
-  surrounding_msg = (HildonIMSurroundingMessage *) &event.xclient.data;
-  surrounding_msg->commit_mode = self->commit_mode;
-  surrounding_msg->cursor_offset = offset;
+  hildon_im_context_init_surrounding_header(self, offset, &event);
   hildon_im_context_send_event(self, &event);
 }
 
@@ -3450,7 +6581,7 @@ is_request_for_surrounding(Display *display,
   {
     XClientMessageEvent *cme = (XClientMessageEvent *)event;
 
-    if (cme->message_type == hildon_im_protocol_get_atom(HILDON_IM_COM)
+    if (cme->message_type == ((HildonIMContext *) arg)->atoms[HILDON_IM_COM]
         && cme->format == HILDON_IM_COM_FORMAT)
     {
       HildonIMComMessage *msg = (HildonIMComMessage *)&cme->data;
@@ -3465,12 +6596,23 @@ is_request_for_surrounding(Display *display,
 
   return False;
 }
+/* How many bytes of text go into one content message. An IM that
+   announced its capabilities takes chunks without a terminating nul. */
+static gsize
+hildon_im_context_get_chunk_size (HildonIMContext *self)
+{
+  if (hildon_im_context_get_peer_caps(self) != 0)
+    return HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE;
+
+  return HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE - 1;
+}
+
 /* Send the text of the client widget surrounding the active cursor position,
    as well as the the cursor's position in the surrounding, to the IM */
 static void
 hildon_im_context_send_surrounding(HildonIMContext *self, gboolean send_full_line)
 {
-  HildonIMSurroundingContentMessage *surrounding_content_msg=NULL;
+  HildonIMSurroundingContentMessage surrounding_content_msg;
   XEvent event;
   XEvent next_request_event;
   Bool go_on = False;
@@ -3478,6 +6620,7 @@ hildon_im_context_send_surrounding(HildonIMContext *self, gboolean send_full_lin
   gchar *surrounding = NULL;
   gchar *str;
   gint offset = 0;
+  gsize chunk_size;
 
   g_return_if_fail(HILDON_IS_IM_CONTEXT(self));
 
@@ -3490,7 +6633,7 @@ hildon_im_context_send_surrounding(HildonIMContext *self, gboolean send_full_lin
 
   do
   {
-    go_on = XCheckIfEvent(gdk_x11_get_default_xdisplay(),
+    go_on = XCheckIfEvent(GDK_WINDOW_XDISPLAY(self->client_gdk_window),
                           &next_request_event,
                           is_request_for_surrounding,
                           (XPointer)self);
@@ -3506,6 +6649,9 @@ hildon_im_context_send_surrounding(HildonIMContext *self, gboolean send_full_lin
     /* TODO free the event? */
   }  
   while (go_on == True);
+
+  /* What is still queued of an older surrounding is outdated now */
+  hildon_im_context_drop_superseded(self, HILDON_IM_SUPERSEDE_SURROUNDING);
   
   if (send_full_line)
   {
@@ -3522,30 +6668,35 @@ hildon_im_context_send_surrounding(HildonIMContext *self, gboolean send_full_lin
     return;
   }
 
+  /* Hand the whole text over in one property if the IM can read it */
+  hildon_im_context_init_surrounding_header(self, offset, &event);
+  if (hildon_im_context_send_bulk(self, HILDON_IM_SURROUNDING_CONTENT,
+                                  surrounding, &event))
+  {
+    g_free(surrounding);
+    return;
+  }
+
   /* Split surrounding context into pieces that are small enough
      to send in a x message */
   str = surrounding;
+  chunk_size = hildon_im_context_get_chunk_size(self);
   do
   {
-    gchar *next_start;
     gsize len;
 
-    next_start = get_next_packet_start(str);
-    len = next_start - str;
-    g_return_if_fail(0 <= len && len < HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE);
-
-    /*this call will take care of adding the null terminator*/
-    memset( &event, 0, sizeof(XEvent) );
-    event.xclient.message_type = hildon_im_protocol_get_atom( HILDON_IM_SURROUNDING_CONTENT );
-    event.xclient.format = HILDON_IM_SURROUNDING_CONTENT_FORMAT;
+    len = hildon_im_codec_next_chunk(str, chunk_size);
 
-    surrounding_content_msg = (HildonIMSurroundingContentMessage *) &event.xclient.data;
-    surrounding_content_msg->msg_flag = flag;
-    memcpy(surrounding_content_msg->surrounding, str, len);
+    /* The codec zeroes what the chunk leaves of the field */
+    memset(&surrounding_content_msg, 0, sizeof(surrounding_content_msg));
+    surrounding_content_msg.msg_flag = flag;
+    memcpy(surrounding_content_msg.surrounding, str, len);
+    hildon_im_codec_encode(self->atoms, HILDON_IM_SURROUNDING_CONTENT, None,
+                           &surrounding_content_msg, &event);
 
     hildon_im_context_send_event(self, &event);
 
-    str = next_start;
+    str += len;
     flag = HILDON_IM_MSG_CONTINUE;
   } while (*str);
 
@@ -3559,56 +6710,209 @@ hildon_im_context_send_surrounding(HildonIMContext *self, gboolean send_full_lin
 static void
 hildon_im_context_send_committed_preedit(HildonIMContext *self, gchar* committed_preedit)
 {
-  HildonIMPreeditCommittedMessage *preedit_comm_msg = NULL;
-  HildonIMPreeditCommittedContentMessage *preedit_comm_content_msg = NULL;
+  HildonIMPreeditCommittedMessage preedit_comm_msg;
+  HildonIMPreeditCommittedContentMessage preedit_comm_content_msg;
   XEvent event;
+  XEvent header;
   gint flag;
   gchar *surrounding = NULL;
   gchar *str;
+  gsize chunk_size;
 
   g_return_if_fail(HILDON_IS_IM_CONTEXT(self));
 
+  memset(&preedit_comm_msg, 0, sizeof(preedit_comm_msg));
+  preedit_comm_msg.commit_mode = self->commit_mode;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_PREEDIT_COMMITTED, None,
+                         &preedit_comm_msg, &header);
+
+  if (hildon_im_context_send_bulk(self, HILDON_IM_PREEDIT_COMMITTED_CONTENT,
+                                  committed_preedit, &header))
+  {
+    return;
+  }
+
   flag = HILDON_IM_MSG_START;
 
   str = committed_preedit;
+  chunk_size = hildon_im_context_get_chunk_size(self);
   do
   {
-    gchar *next_start;
     gsize len;
 
-    next_start = get_next_packet_start(str);
-    len = next_start - str;
-    g_return_if_fail(0 <= len && len < HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE);
-
-    memset( &event, 0, sizeof(XEvent) );
-    event.xclient.message_type = hildon_im_protocol_get_atom( HILDON_IM_PREEDIT_COMMITTED_CONTENT );
-    event.xclient.format = HILDON_IM_PREEDIT_COMMITTED_CONTENT_FORMAT;
+    len = hildon_im_codec_next_chunk(str, chunk_size);
 
-    preedit_comm_content_msg = (HildonIMPreeditCommittedContentMessage *) &event.xclient.data;
-    preedit_comm_content_msg->msg_flag = flag;
-    memcpy(preedit_comm_content_msg->committed_preedit, str, len);
+    memset(&preedit_comm_content_msg, 0, sizeof(preedit_comm_content_msg));
+    preedit_comm_content_msg.msg_flag = flag;
+    memcpy(preedit_comm_content_msg.committed_preedit, str, len);
+    hildon_im_codec_encode(self->atoms, HILDON_IM_PREEDIT_COMMITTED_CONTENT,
+                           None, &preedit_comm_content_msg, &event);
 
     hildon_im_context_send_event(self, &event);
 
-    str = next_start;
+    str += len;
     flag = HILDON_IM_MSG_CONTINUE;
   } while (*str);
 
   /*
    * Now we send the header.
    */
-  
-  memset( &event, 0, sizeof(XEvent) );
-  event.xclient.message_type = hildon_im_protocol_get_atom(HILDON_IM_PREEDIT_COMMITTED);
-  event.xclient.format = HILDON_IM_PREEDIT_COMMITTED_FORMAT;
+  hildon_im_context_send_event(self, &header);
+
+  g_free(surrounding);
+}
+
+
+/* Stamps the next message to the IM for latency tracing, if the IM
+   asked for it */
+static void
+hildon_im_context_send_trace(HildonIMContext *self, HildonIMAtom atom)
+{
+  HildonIMTraceStamp *stamp;
+  HildonIMTraceMessage msg;
+  XEvent event;
+
+  if (!(hildon_im_context_get_peer_caps(self) & HILDON_IM_CAP_TRACE))
+    return;
+
+  /* seq 0 stands for "no stamp" in the IM's replies */
+  if (++trace_seq == 0)
+    ++trace_seq;
+
+  stamp = &trace_pending[trace_seq % HILDON_IM_TRACE_PENDING];
+  stamp->seq = trace_seq;
+  stamp->sent = self->keypress_time != 0 ? self->keypress_time
+                                         : g_get_monotonic_time();
+  stamp->received = 0;
+
+  msg.type = HILDON_IM_TRACE_STAMP;
+  msg.seq = stamp->seq;
+  msg.atom = atom;
+  msg.time_hi = (guint32) (stamp->sent >> 32);
+  msg.time_lo = (guint32) stamp->sent;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_TRACE, None, &msg, &event);
 
-  preedit_comm_msg = (HildonIMPreeditCommittedMessage *) &event.xclient.data;
-  preedit_comm_msg->commit_mode = self->commit_mode;
   hildon_im_context_send_event(self, &event);
+}
 
-  g_free(surrounding);
+/* Adds one sample to the latency statistics of a hop */
+static void
+hildon_im_context_latency_add (HildonIMLatencyHop hop, gint64 usec)
+{
+  HildonIMLatency *latency = &latencies[hop];
+  gint64 ms;
+  guint bucket = 0;
+
+  if (usec < 0)
+    return;
+
+  for (ms = usec / 1000; ms > 0 && bucket < HILDON_IM_LATENCY_BUCKETS - 1; ms >>= 1)
+    bucket++;
+
+  latency->count++;
+  latency->total += usec;
+  latency->max = MAX(latency->max, usec);
+  latency->buckets[bucket]++;
+}
+
+/* Logs the latency statistics gathered so far */
+static void
+hildon_im_context_latency_dump (void)
+{
+  GString *line;
+  guint hop, i;
+
+  line = g_string_new(NULL);
+
+  for (hop = 0; hop < HILDON_IM_NUM_LATENCIES; hop++)
+  {
+    HildonIMLatency *latency = &latencies[hop];
+
+    if (latency->count == 0)
+      continue;
+
+    g_string_printf(line, "IM latency %s: %u samples, mean %.2f ms, max %.2f ms,"
+                    " histogram", latency_names[hop], latency->count,
+                    latency->total / 1000.0 / latency->count,
+                    latency->max / 1000.0);
+    for (i = 0; i < HILDON_IM_LATENCY_BUCKETS; i++)
+      g_string_append_printf(line, " %u", latency->buckets[i]);
+
+    g_debug("%s", line->str);
+  }
+
+  g_string_free(line, TRUE);
+}
+
+/* Logs how long the bulk lane was held back so far and how many
+   outdated updates were never sent */
+static void
+hildon_im_context_lane_dump (void)
+{
+  if (bulk_lane_stats.sent == 0 && bulk_lane_stats.superseded == 0)
+    return;
+
+  g_debug("IM bulk lane: %u messages, mean wait %.2f ms, max %.2f ms, "
+          "%u urgent messages sent ahead, %u flushes deferred, "
+          "%u waiting for the IM, %u superseded messages dropped",
+          bulk_lane_stats.sent,
+          bulk_lane_stats.wait_total / 1000.0 / MAX(bulk_lane_stats.sent, 1),
+          bulk_lane_stats.wait_max / 1000.0,
+          bulk_lane_stats.overtaken,
+          bulk_lane_stats.deferred_flushes,
+          bulk_lane_stats.blocked_flushes,
+          bulk_lane_stats.superseded);
 }
 
+/* Sends a key event as a compact record. It joins the previous one of
+   the same client if that is still queued and has room left, which is
+   where a press and its release end up in one message. */
+static void
+hildon_im_context_send_key_record(HildonIMContext *self,
+                                  GdkEventType type,
+                                  guint state,
+                                  guint keyval,
+                                  guint16 hardware_keycode)
+{
+  HildonIMKeyEventsMessage msg;
+  HildonIMKeyRecord record;
+  HildonIMQueuedEvent *queued;
+  Window client;
+  XEvent event;
+
+  client = GDK_WINDOW_XID(self->client_gdk_window);
+
+  record.type = type;
+  record.hardware_keycode = hardware_keycode;
+  record.state = state & HILDON_IM_KEY_RECORD_STATE_MASK;
+  record.keyval = keyval;
+
+  queued = g_queue_peek_tail(&out_queue[HILDON_IM_LANE_URGENT]);
+  if (queued != NULL && queued->context == self &&
+      queued->event.xclient.message_type == self->atoms[HILDON_IM_KEY_EVENTS])
+  {
+    HildonIMKeyEventsMessage *pending =
+      (HildonIMKeyEventsMessage *) &queued->event.xclient.data;
+
+    if (pending->input_window == client && pending->events[1].type == 0)
+    {
+      pending->events[1] = record;
+      return;
+    }
+  }
+
+  /* Only a new message is stamped; one queued in between would keep
+     the next record from joining this one */
+  hildon_im_context_send_trace(self, HILDON_IM_KEY_EVENTS);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.input_window = client;
+  msg.events[0] = record;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_KEY_EVENTS, None,
+                         &msg, &event);
+
+  hildon_im_context_send_event(self, &event);
+}
 
 /* Send a key event to the IM, which makes it available to the plugins */
 static void
@@ -3618,24 +6922,30 @@ hildon_im_context_send_key_event(HildonIMContext *self,
                                  guint keyval,
                                  guint16 hardware_keycode)
 {
-  HildonIMKeyEventMessage *key_event_msg=NULL;
+  HildonIMKeyEventMessage key_event_msg;
   XEvent event;
 
   g_return_if_fail(HILDON_IS_IM_CONTEXT(self));
 
   if (self->is_internal_widget)
     return;
-  
-  memset(&event, 0, sizeof(XEvent));
-  event.xclient.message_type = hildon_im_protocol_get_atom(HILDON_IM_KEY_EVENT);
-  event.xclient.format = HILDON_IM_KEY_EVENT_FORMAT;
 
-  key_event_msg = (HildonIMKeyEventMessage *) &event.xclient.data;
-  key_event_msg->input_window = GDK_WINDOW_XID(self->client_gdk_window);
-  key_event_msg->type = type;
-  key_event_msg->state = state;
-  key_event_msg->keyval = keyval;
-  key_event_msg->hardware_keycode = hardware_keycode;
+  if (hildon_im_context_get_peer_caps(self) & HILDON_IM_CAP_KEY_EVENTS)
+  {
+    hildon_im_context_send_key_record(self, type, state, keyval,
+                                      hardware_keycode);
+    return;
+  }
+
+  hildon_im_context_send_trace(self, HILDON_IM_KEY_EVENT);
+
+  key_event_msg.input_window = GDK_WINDOW_XID(self->client_gdk_window);
+  key_event_msg.type = type;
+  key_event_msg.state = state;
+  key_event_msg.keyval = keyval;
+  key_event_msg.hardware_keycode = hardware_keycode;
+  hildon_im_codec_encode(self->atoms, HILDON_IM_KEY_EVENT, None,
+                         &key_event_msg, &event);
 
   hildon_im_context_send_event(self, &event);
 }
@@ -3648,13 +6958,16 @@ hildon_im_context_show_cb(GtkIMContext *context)
   g_return_val_if_fail(HILDON_IS_IM_CONTEXT(context), FALSE);
   self = HILDON_IM_CONTEXT(context);
 
-  /* Avoid autocap on inactive window. */
-  if (self->has_focus)
+  if (!hildon_im_context_send_focus(self, HILDON_IM_SETNSHOW))
   {
-    hildon_im_context_check_sentence_start(self);
-  }
+    /* Avoid autocap on inactive window. */
+    if (self->has_focus)
+    {
+      hildon_im_context_check_sentence_start(self);
+    }
 
-  hildon_im_context_send_command(self, HILDON_IM_SETNSHOW);
+    hildon_im_context_send_command(self, HILDON_IM_SETNSHOW);
+  }
 
   launch_delay_timeout_id = 0;
 
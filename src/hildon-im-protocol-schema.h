@@ -0,0 +1,156 @@
+/**
+   @file: hildon-im-protocol-schema.h
+
+   The Hildon IM message set, one HILDON_IM_SCHEMA_ATOM() entry per
+   #HildonIMAtom, in enum order. Define HILDON_IM_SCHEMA_ATOM() before
+   including this file and undefine it afterwards; the file has no include
+   guard on purpose. The atom enum, the atom names and the codec tables are
+   all expanded from this list, so a new message is added here only.
+
+   HILDON_IM_SCHEMA_ATOM(atom, name, format, size, kind):
+   @atom: the #HildonIMAtom
+   @name: the X name of the atom
+   @format: the ClientMessage or property format, 8 or 32
+   @size: the size of the payload in bytes, at most 20
+   @kind: HILDON_IM_CODEC_MESSAGE for a ClientMessage,
+   HILDON_IM_CODEC_PROPERTY for a window property
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_WINDOW,
+                      HILDON_IM_WINDOW_NAME,
+                      HILDON_IM_WINDOW_ID_FORMAT,
+                      sizeof(guint32),
+                      HILDON_IM_CODEC_PROPERTY)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_ACTIVATE,
+                      HILDON_IM_ACTIVATE_NAME,
+                      HILDON_IM_ACTIVATE_FORMAT,
+                      sizeof(HildonIMActivateMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_INPUT_MODE,
+                      HILDON_IM_INPUT_MODE_NAME,
+                      HILDON_IM_INPUT_MODE_FORMAT,
+                      sizeof(HildonIMInputModeMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_INSERT_UTF8,
+                      HILDON_IM_INSERT_UTF8_NAME,
+                      HILDON_IM_INSERT_UTF8_FORMAT,
+                      sizeof(HildonIMInsertUtf8Message),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_SURROUNDING,
+                      HILDON_IM_SURROUNDING_NAME,
+                      HILDON_IM_SURROUNDING_FORMAT,
+                      sizeof(HildonIMSurroundingMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_SURROUNDING_CONTENT,
+                      HILDON_IM_SURROUNDING_CONTENT_NAME,
+                      HILDON_IM_SURROUNDING_CONTENT_FORMAT,
+                      sizeof(HildonIMSurroundingContentMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_KEY_EVENT,
+                      HILDON_IM_KEY_EVENT_NAME,
+                      HILDON_IM_KEY_EVENT_FORMAT,
+                      sizeof(HildonIMKeyEventMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_COM,
+                      HILDON_IM_COM_NAME,
+                      HILDON_IM_COM_FORMAT,
+                      sizeof(HildonIMComMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_CLIPBOARD_COPIED,
+                      HILDON_IM_CLIPBOARD_COPIED_NAME,
+                      HILDON_IM_CLIPBOARD_FORMAT,
+                      0,
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_CLIPBOARD_SELECTION_QUERY,
+                      HILDON_IM_CLIPBOARD_SELECTION_QUERY_NAME,
+                      HILDON_IM_CLIPBOARD_FORMAT,
+                      0,
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_CLIPBOARD_SELECTION_REPLY,
+                      HILDON_IM_CLIPBOARD_SELECTION_REPLY_NAME,
+                      HILDON_IM_CLIPBOARD_SELECTION_REPLY_FORMAT,
+                      sizeof(HildonIMClipboardSelectionReplyMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_PREEDIT_COMMITTED,
+                      HILDON_IM_PREEDIT_COMMITTED_NAME,
+                      HILDON_IM_PREEDIT_COMMITTED_FORMAT,
+                      sizeof(HildonIMPreeditCommittedMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_PREEDIT_COMMITTED_CONTENT,
+                      HILDON_IM_PREEDIT_COMMITTED_CONTENT_NAME,
+                      HILDON_IM_PREEDIT_COMMITTED_CONTENT_FORMAT,
+                      sizeof(HildonIMPreeditCommittedContentMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_LONG_PRESS_SETTINGS,
+                      HILDON_IM_LONG_PRESS_SETTINGS_NAME,
+                      HILDON_IM_LONG_PRESS_SETTINGS_FORMAT,
+                      sizeof(HildonIMLongPressSettingsMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_SHM_RING,
+                      HILDON_IM_SHM_RING_NAME,
+                      HILDON_IM_SHM_RING_FORMAT,
+                      sizeof(HildonIMShmRingMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_BULK,
+                      HILDON_IM_BULK_NAME,
+                      HILDON_IM_BULK_FORMAT,
+                      sizeof(HildonIMBulkMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_PROTOCOL_VERSION,
+                      HILDON_IM_PROTOCOL_VERSION_NAME,
+                      HILDON_IM_PROTOCOL_VERSION_FORMAT,
+                      2 * sizeof(guint32),
+                      HILDON_IM_CODEC_PROPERTY)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_TRACE,
+                      HILDON_IM_TRACE_NAME,
+                      HILDON_IM_TRACE_FORMAT,
+                      sizeof(HildonIMTraceMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_FOCUS,
+                      HILDON_IM_FOCUS_NAME,
+                      HILDON_IM_FOCUS_FORMAT,
+                      sizeof(HildonIMFocusMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_REPLACE,
+                      HILDON_IM_REPLACE_NAME,
+                      HILDON_IM_REPLACE_FORMAT,
+                      sizeof(HildonIMReplaceMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_PREEDIT,
+                      HILDON_IM_PREEDIT_NAME,
+                      HILDON_IM_PREEDIT_FORMAT,
+                      sizeof(HildonIMPreeditMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_KEY_EVENTS,
+                      HILDON_IM_KEY_EVENTS_NAME,
+                      HILDON_IM_KEY_EVENTS_FORMAT,
+                      sizeof(HildonIMKeyEventsMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_CURSOR,
+                      HILDON_IM_CURSOR_NAME,
+                      HILDON_IM_CURSOR_FORMAT,
+                      sizeof(HildonIMCursorMessage),
+                      HILDON_IM_CODEC_MESSAGE)
+HILDON_IM_SCHEMA_ATOM(HILDON_IM_STATE,
+                      HILDON_IM_STATE_NAME,
+                      HILDON_IM_STATE_FORMAT,
+                      sizeof(HildonIMStateMessage),
+                      HILDON_IM_CODEC_MESSAGE)
@@ -25,69 +25,488 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <gdk/gdkx.h>
 #include <gtk/gtk.h>
+#ifdef HAVE_X11_XCB
+#include <stdlib.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
 
 #include "hildon-im-gtk-compat.h"
 #include "hildon-im-protocol.h"
 
 
-static const char *
+#define HILDON_IM_ATOM_TABLE_KEY "hildon-im-atom-table"
+#define HILDON_IM_ATOM_COOKIES_KEY "hildon-im-atom-cookies"
+
+/* The atoms come first, so a table is handed out as a plain Atom array.
+   Only hildon_im_protocol_lookup_atom() needs the index, and it finds the
+   table through atom_tables rather than trusting the array it gets. */
+typedef struct
+{
+  Atom atoms[HILDON_IM_NUM_ATOMS];
+  GHashTable *index;
+} HildonIMAtomTable;
+
+struct _HildonIMPeerQuery
+{
+  GdkDisplay *display;
+#ifdef HAVE_X11_XCB
+  xcb_get_property_cookie_t window;
+  xcb_get_property_cookie_t version;
+#endif
+};
+
+static char *
 ATOM_NAME[HILDON_IM_NUM_ATOMS] =
 {
-  HILDON_IM_WINDOW_NAME,
-  HILDON_IM_ACTIVATE_NAME,
-  HILDON_IM_INPUT_MODE_NAME,
-  HILDON_IM_INSERT_UTF8_NAME,
-  HILDON_IM_SURROUNDING_NAME,
-  HILDON_IM_SURROUNDING_CONTENT_NAME,
-  HILDON_IM_KEY_EVENT_NAME,
-  HILDON_IM_COM_NAME,
-  HILDON_IM_CLIPBOARD_COPIED_NAME,
-  HILDON_IM_CLIPBOARD_SELECTION_QUERY_NAME,
-  HILDON_IM_CLIPBOARD_SELECTION_REPLY_NAME,
-  HILDON_IM_PREEDIT_COMMITTED_NAME,
-  HILDON_IM_PREEDIT_COMMITTED_CONTENT_NAME,
-  HILDON_IM_LONG_PRESS_SETTINGS_NAME
+#define HILDON_IM_SCHEMA_ATOM(atom, name, format, size, kind) name,
+#include "hildon-im-protocol-schema.h"
+#undef HILDON_IM_SCHEMA_ATOM
 };
 
+/* Atoms of the default display, for hildon_im_protocol_get_atom() */
+static const Atom *default_atoms = NULL;
+
+/* The tables hildon_im_protocol_get_atoms() handed out, keyed by their
+   atom array, so that hildon_im_protocol_lookup_atom() never takes an
+   array of the caller's own for one of them. Filters of other threads
+   look tables up too. */
+G_LOCK_DEFINE_STATIC(atom_tables);
+static GHashTable *atom_tables = NULL;
+
+/**
+ * hildon_im_protocol_prefetch_atoms:
+ * @display: a #GdkDisplay
+ *
+ * Sends the requests interning the atoms of @display without waiting for
+ * the replies, so that hildon_im_protocol_get_atoms() finds them already
+ * there. Without XCB this does nothing.
+ */
+void
+hildon_im_protocol_prefetch_atoms(GdkDisplay *display)
+{
+#ifdef HAVE_X11_XCB
+  xcb_connection_t *connection;
+  xcb_intern_atom_cookie_t *cookies;
+  gint i;
+
+  g_return_if_fail(GDK_IS_DISPLAY(display));
+
+  if (g_object_get_data(G_OBJECT(display), HILDON_IM_ATOM_TABLE_KEY) != NULL ||
+      g_object_get_data(G_OBJECT(display), HILDON_IM_ATOM_COOKIES_KEY) != NULL)
+  {
+    return;
+  }
+
+  connection = XGetXCBConnection(GDK_DISPLAY_XDISPLAY(display));
+  cookies = g_new(xcb_intern_atom_cookie_t, HILDON_IM_NUM_ATOMS);
+
+  for (i = 0; i < HILDON_IM_NUM_ATOMS; i++)
+  {
+    cookies[i] = xcb_intern_atom(connection, 0, strlen(ATOM_NAME[i]),
+                                 ATOM_NAME[i]);
+  }
+
+  xcb_flush(connection);
+
+  g_object_set_data_full(G_OBJECT(display), HILDON_IM_ATOM_COOKIES_KEY,
+                         cookies, g_free);
+#endif
+}
+
+static void
+atom_table_free(HildonIMAtomTable *table)
+{
+  G_LOCK(atom_tables);
+  g_hash_table_remove(atom_tables, table->atoms);
+  G_UNLOCK(atom_tables);
+
+  g_hash_table_destroy(table->index);
+  g_free(table);
+}
+
+/**
+ * hildon_im_protocol_get_atoms:
+ * @display: a #GdkDisplay
+ * @Returns: the #Atom table of @display, indexed by #HildonIMAtom
+ *
+ * Interns all hildon-keyboard related atoms of @display on first use,
+ * costing a single round trip, or none left to wait for if
+ * hildon_im_protocol_prefetch_atoms() was called early enough. The table
+ * stays valid as long as @display does, so callers can keep it and look
+ * atoms up with a plain array index.
+ */
+const Atom *
+hildon_im_protocol_get_atoms(GdkDisplay *display)
+{
+  HildonIMAtomTable *table;
+  Atom *atoms;
+  gint i;
+#ifdef HAVE_X11_XCB
+  xcb_connection_t *connection;
+  xcb_intern_atom_cookie_t *cookies;
+  xcb_intern_atom_reply_t *reply;
+#endif
+
+  g_return_val_if_fail(GDK_IS_DISPLAY(display), NULL);
+
+  table = g_object_get_data(G_OBJECT(display), HILDON_IM_ATOM_TABLE_KEY);
+  if (table != NULL)
+  {
+    return table->atoms;
+  }
+
+  table = g_new0(HildonIMAtomTable, 1);
+  atoms = table->atoms;
+
+#ifdef HAVE_X11_XCB
+  hildon_im_protocol_prefetch_atoms(display);
+
+  connection = XGetXCBConnection(GDK_DISPLAY_XDISPLAY(display));
+  cookies = g_object_get_data(G_OBJECT(display), HILDON_IM_ATOM_COOKIES_KEY);
+
+  for (i = 0; i < HILDON_IM_NUM_ATOMS; i++)
+  {
+    reply = xcb_intern_atom_reply(connection, cookies[i], NULL);
+    if (reply == NULL)
+    {
+      g_warning("HildonIMProtocol :: Unable to intern %s\n", ATOM_NAME[i]);
+      continue;
+    }
+
+    atoms[i] = reply->atom;
+    free(reply);
+  }
+
+  g_object_set_data(G_OBJECT(display), HILDON_IM_ATOM_COOKIES_KEY, NULL);
+#else
+  if (!XInternAtoms(GDK_DISPLAY_XDISPLAY(display), ATOM_NAME,
+                    HILDON_IM_NUM_ATOMS, False, atoms))
+  {
+    g_warning("HildonIMProtocol :: Unable to intern the atoms\n");
+  }
+#endif
+
+  /* Values are offset by one, so that no atom maps to NULL */
+  table->index = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (i = 0; i < HILDON_IM_NUM_ATOMS; i++)
+  {
+    if (atoms[i] != None)
+      g_hash_table_insert(table->index, GUINT_TO_POINTER(atoms[i]),
+                          GINT_TO_POINTER(i + 1));
+  }
+
+  G_LOCK(atom_tables);
+  if (atom_tables == NULL)
+    atom_tables = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(atom_tables, atoms, table);
+  G_UNLOCK(atom_tables);
+
+  g_object_set_data_full(G_OBJECT(display), HILDON_IM_ATOM_TABLE_KEY,
+                         table, (GDestroyNotify) atom_table_free);
+
+  return atoms;
+}
+
+/**
+ * hildon_im_protocol_lookup_atom:
+ * @atoms: an #Atom table indexed by #HildonIMAtom, usually the one
+ * hildon_im_protocol_get_atoms() returned
+ * @atom: an #Atom of the same display
+ * @Returns: the #HildonIMAtom of @atom, or %HILDON_IM_NUM_ATOMS if @atom
+ * is not one of the IM atoms
+ *
+ * Looks up what an atom stands for with a hash lookup, so that filters
+ * seeing every event of a window can skip unrelated ones cheaply. Any
+ * other table of %HILDON_IM_NUM_ATOMS atoms is searched entry by entry.
+ */
+HildonIMAtom
+hildon_im_protocol_lookup_atom(const Atom *atoms, Atom atom)
+{
+  HildonIMAtomTable *table = NULL;
+  gint index = 0;
+  gint i;
+
+  g_return_val_if_fail(atoms != NULL, HILDON_IM_NUM_ATOMS);
+
+  if (atom == None)
+    return HILDON_IM_NUM_ATOMS;
+
+  G_LOCK(atom_tables);
+  if (atom_tables != NULL)
+    table = g_hash_table_lookup(atom_tables, atoms);
+  if (table != NULL)
+    index = GPOINTER_TO_INT(g_hash_table_lookup(table->index,
+                                                GUINT_TO_POINTER(atom)));
+  G_UNLOCK(atom_tables);
+
+  if (table == NULL)
+  {
+    for (i = 0; i < HILDON_IM_NUM_ATOMS; i++)
+    {
+      if (atoms[i] == atom)
+        return i;
+    }
+  }
+
+  return index > 0 ? index - 1 : HILDON_IM_NUM_ATOMS;
+}
+
 /**
  * hildon_im_protocol_get_atom:
  * @atom_name: a #HildonIMAtom
  * @Returns: the #Atom of the given #HildonIMAtom
  *
- * Convenience function for getting hildon-keyboard related atoms.
+ * Convenience function for getting hildon-keyboard related atoms of the
+ * default display.
  */
 Atom
 hildon_im_protocol_get_atom(HildonIMAtom atom_name)
 {
-  static Atom atom_list[HILDON_IM_NUM_ATOMS] = { None, None, None, None };
-  Atom result = None;
-  gint i;
+  g_return_val_if_fail(atom_name < HILDON_IM_NUM_ATOMS, None);
 
-  /*initialise the atom on the first call of this function*/
-  if (atom_list[0] == None)
+  if (G_UNLIKELY(default_atoms == NULL))
   {
-    for (i = 0; i < HILDON_IM_NUM_ATOMS; ++i)
-    {
-      atom_list[i] = XInternAtom(gdk_x11_get_default_xdisplay(), ATOM_NAME[i],
-                                 False);
-      g_return_val_if_fail(atom_list[i], result);
-    }
+    default_atoms = hildon_im_protocol_get_atoms(gdk_display_get_default());
   }
 
-  /*now return the atom that we want*/
-  if (atom_name >= HILDON_IM_WINDOW && atom_name <= HILDON_IM_NUM_ATOMS)
+  return default_atoms[atom_name];
+}
+
+/**
+ * hildon_im_protocol_get_atom_name:
+ * @atom_name: a #HildonIMAtom
+ * @Returns: the X name of @atom_name, or NULL if it is out of range
+ *
+ * Needs no display, for tools reading captured messages.
+ */
+const gchar *
+hildon_im_protocol_get_atom_name(guint atom_name)
+{
+  if (atom_name >= HILDON_IM_NUM_ATOMS)
+    return NULL;
+
+  return ATOM_NAME[atom_name];
+}
+
+/**
+ * hildon_im_protocol_set_capabilities:
+ * @caps: the #HildonIMCapabilities implemented by the IM
+ *
+ * Publishes the protocol version and capabilities of the IM. Only the IM
+ * process calls this, before it publishes its window.
+ */
+void
+hildon_im_protocol_set_capabilities(HildonIMCapabilities caps)
+{
+  Display *display = gdk_x11_get_default_xdisplay();
+  long data[2];
+
+  data[0] = HILDON_IM_PROTOCOL_VERSION_CURRENT;
+  data[1] = caps;
+
+  XChangeProperty(display, DefaultRootWindow(display),
+                  hildon_im_protocol_get_atom(HILDON_IM_PROTOCOL_VERSION),
+                  XA_CARDINAL, HILDON_IM_PROTOCOL_VERSION_FORMAT,
+                  PropModeReplace, (unsigned char *) data, 2);
+}
+
+/**
+ * hildon_im_protocol_read_capabilities:
+ * @display: the X display the IM runs on
+ * @version: return location for the protocol version, or NULL
+ * @Returns: the #HildonIMCapabilities published by the IM
+ *
+ * Reads what the IM published with hildon_im_protocol_set_capabilities().
+ * An IM that published nothing has version 0 and no capabilities. This
+ * is a round trip, callers are expected to cache the result.
+ */
+HildonIMCapabilities
+hildon_im_protocol_read_capabilities(Display *display, guint32 *version)
+{
+  HildonIMCapabilities caps = 0;
+  GdkDisplay *gdk_display;
+  Atom version_atom;
+  Atom type = None;
+  gint format = 0;
+  gint status;
+  unsigned long n = 0;
+  unsigned long extra = 0;
+  unsigned char *data = NULL;
+
+  if (version)
+    *version = 0;
+
+  gdk_display = gdk_x11_lookup_xdisplay(display);
+  if (gdk_display != NULL)
+    version_atom = hildon_im_protocol_get_atoms(gdk_display)
+                     [HILDON_IM_PROTOCOL_VERSION];
+  else
+    version_atom = hildon_im_protocol_get_atom(HILDON_IM_PROTOCOL_VERSION);
+
+  gdk_error_trap_push();
+  status = XGetWindowProperty(display, DefaultRootWindow(display),
+                              version_atom,
+                              0L, 2L, False, XA_CARDINAL, &type, &format,
+                              &n, &extra, &data);
+
+  if (gdk_error_trap_pop() == 0 && status == Success &&
+      type == XA_CARDINAL && format == HILDON_IM_PROTOCOL_VERSION_FORMAT &&
+      n == 2)
   {
-    result = atom_list[atom_name];
+    long *values = (long *) data;
+
+    if (version)
+      *version = values[0];
+
+    if (values[0] >= 1)
+      caps = values[1];
   }
-  else
+
+  if (status == Success && data != NULL)
+    XFree(data);
+
+  return caps;
+}
+
+/**
+ * hildon_im_protocol_query_peer:
+ * @display: the #GdkDisplay the IM runs on
+ * @Returns: a #HildonIMPeerQuery to pass to
+ * hildon_im_protocol_query_peer_finish()
+ *
+ * Sends the requests for the IM window and what the IM published with
+ * hildon_im_protocol_set_capabilities(), without waiting for the
+ * replies. Both come back in the same round trip, which the caller can
+ * overlap with other work. Without XCB the requests are only made by
+ * hildon_im_protocol_query_peer_finish().
+ */
+HildonIMPeerQuery *
+hildon_im_protocol_query_peer(GdkDisplay *display)
+{
+  HildonIMPeerQuery *query;
+#ifdef HAVE_X11_XCB
+  xcb_connection_t *connection;
+  const Atom *atoms;
+  Window root;
+#endif
+
+  g_return_val_if_fail(GDK_IS_DISPLAY(display), NULL);
+
+  query = g_new0(HildonIMPeerQuery, 1);
+  query->display = display;
+
+#ifdef HAVE_X11_XCB
+  connection = XGetXCBConnection(GDK_DISPLAY_XDISPLAY(display));
+  atoms = hildon_im_protocol_get_atoms(display);
+  root = DefaultRootWindow(GDK_DISPLAY_XDISPLAY(display));
+
+  query->window = xcb_get_property(connection, 0, root,
+                                   atoms[HILDON_IM_WINDOW], XA_WINDOW,
+                                   0, 1);
+  query->version = xcb_get_property(connection, 0, root,
+                                    atoms[HILDON_IM_PROTOCOL_VERSION],
+                                    XA_CARDINAL, 0, 2);
+  xcb_flush(connection);
+#endif
+
+  return query;
+}
+
+/**
+ * hildon_im_protocol_query_peer_finish:
+ * @query: a #HildonIMPeerQuery
+ * @caps: return location for the #HildonIMCapabilities of the IM
+ * @version: return location for the protocol version, or NULL
+ * @Returns: the IM window, or None if there is none
+ *
+ * Waits for the replies of hildon_im_protocol_query_peer() and frees
+ * @query.
+ */
+Window
+hildon_im_protocol_query_peer_finish(HildonIMPeerQuery *query,
+                                     HildonIMCapabilities *caps,
+                                     guint32 *version)
+{
+  Window window = None;
+#ifdef HAVE_X11_XCB
+  xcb_connection_t *connection;
+  xcb_get_property_reply_t *reply;
+  guint32 *values;
+#else
+  Display *display;
+  Atom type = None;
+  gint format = 0;
+  gint status;
+  unsigned long n = 0;
+  unsigned long extra = 0;
+  unsigned char *data = NULL;
+#endif
+
+  g_return_val_if_fail(query != NULL, None);
+
+  *caps = 0;
+  if (version)
+    *version = 0;
+
+#ifdef HAVE_X11_XCB
+  connection = XGetXCBConnection(GDK_DISPLAY_XDISPLAY(query->display));
+
+  /* Errors come back in place of the replies, not through Xlib */
+  reply = xcb_get_property_reply(connection, query->window, NULL);
+  if (reply != NULL && reply->type == XA_WINDOW &&
+      reply->format == HILDON_IM_WINDOW_ID_FORMAT &&
+      xcb_get_property_value_length(reply) == 4)
   {
-    g_warning("HildonIMProtocol :: Trying to get an invalid atom\n");
+    window = *(guint32 *) xcb_get_property_value(reply);
   }
+  free(reply);
+
+  reply = xcb_get_property_reply(connection, query->version, NULL);
+  if (reply != NULL && reply->type == XA_CARDINAL &&
+      reply->format == HILDON_IM_PROTOCOL_VERSION_FORMAT &&
+      xcb_get_property_value_length(reply) == 8)
+  {
+    values = xcb_get_property_value(reply);
+
+    if (version)
+      *version = values[0];
+
+    if (values[0] >= 1)
+      *caps = values[1];
+  }
+  free(reply);
+#else
+  display = GDK_DISPLAY_XDISPLAY(query->display);
+
+  gdk_error_trap_push();
+  status = XGetWindowProperty(display, DefaultRootWindow(display),
+                              hildon_im_protocol_get_atoms(query->display)
+                                [HILDON_IM_WINDOW],
+                              0L, 1L, False, XA_WINDOW, &type, &format,
+                              &n, &extra, &data);
+
+  if (gdk_error_trap_pop() == 0 && status == Success &&
+      type == XA_WINDOW && format == HILDON_IM_WINDOW_ID_FORMAT && n == 1)
+  {
+    window = *(Window *) data;
+  }
+
+  if (status == Success && data != NULL)
+    XFree(data);
+
+  *caps = hildon_im_protocol_read_capabilities(display, version);
+#endif
+
+  g_free(query);
 
-  return result;
+  return window;
 }
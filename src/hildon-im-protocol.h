@@ -28,6 +28,8 @@
 #define __HILDON_IM_PROTOCOL_H__
 
 #include <X11/X.h>
+#include <X11/Xlib.h>
+#include <gdk/gdk.h>
 #include <gtk/gtkenums.h>
 
 G_BEGIN_DECLS
@@ -35,25 +37,15 @@ G_BEGIN_DECLS
 /**
  * HildonIMAtom:
  *
- * IM atoms for each message type
+ * IM atoms for each message type, expanded from
+ * hildon-im-protocol-schema.h
  *
  */
 typedef enum
 {
-  HILDON_IM_WINDOW,
-  HILDON_IM_ACTIVATE,
-  HILDON_IM_INPUT_MODE,
-  HILDON_IM_INSERT_UTF8,
-  HILDON_IM_SURROUNDING,
-  HILDON_IM_SURROUNDING_CONTENT,
-  HILDON_IM_KEY_EVENT,
-  HILDON_IM_COM,
-  HILDON_IM_CLIPBOARD_COPIED,
-  HILDON_IM_CLIPBOARD_SELECTION_QUERY,
-  HILDON_IM_CLIPBOARD_SELECTION_REPLY,
-  HILDON_IM_PREEDIT_COMMITTED,
-  HILDON_IM_PREEDIT_COMMITTED_CONTENT,
-  HILDON_IM_LONG_PRESS_SETTINGS,
+#define HILDON_IM_SCHEMA_ATOM(atom, name, format, size, kind) atom,
+#include "hildon-im-protocol-schema.h"
+#undef HILDON_IM_SCHEMA_ATOM
 
   /* always last */
   HILDON_IM_NUM_ATOMS
@@ -61,6 +53,83 @@ typedef enum
 
 /* Returns the Atom of a given HildonIMAtom */
 Atom hildon_im_protocol_get_atom(HildonIMAtom atom_name);
+/* Returns the Atom table of a display, indexed by HildonIMAtom */
+const Atom *hildon_im_protocol_get_atoms(GdkDisplay *display);
+/* Returns the HildonIMAtom of an Atom of such a table, in constant time
+   for tables from hildon_im_protocol_get_atoms(), or HILDON_IM_NUM_ATOMS
+   if it is none of them */
+HildonIMAtom hildon_im_protocol_lookup_atom(const Atom *atoms, Atom atom);
+/* Sends the requests for hildon_im_protocol_get_atoms() ahead of time */
+void hildon_im_protocol_prefetch_atoms(GdkDisplay *display);
+/* Returns the X name of a given HildonIMAtom, or NULL */
+const gchar *hildon_im_protocol_get_atom_name(guint atom_name);
+
+/**
+ * HildonIMCapabilities:
+ * @HILDON_IM_CAP_SHM_RING: Messages can go through a shared-memory ring
+ * @HILDON_IM_CAP_BULK: Text payloads can go through window properties
+ * @HILDON_IM_CAP_TRACE: Messages can be stamped for latency tracing
+ * @HILDON_IM_CAP_ACK: The IM confirms every surrounding it handled with
+ * %HILDON_IM_CONTEXT_SURROUNDING_ACK
+ * @HILDON_IM_CAP_FOCUS: A #HildonIMFocusMessage replaces the messages sent
+ * when a client gets the focus
+ * @HILDON_IM_CAP_REPLACE: Text around the cursor can be replaced with a
+ * #HildonIMReplaceMessage
+ * @HILDON_IM_CAP_PREEDIT: The preedit can be set with a
+ * #HildonIMPreeditMessage
+ * @HILDON_IM_CAP_KEY_EVENTS: Key events can be sent two at a time as a
+ * #HildonIMKeyEventsMessage
+ * @HILDON_IM_CAP_CURSOR: The cursor rectangle is sent as a
+ * #HildonIMCursorMessage whenever it changes
+ * @HILDON_IM_CAP_SELECTION: A #HildonIMClipboardSelectionReplyMessage is
+ * sent whenever the client gets or loses a selection, so the IM need not
+ * send %HILDON_IM_CONTEXT_CLIPBOARD_SELECTION_QUERY
+ * @HILDON_IM_CAP_STATE_PAGE: Modifier, option and autocap state can be
+ * shared through a #HildonIMStatePage
+ *
+ * Optional protocol features. The IM publishes the ones it implements
+ * in the _HILDON_IM_PROTOCOL_VERSION property of the root window, the
+ * context sends its own with every #HildonIMActivateMessage. Either side
+ * only uses a feature the other side has announced and otherwise falls
+ * back to the original messages.
+ *
+ */
+typedef enum
+{
+  HILDON_IM_CAP_SHM_RING = 1 << 0,
+  HILDON_IM_CAP_BULK     = 1 << 1,
+  HILDON_IM_CAP_TRACE    = 1 << 2,
+  HILDON_IM_CAP_ACK      = 1 << 3,
+  HILDON_IM_CAP_FOCUS    = 1 << 4,
+  HILDON_IM_CAP_REPLACE  = 1 << 5,
+  HILDON_IM_CAP_PREEDIT  = 1 << 6,
+  HILDON_IM_CAP_KEY_EVENTS = 1 << 7,
+  HILDON_IM_CAP_CURSOR   = 1 << 8,
+  HILDON_IM_CAP_SELECTION = 1 << 9,
+  HILDON_IM_CAP_STATE_PAGE = 1 << 10
+} HildonIMCapabilities;
+
+/* The protocol revision described by this header. Peers that publish
+   nothing speak revision 0, the unversioned original protocol. */
+#define HILDON_IM_PROTOCOL_VERSION_CURRENT 1
+
+/* Publishes the version and capabilities of the IM on the root window */
+void hildon_im_protocol_set_capabilities(HildonIMCapabilities caps);
+
+/* Reads the version and capabilities published by the IM */
+HildonIMCapabilities hildon_im_protocol_read_capabilities(Display *display,
+                                                          guint32 *version);
+
+/* A pending read of the IM window and capabilities, see
+   hildon_im_protocol_query_peer() */
+typedef struct _HildonIMPeerQuery HildonIMPeerQuery;
+
+/* Sends the requests for the IM window and capabilities of a display */
+HildonIMPeerQuery *hildon_im_protocol_query_peer(GdkDisplay *display);
+/* Collects the replies of a peer query and frees it. Returns the IM window */
+Window hildon_im_protocol_query_peer_finish(HildonIMPeerQuery *query,
+                                            HildonIMCapabilities *caps,
+                                            guint32 *version);
 
 /* IM atom names */
 #define HILDON_IM_WINDOW_NAME                    "_HILDON_IM_WINDOW"
@@ -77,6 +146,16 @@ Atom hildon_im_protocol_get_atom(HildonIMAtom atom_name);
 #define HILDON_IM_PREEDIT_COMMITTED_NAME         "_HILDON_IM_PREEDIT_COMMITTED"
 #define HILDON_IM_PREEDIT_COMMITTED_CONTENT_NAME "_HILDON_IM_PREEDIT_COMMITTED_CONTENT"
 #define HILDON_IM_LONG_PRESS_SETTINGS_NAME       "_HILDON_IM_LONG_PRESS_SETTINGS"
+#define HILDON_IM_SHM_RING_NAME                  "_HILDON_IM_SHM_RING"
+#define HILDON_IM_BULK_NAME                      "_HILDON_IM_BULK"
+#define HILDON_IM_PROTOCOL_VERSION_NAME          "_HILDON_IM_PROTOCOL_VERSION"
+#define HILDON_IM_TRACE_NAME                     "_HILDON_IM_TRACE"
+#define HILDON_IM_FOCUS_NAME                     "_HILDON_IM_FOCUS"
+#define HILDON_IM_REPLACE_NAME                   "_HILDON_IM_REPLACE"
+#define HILDON_IM_PREEDIT_NAME                   "_HILDON_IM_PREEDIT"
+#define HILDON_IM_KEY_EVENTS_NAME                "_HILDON_IM_KEY_EVENTS"
+#define HILDON_IM_CURSOR_NAME                    "_HILDON_IM_CURSOR"
+#define HILDON_IM_STATE_NAME                     "_HILDON_IM_STATE"
 
 /* IM ClientMessage formats */
 #define HILDON_IM_WINDOW_ID_FORMAT 32
@@ -92,6 +171,16 @@ Atom hildon_im_protocol_get_atom(HildonIMAtom atom_name);
 #define HILDON_IM_PREEDIT_COMMITTED_FORMAT 8
 #define HILDON_IM_PREEDIT_COMMITTED_CONTENT_FORMAT 8
 #define HILDON_IM_LONG_PRESS_SETTINGS_FORMAT 32
+#define HILDON_IM_SHM_RING_FORMAT 8
+#define HILDON_IM_BULK_FORMAT 8
+#define HILDON_IM_PROTOCOL_VERSION_FORMAT 32
+#define HILDON_IM_TRACE_FORMAT 32
+#define HILDON_IM_FOCUS_FORMAT 8
+#define HILDON_IM_REPLACE_FORMAT 8
+#define HILDON_IM_PREEDIT_FORMAT 8
+#define HILDON_IM_KEY_EVENTS_FORMAT 8
+#define HILDON_IM_CURSOR_FORMAT 32
+#define HILDON_IM_STATE_FORMAT 8
 
 /**
  * HildonIMCommand:
@@ -176,6 +265,8 @@ typedef enum
  * @HILDON_IM_CONTEXT_LEVEL_UNLOCKED: Notify context of level unlocked in a plugin
  * @HILDON_IM_CONTEXT_SHIFT_UNSTICKY: Notify context to remove stickyness of shift
  * @HILDON_IM_CONTEXT_LEVEL_UNSTICKY: Notify context to remove stickyness of level
+ * @HILDON_IM_CONTEXT_SURROUNDING_ACK: The IM handled the oldest surrounding
+ * it had not confirmed yet, see %HILDON_IM_CAP_ACK
  * @HILDON_IM_CONTEXT_NUM_COM: The number of defined commands
  *
  * IM communications, from IM process to context.
@@ -217,6 +308,8 @@ typedef enum
   HILDON_IM_CONTEXT_SHIFT_UNSTICKY,
   HILDON_IM_CONTEXT_LEVEL_UNSTICKY,
 
+  HILDON_IM_CONTEXT_SURROUNDING_ACK,
+
   /* always last */
   HILDON_IM_CONTEXT_NUM_COM
 } HildonIMCommunication;
@@ -274,7 +367,9 @@ typedef enum
  * works as a temporary mode, so the commit mode will be reset to its old value
  * after the preedit text has been set. Remember to send a
  * @HILDON_IM_CONTEXT_PREEDIT_MODE message before using @hildon_im_ui_send_utf8
- * to set the preedit, each time.
+ * to set the preedit, each time. A context that announced
+ * %HILDON_IM_CAP_PREEDIT takes a #HildonIMPreeditMessage instead, which
+ * leaves the commit mode alone.
  *
  * The mode to determine how and where the text is committed.
  *
@@ -297,13 +392,15 @@ typedef enum {
   HILDON_IM_DEAD_KEY_MASK         = 1 << 5
 } HildonIMInternalModifierMask;
 
-/* Command activation message, from context to IM (see HildonIMCommand) */
+/* Command activation message, from context to IM (see HildonIMCommand).
+   capabilities is zero when sent by an unversioned context. */
 typedef struct
 {
   guint32 input_window;
   guint32 app_window;
   HildonIMCommand cmd;
   HildonIMTrigger trigger;
+  guint32 capabilities;
 } HildonIMActivateMessage;
 
 typedef struct
@@ -314,7 +411,9 @@ typedef struct
 
 /* event.xclient.data may not exceed 20 bytes -> HildonIMInsertUtf8Message
    may not exceed 20 bytes. So the maximum size of message buffer is
-   20 - sizeof(msg_flags) = 16. */
+   20 - sizeof(msg_flags) = 16. A chunk ends on a character boundary and
+   is nul-terminated unless it fills the field, which senders only do
+   towards a peer that announced its capabilities. */
 #define HILDON_IM_CLIENT_MESSAGE_BUFFER_SIZE (20 - sizeof(int))
 
 /* Text insertion message, from IM to context */
@@ -380,6 +479,14 @@ typedef struct
 
 } HildonIMComMessage;
 
+/* Reply to HILDON_IM_CONTEXT_CLIPBOARD_SELECTION_QUERY, from context to IM.
+   An IM that announced HILDON_IM_CAP_SELECTION also gets it unasked when
+   a client gets the focus and whenever has_selection flips. */
+typedef struct
+{
+  guint32 has_selection;
+} HildonIMClipboardSelectionReplyMessage;
+
 /* Long-press settings message from IM to context */
 typedef struct
 {
@@ -387,6 +494,338 @@ typedef struct
   guint16 long_press_timeout;
 } HildonIMLongPressSettingsMessage;
 
+/**
+ * HildonIMShmRingCommand:
+ * @HILDON_IM_SHM_RING_ANNOUNCE: The context offers a ring, see #HildonIMShmRingMessage
+ * @HILDON_IM_SHM_RING_ACCEPT: The IM has mapped the announced ring
+ * @HILDON_IM_SHM_RING_DOORBELL: New messages are waiting in the ring
+ * @HILDON_IM_SHM_RING_CLOSE: The sender stops using the ring
+ *
+ * Shared-memory ring control messages. The ring is only offered to an
+ * IM that announced %HILDON_IM_CAP_SHM_RING, and only used after the IM
+ * has answered an ANNOUNCE with an ACCEPT; everything else stays on the
+ * ClientMessage path.
+ *
+ */
+typedef enum
+{
+  HILDON_IM_SHM_RING_ANNOUNCE,
+  HILDON_IM_SHM_RING_ACCEPT,
+  HILDON_IM_SHM_RING_DOORBELL,
+  HILDON_IM_SHM_RING_CLOSE
+} HildonIMShmRingCommand;
+
+/* Shared-memory ring control message, sent by both IM and context.
+   File descriptors cannot travel through the X server, so the IM maps
+   the ring through /proc/<pid>/fd/<fd> of the announcing process. */
+typedef struct
+{
+  guint32 input_window;
+  HildonIMShmRingCommand type;
+  gint32 pid;
+  gint32 fd;
+  guint32 n_slots;
+} HildonIMShmRingMessage;
+
+#define HILDON_IM_RING_MAGIC   0x524d4948 /* "HIMR" */
+#define HILDON_IM_RING_VERSION 1
+
+/* Header at the start of the shared mapping. head and tail are
+   free-running counters, the slot index is counter % n_slots. Only the
+   context writes head and only the IM writes tail. The IM sets
+   consumer_waiting before it goes back to its main loop, and the context
+   rings the doorbell only when it clears that flag. */
+typedef struct
+{
+  guint32 magic;
+  guint32 version;
+  guint32 n_slots;
+  guint32 slot_size;
+  volatile gint head;
+  volatile gint tail;
+  volatile gint consumer_waiting;
+  guint32 reserved;
+} HildonIMRingHeader;
+
+/* One ring slot carries exactly what a ClientMessage would have: the
+   HildonIMAtom of the message, its format and the 20 data bytes. */
+typedef struct
+{
+  guint32 atom;
+  guint32 format;
+  char data[20];
+  guint32 reserved;
+} HildonIMRingSlot;
+
+/**
+ * HildonIMBulkType:
+ * @HILDON_IM_BULK_WHOLE: The property holds the complete payload
+ * @HILDON_IM_BULK_INCR_START: The property holds the first piece of a payload
+ * @HILDON_IM_BULK_INCR_CONTINUE: The property holds a further piece
+ * @HILDON_IM_BULK_INCR_END: The property holds the last piece
+ *
+ * Bulk transfers replace the 16-byte chunks of SURROUNDING_CONTENT,
+ * PREEDIT_COMMITTED_CONTENT and INSERT_UTF8 between peers that both
+ * announced %HILDON_IM_CAP_BULK. The sender stores the text
+ * in a property named after the content's atom on the client's input
+ * window and sends one #HildonIMBulkMessage. The receiver reads the
+ * property and deletes it. Payloads too large for one request are
+ * streamed like ICCCM INCR transfers: the sender writes the next piece
+ * when it sees the PropertyNotify for the deletion. The sender never
+ * writes a property the receiver has not deleted yet, so a further
+ * payload waits for that deletion too. A header message that
+ * normally follows the content is sent after the last piece, and a new
+ * transfer discards an incomplete one from the same sender.
+ *
+ */
+typedef enum
+{
+  HILDON_IM_BULK_WHOLE,
+  HILDON_IM_BULK_INCR_START,
+  HILDON_IM_BULK_INCR_CONTINUE,
+  HILDON_IM_BULK_INCR_END
+} HildonIMBulkType;
+
+/* Bulk payload notification, sent by both IM and context */
+typedef struct
+{
+  guint32 input_window;
+  HildonIMBulkType type;
+  HildonIMAtom content;
+  guint32 length;
+} HildonIMBulkMessage;
+
+/**
+ * HildonIMTraceType:
+ * @HILDON_IM_TRACE_STAMP: Stamps the next message of the sender
+ * @HILDON_IM_TRACE_ECHO: Echoes a stamp back to its sender
+ *
+ * Latency tracing between peers that both announced %HILDON_IM_CAP_TRACE.
+ * The context sends a stamp right before each key event, and the IM
+ * answers with an echo holding the time the key event arrived. The IM
+ * stamps the message it sends in reply, e.g. INSERT_UTF8, with the seq
+ * of the key event it answers, or 0 if it answers none. Times are
+ * CLOCK_MONOTONIC in microseconds, so they compare across processes.
+ *
+ */
+typedef enum
+{
+  HILDON_IM_TRACE_STAMP,
+  HILDON_IM_TRACE_ECHO
+} HildonIMTraceType;
+
+/* Latency tracing message, sent by both IM and context */
+typedef struct
+{
+  HildonIMTraceType type;
+  guint32 seq;
+  HildonIMAtom atom;
+  guint32 time_hi;
+  guint32 time_lo;
+} HildonIMTraceMessage;
+
+/**
+ * HildonIMFocusFlags:
+ * @HILDON_IM_FOCUS_AUTOCAP: Automatic capitalization applies to the client
+ * @HILDON_IM_FOCUS_SURROUNDING: The short surrounding of the cursor follows
+ * right away, so the IM does not need to request it
+ *
+ * What else a #HildonIMFocusMessage tells the IM.
+ *
+ */
+typedef enum
+{
+  HILDON_IM_FOCUS_AUTOCAP     = 1 << 0,
+  HILDON_IM_FOCUS_SURROUNDING = 1 << 1
+} HildonIMFocusFlags;
+
+/* Focus bundle, from context to IM that announced HILDON_IM_CAP_FOCUS.
+   It stands for the input mode message, the activation with cmd
+   HILDON_IM_SETCLIENT or HILDON_IM_SETNSHOW and the commands setting the
+   modifiers, which are all a client sends when it gets the focus.
+   modifiers is a HildonIMInternalModifierMask of the shift and level
+   sticky and lock bits the IM is to take over. The input modes are
+   whole HildonGtkInputModes. The context's capabilities come with its
+   HildonIMActivateMessages. */
+typedef struct
+{
+  guint32 input_window;
+  guint32 app_window;
+  guint32 input_mode;
+  guint32 default_input_mode;
+  guint8 cmd;
+  guint8 trigger;
+  guint8 modifiers;
+  guint8 flags;
+} HildonIMFocusMessage;
+
+#define HILDON_IM_REPLACE_BUFFER_SIZE 15
+
+/* Range replacement, from IM to a context that announced
+   HILDON_IM_CAP_REPLACE. The characters from start to end, counted from
+   the cursor, are replaced with the text, which is split into chunks
+   like that of HildonIMInsertUtf8Message. Every chunk repeats the range;
+   the context applies it as one edit once the END chunk arrived. */
+typedef struct
+{
+  gint16 start;
+  gint16 end;
+  gint8 msg_flag;
+  char utf8_str[HILDON_IM_REPLACE_BUFFER_SIZE];
+} HildonIMReplaceMessage;
+
+/**
+ * HildonIMPreeditFlags:
+ * @HILDON_IM_PREEDIT_APPEND: The text extends the current preedit instead
+ * of replacing it
+ *
+ * How a #HildonIMPreeditMessage changes the preedit.
+ *
+ */
+typedef enum
+{
+  HILDON_IM_PREEDIT_APPEND = 1 << 0
+} HildonIMPreeditFlags;
+
+#define HILDON_IM_PREEDIT_BUFFER_SIZE 18
+
+/* Preedit text, from IM to a context that announced HILDON_IM_CAP_PREEDIT.
+   The text is split into chunks like that of HildonIMInsertUtf8Message,
+   so a preedit of up to 18 bytes is a single END chunk. flags is a
+   HildonIMPreeditFlags and only read from the END chunk. An empty text
+   without HILDON_IM_PREEDIT_APPEND clears the preedit. */
+typedef struct
+{
+  gint8 msg_flag;
+  guint8 flags;
+  char utf8_str[HILDON_IM_PREEDIT_BUFFER_SIZE];
+} HildonIMPreeditMessage;
+
+/* The part of a key event's state a HildonIMKeyRecord keeps: the core X
+   modifier and button bits. The GDK bits above them are derived from
+   these, or from the type in the case of GDK_RELEASE_MASK. */
+#define HILDON_IM_KEY_RECORD_STATE_MASK 0xffff
+
+/* One key event in a HildonIMKeyEventsMessage. type is GDK_KEY_PRESS or
+   GDK_KEY_RELEASE, or 0 for an unused record. X keycodes fit in 8 bits. */
+typedef struct
+{
+  guint8 type;
+  guint8 hardware_keycode;
+  guint16 state;
+  guint32 keyval;
+} HildonIMKeyRecord;
+
+/* Key events, from context to IM that announced HILDON_IM_CAP_KEY_EVENTS.
+   It stands for one or two HildonIMKeyEventMessages of the same client,
+   in order, e.g. a key press and its release. */
+typedef struct
+{
+  guint32 input_window;
+  HildonIMKeyRecord events[2];
+} HildonIMKeyEventsMessage;
+
+/* Cursor rectangle of the focused client in root window coordinates,
+   from context to IM that announced HILDON_IM_CAP_CURSOR. It is sent
+   whenever the client reports a rectangle that differs from the last
+   one sent, at most every 50 ms, so the IM can place popups next to the
+   cursor without asking the X server. */
+typedef struct
+{
+  guint32 input_window;
+  gint32 x;
+  gint32 y;
+  gint32 width;
+  gint32 height;
+} HildonIMCursorMessage;
+
+/**
+ * HildonIMStateCommand:
+ * @HILDON_IM_STATE_ANNOUNCE: The context offers a state page, see
+ * #HildonIMStateMessage
+ * @HILDON_IM_STATE_ACCEPT: The IM has mapped the announced page
+ * @HILDON_IM_STATE_CHANGED: The sender changed its block of the page
+ * while the receiver was asleep
+ * @HILDON_IM_STATE_CLOSE: The sender stops using the page
+ *
+ * State page control messages. The page is only offered to an IM that
+ * announced %HILDON_IM_CAP_STATE_PAGE. Once the IM has accepted it,
+ * neither side sends the modifier commands from %HILDON_IM_SHIFT_LOCKED
+ * to %HILDON_IM_MOD_UNSTICKY or the modifier #HildonIMCommunication
+ * messages from %HILDON_IM_CONTEXT_SHIFT_LOCKED to
+ * %HILDON_IM_CONTEXT_LEVEL_UNSTICKY any more; both write their block
+ * of the page instead.
+ *
+ */
+typedef enum
+{
+  HILDON_IM_STATE_ANNOUNCE,
+  HILDON_IM_STATE_ACCEPT,
+  HILDON_IM_STATE_CHANGED,
+  HILDON_IM_STATE_CLOSE
+} HildonIMStateCommand;
+
+/* State page control message, sent by both IM and context. Like the
+   shared-memory ring, the IM maps the page through /proc/<pid>/fd/<fd>
+   of the announcing process. */
+typedef struct
+{
+  guint32 input_window;
+  HildonIMStateCommand type;
+  gint32 pid;
+  gint32 fd;
+} HildonIMStateMessage;
+
+#define HILDON_IM_STATE_MAGIC   0x534d4948 /* "HIMS" */
+#define HILDON_IM_STATE_VERSION 1
+
+/**
+ * HildonIMStateSide:
+ * @HILDON_IM_STATE_SIDE_CONTEXT: The block the context writes
+ * @HILDON_IM_STATE_SIDE_IM: The block the IM writes
+ *
+ * The two halves of a #HildonIMStatePage.
+ */
+typedef enum
+{
+  HILDON_IM_STATE_SIDE_CONTEXT,
+  HILDON_IM_STATE_SIDE_IM,
+  HILDON_IM_STATE_NUM_SIDES
+} HildonIMStateSide;
+
+/* Autocap applies to the client, see HILDON_GTK_INPUT_MODE_AUTOCAP */
+#define HILDON_IM_STATE_AUTOCAP (1 << 0)
+
+/* The state one side publishes. Only that side writes seq and the
+   values; seq is odd while it is writing, and a reader retries until it
+   sees the same even seq before and after copying the values. mask is a
+   HildonIMInternalModifierMask of the shift and level bits, options a
+   HildonIMOptionMask, only meaningful in the IM's block, and flags holds
+   HILDON_IM_STATE_AUTOCAP, only meaningful in the context's block.
+   input_window is the client the state belongs to. The owner sets
+   sleeping before it waits for events, and the other side only sends
+   HILDON_IM_STATE_CHANGED when it clears that flag. */
+typedef struct
+{
+  volatile gint seq;
+  volatile gint sleeping;
+  guint32 input_window;
+  guint32 mask;
+  guint32 options;
+  guint32 flags;
+  guint32 reserved[2];
+} HildonIMStateBlock;
+
+/* The shared mapping, one page per context process */
+typedef struct
+{
+  guint32 magic;
+  guint32 version;
+  guint32 block_size;
+  guint32 reserved;
+  HildonIMStateBlock blocks[HILDON_IM_STATE_NUM_SIDES];
+} HildonIMStatePage;
+
 G_END_DECLS
 
 #endif
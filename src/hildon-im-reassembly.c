@@ -0,0 +1,218 @@
+/**
+   @file: hildon-im-reassembly.c
+
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "hildon-im-gtk-compat.h"
+#include "hildon-im-protocol.h"
+#include "hildon-im-reassembly.h"
+
+/* A buffer that grew past this many times its initial size is released
+   on reset instead of being kept for the next message */
+#define REASSEMBLY_SHRINK_FACTOR 8
+
+struct _HildonIMReassembly
+{
+  gchar *buffer;
+  gsize length;
+  gsize allocated;
+  gsize initial_size;
+  gsize max_size;
+  gboolean active;
+  gboolean overflowed;
+};
+
+static void
+reassembly_grow (HildonIMReassembly *reassembly, gsize needed)
+{
+  gsize allocated;
+
+  /* Room for the terminating nul is always kept */
+  if (needed < reassembly->allocated)
+    return;
+
+  allocated = MAX (reassembly->allocated, reassembly->initial_size + 1);
+  while (allocated <= needed)
+    allocated *= 2;
+
+  reassembly->buffer = g_realloc (reassembly->buffer, allocated);
+  reassembly->allocated = allocated;
+}
+
+HildonIMReassembly *
+hildon_im_reassembly_new (gsize initial_size, gsize max_size)
+{
+  HildonIMReassembly *reassembly;
+
+  reassembly = g_new0 (HildonIMReassembly, 1);
+  reassembly->initial_size = MAX (initial_size, 1);
+  reassembly->max_size = MAX (max_size, reassembly->initial_size);
+
+  reassembly_grow (reassembly, reassembly->initial_size);
+  reassembly->buffer[0] = '\0';
+
+  return reassembly;
+}
+
+void
+hildon_im_reassembly_free (HildonIMReassembly *reassembly)
+{
+  if (reassembly == NULL)
+    return;
+
+  g_free (reassembly->buffer);
+  g_free (reassembly);
+}
+
+void
+hildon_im_reassembly_reset (HildonIMReassembly *reassembly)
+{
+  g_return_if_fail (reassembly != NULL);
+
+  if (reassembly->allocated >
+      reassembly->initial_size * REASSEMBLY_SHRINK_FACTOR)
+  {
+    g_free (reassembly->buffer);
+    reassembly->buffer = NULL;
+    reassembly->allocated = 0;
+    reassembly_grow (reassembly, reassembly->initial_size);
+  }
+
+  if (reassembly->buffer != NULL)
+    reassembly->buffer[0] = '\0';
+
+  reassembly->length = 0;
+  reassembly->active = FALSE;
+  reassembly->overflowed = FALSE;
+}
+
+gboolean
+hildon_im_reassembly_reserve (HildonIMReassembly *reassembly, gsize size)
+{
+  g_return_val_if_fail (reassembly != NULL, FALSE);
+
+  if (size > reassembly->max_size)
+    return FALSE;
+
+  reassembly_grow (reassembly, size);
+
+  return TRUE;
+}
+
+HildonIMReassemblyStatus
+hildon_im_reassembly_feed (HildonIMReassembly *reassembly,
+                           gint flag,
+                           const gchar *data,
+                           gsize length)
+{
+  const gchar *nul;
+
+  g_return_val_if_fail (reassembly != NULL, HILDON_IM_REASSEMBLY_DROPPED);
+
+  if (flag != HILDON_IM_MSG_START &&
+      flag != HILDON_IM_MSG_CONTINUE &&
+      flag != HILDON_IM_MSG_END)
+  {
+    hildon_im_reassembly_reset (reassembly);
+    return HILDON_IM_REASSEMBLY_DROPPED;
+  }
+
+  if (flag == HILDON_IM_MSG_START || !reassembly->active)
+  {
+    hildon_im_reassembly_reset (reassembly);
+    reassembly->active = TRUE;
+  }
+
+  /* Chunks are fixed-size fields that are only nul-terminated when the
+     text is shorter than the field */
+  nul = memchr (data, '\0', length);
+  if (nul != NULL)
+    length = nul - data;
+
+  if (!reassembly->overflowed)
+  {
+    if (length > reassembly->max_size - reassembly->length)
+    {
+      reassembly->overflowed = TRUE;
+    }
+    else
+    {
+      reassembly_grow (reassembly, reassembly->length + length);
+      memcpy (reassembly->buffer + reassembly->length, data, length);
+      reassembly->length += length;
+      reassembly->buffer[reassembly->length] = '\0';
+    }
+  }
+
+  if (flag != HILDON_IM_MSG_END)
+    return HILDON_IM_REASSEMBLY_PENDING;
+
+  reassembly->active = FALSE;
+
+  if (reassembly->overflowed)
+  {
+    hildon_im_reassembly_reset (reassembly);
+    return HILDON_IM_REASSEMBLY_DROPPED;
+  }
+
+  return HILDON_IM_REASSEMBLY_COMPLETE;
+}
+
+const gchar *
+hildon_im_reassembly_peek (HildonIMReassembly *reassembly, gsize *length)
+{
+  g_return_val_if_fail (reassembly != NULL, NULL);
+
+  if (length)
+    *length = reassembly->length;
+
+  if (reassembly->buffer == NULL)
+    return "";
+
+  return reassembly->buffer;
+}
+
+gchar *
+hildon_im_reassembly_steal (HildonIMReassembly *reassembly, gsize *length)
+{
+  gchar *text;
+
+  g_return_val_if_fail (reassembly != NULL, NULL);
+
+  if (length)
+    *length = reassembly->length;
+
+  text = reassembly->buffer != NULL ? reassembly->buffer : g_strdup ("");
+
+  /* The next message allocates a fresh buffer on its first chunk */
+  reassembly->buffer = NULL;
+  reassembly->allocated = 0;
+  hildon_im_reassembly_reset (reassembly);
+
+  return text;
+}
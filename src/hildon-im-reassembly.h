@@ -0,0 +1,133 @@
+/**
+   @file: hildon-im-reassembly.h
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef HILDON_IM_REASSEMBLY_H_
+#define HILDON_IM_REASSEMBLY_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HildonIMReassembly HildonIMReassembly;
+
+/**
+ * HildonIMReassemblyStatus:
+ * @HILDON_IM_REASSEMBLY_PENDING: More chunks are expected
+ * @HILDON_IM_REASSEMBLY_COMPLETE: The END chunk arrived, the text is ready
+ * @HILDON_IM_REASSEMBLY_DROPPED: The message was discarded, because it
+ * grew past the size limit or a chunk had an unknown flag
+ */
+typedef enum
+{
+  HILDON_IM_REASSEMBLY_PENDING,
+  HILDON_IM_REASSEMBLY_COMPLETE,
+  HILDON_IM_REASSEMBLY_DROPPED
+} HildonIMReassemblyStatus;
+
+/**
+ * hildon_im_reassembly_new:
+ * @initial_size: bytes to allocate up front
+ * @max_size: the largest message accepted, in bytes
+ *
+ * Creates a buffer that joins text sent as HILDON_IM_MSG_START,
+ * HILDON_IM_MSG_CONTINUE and HILDON_IM_MSG_END chunks. The buffer grows
+ * geometrically, so a message costs a logarithmic number of allocations.
+ *
+ * Returns: a new #HildonIMReassembly
+ */
+HildonIMReassembly *hildon_im_reassembly_new (gsize initial_size,
+                                              gsize max_size);
+
+/**
+ * hildon_im_reassembly_free:
+ * @reassembly: a #HildonIMReassembly
+ */
+void hildon_im_reassembly_free (HildonIMReassembly *reassembly);
+
+/**
+ * hildon_im_reassembly_reset:
+ * @reassembly: a #HildonIMReassembly
+ *
+ * Drops the message in progress. A buffer that grew well past its
+ * initial size is released.
+ */
+void hildon_im_reassembly_reset (HildonIMReassembly *reassembly);
+
+/**
+ * hildon_im_reassembly_reserve:
+ * @reassembly: a #HildonIMReassembly
+ * @size: the announced size of the message in progress
+ *
+ * Allocates room for @size bytes at once, for senders that announce the
+ * total length.
+ *
+ * Returns: FALSE if @size is over the limit.
+ */
+gboolean hildon_im_reassembly_reserve (HildonIMReassembly *reassembly,
+                                       gsize size);
+
+/**
+ * hildon_im_reassembly_feed:
+ * @reassembly: a #HildonIMReassembly
+ * @flag: HILDON_IM_MSG_START, HILDON_IM_MSG_CONTINUE or HILDON_IM_MSG_END
+ * @data: the chunk
+ * @length: the size of @data; the chunk also ends at the first nul byte
+ *
+ * Appends one chunk. A START chunk drops any unfinished message. A
+ * CONTINUE or END chunk with no message in progress starts one, since
+ * short texts are sent as a single END chunk. Once a message is over the
+ * limit its remaining chunks are skipped until END.
+ *
+ * Returns: the state of the message after this chunk.
+ */
+HildonIMReassemblyStatus hildon_im_reassembly_feed (HildonIMReassembly *reassembly,
+                                                    gint flag,
+                                                    const gchar *data,
+                                                    gsize length);
+
+/**
+ * hildon_im_reassembly_peek:
+ * @reassembly: a #HildonIMReassembly
+ * @length: location for the length of the text, or NULL
+ *
+ * Returns: the text gathered so far, nul-terminated. It stays owned by
+ * @reassembly and is valid until the next call on it.
+ */
+const gchar *hildon_im_reassembly_peek (HildonIMReassembly *reassembly,
+                                        gsize *length);
+
+/**
+ * hildon_im_reassembly_steal:
+ * @reassembly: a #HildonIMReassembly
+ * @length: location for the length of the text, or NULL
+ *
+ * Hands the gathered text over to the caller without copying it, and
+ * resets @reassembly.
+ *
+ * Returns: the text, nul-terminated. Free it with g_free().
+ */
+gchar *hildon_im_reassembly_steal (HildonIMReassembly *reassembly,
+                                   gsize *length);
+
+G_END_DECLS
+
+#endif /* ifndef HILDON_IM_REASSEMBLY_H_ */
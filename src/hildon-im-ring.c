@@ -0,0 +1,276 @@
+/**
+   @file: hildon-im-ring.c
+
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "hildon-im-gtk-compat.h"
+#include "hildon-im-ring.h"
+
+struct _HildonIMRing
+{
+  gint fd;
+  gsize map_size;
+  HildonIMRingHeader *header;
+  HildonIMRingSlot *slots;
+};
+
+static gsize
+ring_map_size (guint n_slots)
+{
+  return sizeof (HildonIMRingHeader) + n_slots * sizeof (HildonIMRingSlot);
+}
+
+static HildonIMRing *
+ring_map (gint fd, guint n_slots)
+{
+  HildonIMRing *ring;
+  gsize size = ring_map_size (n_slots);
+  void *addr;
+
+  addr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  ring = g_new0 (HildonIMRing, 1);
+  ring->fd = fd;
+  ring->map_size = size;
+  ring->header = addr;
+  ring->slots = (HildonIMRingSlot *) (ring->header + 1);
+
+  return ring;
+}
+
+HildonIMRing *
+hildon_im_ring_new (guint n_slots)
+{
+#ifdef HAVE_MEMFD_CREATE
+  HildonIMRing *ring;
+  guint size = 1;
+  gint fd;
+
+  while (size < n_slots)
+    size <<= 1;
+
+  fd = memfd_create ("hildon-im-ring", MFD_CLOEXEC);
+  if (fd < 0)
+  {
+    g_warning ("Unable to create the IM ring");
+    return NULL;
+  }
+
+  if (ftruncate (fd, ring_map_size (size)) != 0 ||
+      (ring = ring_map (fd, size)) == NULL)
+  {
+    g_warning ("Unable to map the IM ring");
+    close (fd);
+    return NULL;
+  }
+
+  ring->header->magic = HILDON_IM_RING_MAGIC;
+  ring->header->version = HILDON_IM_RING_VERSION;
+  ring->header->n_slots = size;
+  ring->header->slot_size = sizeof (HildonIMRingSlot);
+  hildon_im_ring_reset (ring);
+
+  return ring;
+#else
+  return NULL;
+#endif
+}
+
+HildonIMRing *
+hildon_im_ring_open (gint pid, gint fd, guint n_slots)
+{
+  HildonIMRing *ring;
+  struct stat st;
+  gchar *path;
+  gint local_fd;
+
+  if (n_slots == 0 || (n_slots & (n_slots - 1)) != 0 ||
+      n_slots > (G_MAXSIZE - sizeof (HildonIMRingHeader)) /
+                sizeof (HildonIMRingSlot))
+  {
+    return NULL;
+  }
+
+  path = g_strdup_printf ("/proc/%d/fd/%d", pid, fd);
+  local_fd = open (path, O_RDWR | O_CLOEXEC);
+  g_free (path);
+
+  if (local_fd < 0)
+    return NULL;
+
+  /* Touching a mapping past the end of the file raises SIGBUS, so a
+     wrong pid/fd pair or slot count must not get that far */
+  if (fstat (local_fd, &st) != 0 ||
+      (guint64) st.st_size < (guint64) ring_map_size (n_slots))
+  {
+    g_warning ("IM ring file is smaller than announced");
+    close (local_fd);
+    return NULL;
+  }
+
+  ring = ring_map (local_fd, n_slots);
+  if (ring == NULL)
+  {
+    close (local_fd);
+    return NULL;
+  }
+
+  if (ring->header->magic != HILDON_IM_RING_MAGIC ||
+      ring->header->version != HILDON_IM_RING_VERSION ||
+      ring->header->n_slots != n_slots ||
+      ring->header->slot_size != sizeof (HildonIMRingSlot))
+  {
+    g_warning ("IM ring header mismatch");
+    hildon_im_ring_free (ring);
+    return NULL;
+  }
+
+  return ring;
+}
+
+void
+hildon_im_ring_free (HildonIMRing *ring)
+{
+  if (ring == NULL)
+    return;
+
+  munmap (ring->header, ring->map_size);
+  close (ring->fd);
+  g_free (ring);
+}
+
+gint
+hildon_im_ring_get_fd (HildonIMRing *ring)
+{
+  g_return_val_if_fail (ring != NULL, -1);
+
+  return ring->fd;
+}
+
+guint
+hildon_im_ring_get_n_slots (HildonIMRing *ring)
+{
+  g_return_val_if_fail (ring != NULL, 0);
+
+  return ring->header->n_slots;
+}
+
+void
+hildon_im_ring_reset (HildonIMRing *ring)
+{
+  g_return_if_fail (ring != NULL);
+
+  g_atomic_int_set (&ring->header->head, 0);
+  g_atomic_int_set (&ring->header->tail, 0);
+  g_atomic_int_set (&ring->header->consumer_waiting, 1);
+}
+
+gboolean
+hildon_im_ring_push (HildonIMRing *ring,
+                     HildonIMAtom atom,
+                     gint format,
+                     const void *data,
+                     gboolean *need_doorbell)
+{
+  HildonIMRingSlot *slot;
+  guint head, tail;
+
+  g_return_val_if_fail (ring != NULL, FALSE);
+
+  head = (guint) g_atomic_int_get (&ring->header->head);
+  tail = (guint) g_atomic_int_get (&ring->header->tail);
+
+  if (head - tail >= ring->header->n_slots)
+    return FALSE;
+
+  slot = &ring->slots[head & (ring->header->n_slots - 1)];
+  slot->atom = atom;
+  slot->format = format;
+  memcpy (slot->data, data, sizeof (slot->data));
+
+  /* Publishing head is a full barrier, the slot is visible before it */
+  g_atomic_int_set (&ring->header->head, (gint) (head + 1));
+
+  /* Only the push that takes the consumer out of its sleep rings the
+     doorbell; the consumer drains everything else on the same wakeup */
+  if (need_doorbell)
+    *need_doorbell =
+      g_atomic_int_compare_and_exchange (&ring->header->consumer_waiting, 1, 0);
+
+  return TRUE;
+}
+
+gboolean
+hildon_im_ring_pop (HildonIMRing *ring, HildonIMRingSlot *slot)
+{
+  guint head, tail;
+
+  g_return_val_if_fail (ring != NULL, FALSE);
+
+  tail = (guint) g_atomic_int_get (&ring->header->tail);
+  head = (guint) g_atomic_int_get (&ring->header->head);
+
+  if (head == tail)
+    return FALSE;
+
+  *slot = ring->slots[tail & (ring->header->n_slots - 1)];
+  g_atomic_int_set (&ring->header->tail, (gint) (tail + 1));
+
+  return TRUE;
+}
+
+gboolean
+hildon_im_ring_sleep (HildonIMRing *ring)
+{
+  g_return_val_if_fail (ring != NULL, TRUE);
+
+  g_atomic_int_set (&ring->header->consumer_waiting, 1);
+
+  /* A push that raced with us may have seen consumer_waiting == 0 and
+     skipped the doorbell, so look once more before sleeping */
+  if (g_atomic_int_get (&ring->header->head) !=
+      g_atomic_int_get (&ring->header->tail))
+  {
+    g_atomic_int_compare_and_exchange (&ring->header->consumer_waiting, 1, 0);
+    return FALSE;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,138 @@
+/**
+   @file: hildon-im-ring.h
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef HILDON_IM_RING_H_
+#define HILDON_IM_RING_H_
+
+#include <glib.h>
+
+#include "hildon-im-protocol.h"
+
+G_BEGIN_DECLS
+
+#define HILDON_IM_RING_DEFAULT_SLOTS 256
+
+typedef struct _HildonIMRing HildonIMRing;
+
+/**
+ * hildon_im_ring_new:
+ * @n_slots: number of slots, rounded up to a power of two
+ *
+ * Creates a new single-producer/single-consumer ring in an anonymous
+ * shared memory file. The creating side is the producer.
+ *
+ * Returns: a new #HildonIMRing, or NULL if shared memory is unavailable.
+ */
+HildonIMRing *hildon_im_ring_new (guint n_slots);
+
+/**
+ * hildon_im_ring_open:
+ * @pid: the process that created the ring
+ * @fd: the ring's file descriptor in that process
+ * @n_slots: the number of slots announced by the producer
+ *
+ * Maps a ring created by another process. The opening side is the
+ * consumer.
+ *
+ * Returns: a #HildonIMRing, or NULL if it could not be mapped or the
+ * header does not match.
+ */
+HildonIMRing *hildon_im_ring_open (gint pid, gint fd, guint n_slots);
+
+/**
+ * hildon_im_ring_free:
+ * @ring: a #HildonIMRing
+ *
+ * Unmaps the ring and closes its file descriptor.
+ */
+void hildon_im_ring_free (HildonIMRing *ring);
+
+/**
+ * hildon_im_ring_get_fd:
+ * @ring: a #HildonIMRing
+ *
+ * Returns: the file descriptor backing @ring.
+ */
+gint hildon_im_ring_get_fd (HildonIMRing *ring);
+
+/**
+ * hildon_im_ring_get_n_slots:
+ * @ring: a #HildonIMRing
+ *
+ * Returns: the number of slots in @ring.
+ */
+guint hildon_im_ring_get_n_slots (HildonIMRing *ring);
+
+/**
+ * hildon_im_ring_reset:
+ * @ring: a #HildonIMRing
+ *
+ * Drops all pending slots. Only call this on the producer side while no
+ * consumer is attached, e.g. before announcing the ring to a new IM.
+ */
+void hildon_im_ring_reset (HildonIMRing *ring);
+
+/**
+ * hildon_im_ring_push:
+ * @ring: a #HildonIMRing
+ * @atom: the #HildonIMAtom of the message
+ * @format: the ClientMessage format of the message
+ * @data: the 20 bytes of message data
+ * @need_doorbell: set to TRUE if the consumer is asleep and must be woken
+ *
+ * Appends one message to the ring.
+ *
+ * Returns: FALSE if the ring is full.
+ */
+gboolean hildon_im_ring_push (HildonIMRing *ring,
+                              HildonIMAtom atom,
+                              gint format,
+                              const void *data,
+                              gboolean *need_doorbell);
+
+/**
+ * hildon_im_ring_pop:
+ * @ring: a #HildonIMRing
+ * @slot: location to copy the next message to
+ *
+ * Takes the oldest message from the ring.
+ *
+ * Returns: FALSE if the ring is empty.
+ */
+gboolean hildon_im_ring_pop (HildonIMRing *ring, HildonIMRingSlot *slot);
+
+/**
+ * hildon_im_ring_sleep:
+ * @ring: a #HildonIMRing
+ *
+ * Marks the consumer as waiting for a doorbell. The consumer must call
+ * this once hildon_im_ring_pop() returns FALSE, and keep draining if
+ * this returns FALSE.
+ *
+ * Returns: TRUE if the ring is still empty and a doorbell will follow
+ * the next push.
+ */
+gboolean hildon_im_ring_sleep (HildonIMRing *ring);
+
+G_END_DECLS
+
+#endif /* ifndef HILDON_IM_RING_H_ */
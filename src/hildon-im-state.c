@@ -0,0 +1,279 @@
+/**
+   @file: hildon-im-state.c
+
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "hildon-im-gtk-compat.h"
+#include "hildon-im-state.h"
+
+/* Attempts at a consistent copy before the writer is taken to be stuck
+   inside hildon_im_state_write() */
+#define HILDON_IM_STATE_READ_TRIES 100
+
+struct _HildonIMState
+{
+  gint fd;
+  HildonIMStatePage *page;
+};
+
+static HildonIMState *
+state_map (gint fd)
+{
+  HildonIMState *state;
+  void *addr;
+
+  addr = mmap (NULL, sizeof (HildonIMStatePage), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  state = g_new0 (HildonIMState, 1);
+  state->fd = fd;
+  state->page = addr;
+
+  return state;
+}
+
+HildonIMState *
+hildon_im_state_new (void)
+{
+#ifdef HAVE_MEMFD_CREATE
+  HildonIMState *state;
+  gint fd;
+
+  fd = memfd_create ("hildon-im-state", MFD_CLOEXEC);
+  if (fd < 0)
+  {
+    g_warning ("Unable to create the IM state page");
+    return NULL;
+  }
+
+  if (ftruncate (fd, sizeof (HildonIMStatePage)) != 0 ||
+      (state = state_map (fd)) == NULL)
+  {
+    g_warning ("Unable to map the IM state page");
+    close (fd);
+    return NULL;
+  }
+
+  state->page->magic = HILDON_IM_STATE_MAGIC;
+  state->page->version = HILDON_IM_STATE_VERSION;
+  state->page->block_size = sizeof (HildonIMStateBlock);
+  hildon_im_state_reset (state);
+
+  return state;
+#else
+  return NULL;
+#endif
+}
+
+HildonIMState *
+hildon_im_state_open (gint pid, gint fd)
+{
+  HildonIMState *state;
+  struct stat st;
+  gchar *path;
+  gint local_fd;
+
+  path = g_strdup_printf ("/proc/%d/fd/%d", pid, fd);
+  local_fd = open (path, O_RDWR | O_CLOEXEC);
+  g_free (path);
+
+  if (local_fd < 0)
+    return NULL;
+
+  /* Touching a mapping past the end of the file raises SIGBUS */
+  if (fstat (local_fd, &st) != 0 ||
+      (guint64) st.st_size < sizeof (HildonIMStatePage))
+  {
+    g_warning ("IM state page file is too small");
+    close (local_fd);
+    return NULL;
+  }
+
+  state = state_map (local_fd);
+  if (state == NULL)
+  {
+    close (local_fd);
+    return NULL;
+  }
+
+  if (state->page->magic != HILDON_IM_STATE_MAGIC ||
+      state->page->version != HILDON_IM_STATE_VERSION ||
+      state->page->block_size != sizeof (HildonIMStateBlock))
+  {
+    g_warning ("IM state page header mismatch");
+    hildon_im_state_free (state);
+    return NULL;
+  }
+
+  return state;
+}
+
+void
+hildon_im_state_free (HildonIMState *state)
+{
+  if (state == NULL)
+    return;
+
+  munmap (state->page, sizeof (HildonIMStatePage));
+  close (state->fd);
+  g_free (state);
+}
+
+gint
+hildon_im_state_get_fd (HildonIMState *state)
+{
+  g_return_val_if_fail (state != NULL, -1);
+
+  return state->fd;
+}
+
+void
+hildon_im_state_reset (HildonIMState *state)
+{
+  gint i;
+
+  g_return_if_fail (state != NULL);
+
+  for (i = 0; i < HILDON_IM_STATE_NUM_SIDES; i++)
+  {
+    HildonIMStateBlock *block = &state->page->blocks[i];
+
+    block->input_window = 0;
+    block->mask = 0;
+    block->options = 0;
+    block->flags = 0;
+    g_atomic_int_set (&block->seq, 0);
+    g_atomic_int_set (&block->sleeping, 1);
+  }
+}
+
+void
+hildon_im_state_write (HildonIMState *state,
+                       HildonIMStateSide side,
+                       const HildonIMStateValues *values,
+                       gboolean *need_notify)
+{
+  HildonIMStateBlock *block;
+
+  g_return_if_fail (state != NULL && side < HILDON_IM_STATE_NUM_SIDES);
+
+  block = &state->page->blocks[side];
+
+  /* The increments are full barriers, so the values are only written
+     while seq is odd */
+  g_atomic_int_inc (&block->seq);
+  block->input_window = values->input_window;
+  block->mask = values->mask;
+  block->options = values->options;
+  block->flags = values->flags;
+  g_atomic_int_inc (&block->seq);
+
+  /* Only the write that takes the other side out of its sleep notifies
+     it; it reads the latest values on the same wakeup */
+  if (need_notify)
+    *need_notify = g_atomic_int_compare_and_exchange (
+        &state->page->blocks[!side].sleeping, 1, 0);
+}
+
+guint
+hildon_im_state_read (HildonIMState *state,
+                      HildonIMStateSide side,
+                      HildonIMStateValues *values,
+                      guint seen)
+{
+  HildonIMStateBlock *block;
+  HildonIMStateValues copy;
+  gint before, after;
+  guint tries;
+
+  g_return_val_if_fail (state != NULL && side < HILDON_IM_STATE_NUM_SIDES,
+                        seen);
+
+  block = &state->page->blocks[side];
+
+  /* The writer is another process, which may die or stall halfway */
+  for (tries = 0; tries < HILDON_IM_STATE_READ_TRIES; tries++)
+  {
+    before = g_atomic_int_get (&block->seq);
+    copy.input_window = block->input_window;
+    copy.mask = block->mask;
+    copy.options = block->options;
+    copy.flags = block->flags;
+    after = g_atomic_int_get (&block->seq);
+
+    if ((before & 1) == 0 && before == after)
+    {
+      *values = copy;
+      return (guint) after;
+    }
+  }
+
+  return seen;
+}
+
+gboolean
+hildon_im_state_sleep (HildonIMState *state,
+                       HildonIMStateSide side,
+                       guint seen)
+{
+  g_return_val_if_fail (state != NULL && side < HILDON_IM_STATE_NUM_SIDES,
+                        TRUE);
+
+  g_atomic_int_set (&state->page->blocks[side].sleeping, 1);
+
+  /* A write that raced with us may have seen sleeping == 0 and skipped
+     the notification, so look once more before sleeping */
+  if ((guint) g_atomic_int_get (&state->page->blocks[!side].seq) != seen)
+  {
+    g_atomic_int_compare_and_exchange (&state->page->blocks[side].sleeping,
+                                       1, 0);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+void
+hildon_im_state_wake (HildonIMState *state,
+                      HildonIMStateSide side)
+{
+  g_return_if_fail (state != NULL && side < HILDON_IM_STATE_NUM_SIDES);
+
+  g_atomic_int_set (&state->page->blocks[side].sleeping, 0);
+}
@@ -0,0 +1,165 @@
+/**
+   @file: hildon-im-state.h
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef HILDON_IM_STATE_H_
+#define HILDON_IM_STATE_H_
+
+#include <glib.h>
+
+#include "hildon-im-protocol.h"
+
+G_BEGIN_DECLS
+
+typedef struct _HildonIMState HildonIMState;
+
+/**
+ * HildonIMStateValues:
+ * @input_window: the client the state belongs to
+ * @mask: the shift and level bits of a #HildonIMInternalModifierMask
+ * @options: a #HildonIMOptionMask
+ * @flags: %HILDON_IM_STATE_AUTOCAP or 0
+ *
+ * A consistent copy of one #HildonIMStateBlock.
+ */
+typedef struct
+{
+  guint32 input_window;
+  guint32 mask;
+  guint32 options;
+  guint32 flags;
+} HildonIMStateValues;
+
+/**
+ * hildon_im_state_new:
+ *
+ * Creates a new state page in an anonymous shared memory file. Both
+ * blocks start out empty and asleep.
+ *
+ * Returns: a new #HildonIMState, or NULL if shared memory is unavailable.
+ */
+HildonIMState *hildon_im_state_new (void);
+
+/**
+ * hildon_im_state_open:
+ * @pid: the process that created the page
+ * @fd: the page's file descriptor in that process
+ *
+ * Maps a state page created by another process.
+ *
+ * Returns: a #HildonIMState, or NULL if it could not be mapped or the
+ * header does not match.
+ */
+HildonIMState *hildon_im_state_open (gint pid, gint fd);
+
+/**
+ * hildon_im_state_free:
+ * @state: a #HildonIMState
+ *
+ * Unmaps the page and closes its file descriptor.
+ */
+void hildon_im_state_free (HildonIMState *state);
+
+/**
+ * hildon_im_state_get_fd:
+ * @state: a #HildonIMState
+ *
+ * Returns: the file descriptor backing @state.
+ */
+gint hildon_im_state_get_fd (HildonIMState *state);
+
+/**
+ * hildon_im_state_reset:
+ * @state: a #HildonIMState
+ *
+ * Clears both blocks. Only call this on the creating side while no peer
+ * is attached, e.g. before announcing the page to a new IM.
+ */
+void hildon_im_state_reset (HildonIMState *state);
+
+/**
+ * hildon_im_state_write:
+ * @state: a #HildonIMState
+ * @side: the block of the calling side
+ * @values: the new state
+ * @need_notify: set to TRUE if the other side is asleep and must be sent
+ * %HILDON_IM_STATE_CHANGED
+ *
+ * Publishes the state of one side. Each block has exactly one writer.
+ */
+void hildon_im_state_write (HildonIMState *state,
+                            HildonIMStateSide side,
+                            const HildonIMStateValues *values,
+                            gboolean *need_notify);
+
+/**
+ * hildon_im_state_read:
+ * @state: a #HildonIMState
+ * @side: the block to read
+ * @values: location to copy the state to
+ *
+ * @seen: the sequence number of the copy read last
+ *
+ * Reads a consistent copy of one block, retrying a bounded number of
+ * times while its writer is inside hildon_im_state_write().
+ *
+ * Returns: the sequence number of the copy; it changes with every write.
+ * If no consistent copy could be made, @values is left alone and @seen
+ * is returned, as if nothing had been written.
+ */
+guint hildon_im_state_read (HildonIMState *state,
+                            HildonIMStateSide side,
+                            HildonIMStateValues *values,
+                            guint seen);
+
+/**
+ * hildon_im_state_sleep:
+ * @state: a #HildonIMState
+ * @side: the block of the calling side
+ * @seen: the sequence number of the other block last read
+ *
+ * Marks the calling side as waiting for %HILDON_IM_STATE_CHANGED. Call
+ * it before waiting for events, and read the other block again if this
+ * returns FALSE.
+ *
+ * Returns: TRUE if the other block is still at @seen and a notification
+ * will follow its next write.
+ */
+gboolean hildon_im_state_sleep (HildonIMState *state,
+                                HildonIMStateSide side,
+                                guint seen);
+
+/**
+ * hildon_im_state_wake:
+ * @state: a #HildonIMState
+ * @side: the block of the calling side
+ *
+ * Marks the calling side as awake again, so writes of the other side
+ * are picked up by its next hildon_im_state_read() without a
+ * notification.
+ */
+void hildon_im_state_wake (HildonIMState *state,
+                           HildonIMStateSide side);
+
+G_END_DECLS
+
+#endif /* ifndef HILDON_IM_STATE_H_ */
@@ -0,0 +1,934 @@
+/**
+   @file: hildon-im-transport.c
+
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <X11/Xlib.h>
+#include <gdk/gdkx.h>
+#include <gtk/gtk.h>
+#ifdef HAVE_XCB
+#include <stdlib.h>
+#include <xcb/xcb.h>
+#endif
+
+#include "hildon-im-gtk-compat.h"
+#include "hildon-im-codec.h"
+#include "hildon-im-transport.h"
+
+/* Largest bulk piece the socket transport sends in one packet */
+#define HILDON_IM_TRANSPORT_PIECE_SIZE 65536
+
+/* Most bytes the socket transport queues while the IM is not reading */
+#define HILDON_IM_TRANSPORT_QUEUE_MAX (1024 * 1024)
+
+/* Where hildon_im_transport_set_for_display() keeps the transport */
+#define HILDON_IM_TRANSPORT_DISPLAY_KEY "hildon-im-transport"
+
+typedef struct
+{
+  const gchar *name;
+  gboolean (*send) (HildonIMTransport *transport,
+                    const HildonIMTransportMessage *message);
+  gboolean (*send_bulk) (HildonIMTransport *transport,
+                         guint32 window,
+                         HildonIMAtom content,
+                         const gchar *text,
+                         gsize length);
+  void (*free) (HildonIMTransport *transport);
+} HildonIMTransportVTable;
+
+struct _HildonIMTransport
+{
+  const HildonIMTransportVTable *vtable;
+  HildonIMTransportReceiveFunc receive;
+  HildonIMTransportBulkFunc bulk;
+  gpointer user_data;
+  HildonIMTransportClosedFunc closed;
+  gpointer closed_data;
+};
+
+/* Must be the last thing a transport does with itself, since the closed
+   function may free it */
+static void
+transport_closed (HildonIMTransport *transport)
+{
+  if (transport->closed != NULL)
+  {
+    transport->closed(transport, transport->closed_data);
+  }
+}
+
+static void
+transport_deliver_bulk (HildonIMTransport *transport,
+                        guint32 window,
+                        HildonIMAtom content,
+                        GString *text)
+{
+  if (transport->bulk != NULL)
+  {
+    transport->bulk(transport, window, content, text->str, text->len,
+                    transport->user_data);
+  }
+}
+
+/* X11 */
+
+typedef struct
+{
+  HildonIMTransport parent;
+  Display *display;
+  const Atom *atoms;
+  Window target;
+} HildonIMTransportX11;
+
+static gboolean
+x11_send (HildonIMTransport *transport, const HildonIMTransportMessage *message)
+{
+  HildonIMTransportX11 *x11 = (HildonIMTransportX11 *) transport;
+  XEvent event;
+
+  hildon_im_transport_x11_encode(x11->atoms, message, &event);
+  if (x11->target != None)
+  {
+    event.xclient.window = x11->target;
+  }
+
+  return XSendEvent(x11->display, event.xclient.window, False, 0, &event) != 0;
+}
+
+static void
+x11_free (HildonIMTransport *transport)
+{
+  g_free(transport);
+}
+
+static const HildonIMTransportVTable x11_vtable =
+{
+  "x11",
+  x11_send,
+  NULL,
+  x11_free
+};
+
+HildonIMTransport *
+hildon_im_transport_x11_new (GdkDisplay *display)
+{
+  HildonIMTransportX11 *x11;
+
+  g_return_val_if_fail(GDK_IS_DISPLAY(display), NULL);
+
+  x11 = g_new0(HildonIMTransportX11, 1);
+  x11->parent.vtable = &x11_vtable;
+  x11->display = GDK_DISPLAY_XDISPLAY(display);
+  x11->atoms = hildon_im_protocol_get_atoms(display);
+  x11->target = None;
+
+  return &x11->parent;
+}
+
+/* X11 from a sender thread */
+
+#ifdef HAVE_XCB
+typedef struct
+{
+  HildonIMTransportX11 x11;
+  xcb_connection_t *connection;
+  GAsyncQueue *queue;
+  GThread *thread;
+} HildonIMTransportX11Thread;
+
+/* Pushed by x11_thread_free() to stop the sender thread */
+static xcb_client_message_event_t x11_thread_stop;
+
+static gpointer
+x11_thread_run (gpointer data)
+{
+  HildonIMTransportX11Thread *thread = data;
+  xcb_client_message_event_t *event;
+  xcb_generic_event_t *reply;
+
+  while ((event = g_async_queue_pop(thread->queue)) != &x11_thread_stop)
+  {
+    xcb_send_event(thread->connection, 0, event->window, 0,
+                   (const char *) event);
+    g_free(event);
+
+    /* Everything queued meanwhile goes out with the same flush */
+    if (g_async_queue_length(thread->queue) > 0)
+      continue;
+
+    xcb_flush(thread->connection);
+
+    /* Sending to a destroyed IM window only results in an error event
+       here, nobody else reads this connection */
+    while ((reply = xcb_poll_for_event(thread->connection)) != NULL)
+      free(reply);
+  }
+
+  xcb_flush(thread->connection);
+
+  return NULL;
+}
+
+static gboolean
+x11_thread_send (HildonIMTransport *transport,
+                 const HildonIMTransportMessage *message)
+{
+  HildonIMTransportX11Thread *thread = (HildonIMTransportX11Thread *) transport;
+  xcb_client_message_event_t *event;
+  guint32 values[5];
+  gint i;
+
+  event = g_new0(xcb_client_message_event_t, 1);
+  event->response_type = XCB_CLIENT_MESSAGE;
+  event->format = message->format;
+  event->window = thread->x11.target != None ? thread->x11.target
+                                             : message->window;
+  event->type = thread->x11.atoms[message->atom];
+
+  if (message->format == 32)
+  {
+    memcpy(values, message->data, sizeof(values));
+    for (i = 0; i < 5; i++)
+      event->data.data32[i] = values[i];
+  }
+  else
+  {
+    memcpy(event->data.data8, message->data, sizeof(message->data));
+  }
+
+  g_async_queue_push(thread->queue, event);
+
+  return TRUE;
+}
+
+static void
+x11_thread_free (HildonIMTransport *transport)
+{
+  HildonIMTransportX11Thread *thread = (HildonIMTransportX11Thread *) transport;
+
+  g_async_queue_push(thread->queue, &x11_thread_stop);
+  g_thread_join(thread->thread);
+
+  g_async_queue_unref(thread->queue);
+  xcb_disconnect(thread->connection);
+  g_free(thread);
+}
+
+static const HildonIMTransportVTable x11_thread_vtable =
+{
+  "x11-thread",
+  x11_thread_send,
+  NULL,
+  x11_thread_free
+};
+#endif
+
+HildonIMTransport *
+hildon_im_transport_x11_thread_new (GdkDisplay *display)
+{
+#ifdef HAVE_XCB
+  HildonIMTransportX11Thread *thread;
+  xcb_connection_t *connection;
+
+  g_return_val_if_fail(GDK_IS_DISPLAY(display), NULL);
+
+  connection = xcb_connect(DisplayString(GDK_DISPLAY_XDISPLAY(display)), NULL);
+  if (xcb_connection_has_error(connection))
+  {
+    g_warning("Unable to open a connection for the IM sender thread");
+    xcb_disconnect(connection);
+    return NULL;
+  }
+
+  thread = g_new0(HildonIMTransportX11Thread, 1);
+  thread->x11.parent.vtable = &x11_thread_vtable;
+  thread->x11.atoms = hildon_im_protocol_get_atoms(display);
+  thread->x11.target = None;
+  thread->connection = connection;
+  thread->queue = g_async_queue_new();
+  thread->thread = g_thread_new("hildon-im-sender", x11_thread_run, thread);
+
+  return &thread->x11.parent;
+#else
+  return NULL;
+#endif
+}
+
+void
+hildon_im_transport_x11_set_target (HildonIMTransport *transport, Window target)
+{
+  g_return_if_fail(transport != NULL);
+#ifdef HAVE_XCB
+  g_return_if_fail(transport->vtable == &x11_vtable ||
+                   transport->vtable == &x11_thread_vtable);
+#else
+  g_return_if_fail(transport->vtable == &x11_vtable);
+#endif
+
+  /* Only read by the thread that calls hildon_im_transport_send() */
+  ((HildonIMTransportX11 *) transport)->target = target;
+}
+
+gboolean
+hildon_im_transport_x11_decode (const Atom *atoms,
+                                const XClientMessageEvent *event,
+                                HildonIMTransportMessage *message)
+{
+  HildonIMAtom atom;
+
+  if (!hildon_im_codec_decode(atoms, event, &atom, message->data))
+  {
+    return FALSE;
+  }
+
+  message->window = event->window;
+  message->atom = atom;
+  message->format = event->format;
+
+  return TRUE;
+}
+
+void
+hildon_im_transport_x11_encode (const Atom *atoms,
+                                const HildonIMTransportMessage *message,
+                                XEvent *event)
+{
+  memset(event, 0, sizeof(XEvent));
+  event->xclient.type = ClientMessage;
+  event->xclient.window = message->window;
+  event->xclient.message_type = atoms[message->atom];
+  event->xclient.format = message->format;
+
+  hildon_im_codec_set_data(&event->xclient, message->data);
+}
+
+/* Unix domain socket */
+
+typedef struct
+{
+  HildonIMTransport parent;
+  gint fd;
+  guint watch_id;
+  GQueue out;
+  gsize out_size;
+  guint out_watch_id;
+  HildonIMBulkMessage pending;
+  gboolean expecting_payload;
+  GString *bulk;
+  gchar *buffer;
+} HildonIMTransportSocket;
+
+static void
+socket_out_clear (HildonIMTransportSocket *sock)
+{
+  GByteArray *packet;
+
+  if (sock->out_watch_id != 0)
+  {
+    g_source_remove(sock->out_watch_id);
+    sock->out_watch_id = 0;
+  }
+
+  while ((packet = g_queue_pop_head(&sock->out)) != NULL)
+  {
+    g_byte_array_free(packet, TRUE);
+  }
+
+  sock->out_size = 0;
+}
+
+static gboolean
+socket_writable (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+  HildonIMTransportSocket *sock = data;
+  GByteArray *packet;
+  gssize n;
+
+  while ((packet = g_queue_peek_head(&sock->out)) != NULL)
+  {
+    n = send(sock->fd, packet->data, packet->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+      return TRUE;
+    }
+
+    if (n != (gssize) packet->len)
+    {
+      /* The receive watch sees the connection go and reports it */
+      g_warning("Unable to send to the IM socket: %s", g_strerror(errno));
+      sock->out_watch_id = 0;
+      socket_out_clear(sock);
+      return FALSE;
+    }
+
+    g_queue_pop_head(&sock->out);
+    sock->out_size -= packet->len;
+    g_byte_array_free(packet, TRUE);
+  }
+
+  sock->out_watch_id = 0;
+
+  return FALSE;
+}
+
+/* Sends a packet without blocking. While the socket is full, packets
+   wait in order for it to become writable again. */
+static gboolean
+socket_write (HildonIMTransportSocket *sock, gconstpointer data, gsize length)
+{
+  GByteArray *packet;
+  GIOChannel *channel;
+  gssize n;
+
+  if (g_queue_is_empty(&sock->out))
+  {
+    n = send(sock->fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (n == (gssize) length)
+    {
+      return TRUE;
+    }
+
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+      g_warning("Unable to send to the IM socket: %s", g_strerror(errno));
+      return FALSE;
+    }
+  }
+
+  packet = g_byte_array_sized_new(length);
+  g_byte_array_append(packet, data, length);
+  g_queue_push_tail(&sock->out, packet);
+  sock->out_size += length;
+
+  if (sock->out_watch_id == 0)
+  {
+    channel = g_io_channel_unix_new(sock->fd);
+    sock->out_watch_id = g_io_add_watch(channel, G_IO_OUT,
+                                        socket_writable, sock);
+    g_io_channel_unref(channel);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+socket_send (HildonIMTransport *transport, const HildonIMTransportMessage *message)
+{
+  HildonIMTransportSocket *sock = (HildonIMTransportSocket *) transport;
+
+  if (sock->out_size + sizeof(*message) > HILDON_IM_TRANSPORT_QUEUE_MAX)
+  {
+    g_warning("The IM is not reading its socket, dropping a message");
+    return FALSE;
+  }
+
+  return socket_write(sock, message, sizeof(*message));
+}
+
+static gboolean
+socket_send_bulk (HildonIMTransport *transport,
+                  guint32 window,
+                  HildonIMAtom content,
+                  const gchar *text,
+                  gsize length)
+{
+  HildonIMTransportSocket *sock = (HildonIMTransportSocket *) transport;
+  HildonIMTransportMessage header;
+  HildonIMBulkMessage *msg;
+  gsize offset = 0;
+
+  /* A zero-length packet reads like a closed connection */
+  if (length == 0)
+  {
+    return FALSE;
+  }
+
+  /* A payload is never left half queued, so it is refused as a whole */
+  if (!g_queue_is_empty(&sock->out) &&
+      sock->out_size + length > HILDON_IM_TRANSPORT_QUEUE_MAX)
+  {
+    return FALSE;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.window = window;
+  header.atom = HILDON_IM_BULK;
+  header.format = HILDON_IM_BULK_FORMAT;
+  msg = (HildonIMBulkMessage *) header.data;
+  msg->input_window = window;
+  msg->content = content;
+
+  while (offset < length)
+  {
+    gsize len = MIN(length - offset, HILDON_IM_TRANSPORT_PIECE_SIZE);
+
+    if (offset == 0)
+      msg->type = len == length ?
+        HILDON_IM_BULK_WHOLE : HILDON_IM_BULK_INCR_START;
+    else if (offset + len == length)
+      msg->type = HILDON_IM_BULK_INCR_END;
+    else
+      msg->type = HILDON_IM_BULK_INCR_CONTINUE;
+    msg->length = len;
+
+    if (!socket_write(sock, &header, sizeof(header)) ||
+        !socket_write(sock, text + offset, len))
+    {
+      g_warning("Unable to send a bulk payload to the IM socket");
+      return FALSE;
+    }
+
+    offset += len;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+socket_receive (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+  HildonIMTransportSocket *sock = data;
+  HildonIMTransport *transport = &sock->parent;
+  gssize n;
+
+  while ((n = recv(sock->fd, sock->buffer, HILDON_IM_TRANSPORT_PIECE_SIZE,
+                   MSG_DONTWAIT)) > 0)
+  {
+    if (sock->expecting_payload)
+    {
+      sock->expecting_payload = FALSE;
+
+      if (sock->pending.type == HILDON_IM_BULK_WHOLE ||
+          sock->pending.type == HILDON_IM_BULK_INCR_START)
+      {
+        g_string_truncate(sock->bulk, 0);
+      }
+
+      g_string_append_len(sock->bulk, sock->buffer, n);
+
+      if (sock->pending.type == HILDON_IM_BULK_WHOLE ||
+          sock->pending.type == HILDON_IM_BULK_INCR_END)
+      {
+        transport_deliver_bulk(transport, sock->pending.input_window,
+                               sock->pending.content, sock->bulk);
+        g_string_truncate(sock->bulk, 0);
+      }
+    }
+    else if (n == sizeof(HildonIMTransportMessage))
+    {
+      HildonIMTransportMessage *message =
+        (HildonIMTransportMessage *) sock->buffer;
+
+      if (message->atom == HILDON_IM_BULK)
+      {
+        memcpy(&sock->pending, message->data, sizeof(sock->pending));
+        sock->expecting_payload = TRUE;
+      }
+      else if (transport->receive != NULL)
+      {
+        transport->receive(transport, message, transport->user_data);
+      }
+    }
+    else
+    {
+      g_warning("Dropping a malformed packet from the IM socket");
+    }
+  }
+
+  if (n == 0 || (condition & (G_IO_HUP | G_IO_ERR)) ||
+      (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  {
+    g_warning("The IM socket was closed");
+    sock->watch_id = 0;
+    socket_out_clear(sock);
+    transport_closed(transport);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+socket_free (HildonIMTransport *transport)
+{
+  HildonIMTransportSocket *sock = (HildonIMTransportSocket *) transport;
+
+  if (sock->watch_id != 0)
+  {
+    g_source_remove(sock->watch_id);
+  }
+
+  socket_out_clear(sock);
+  close(sock->fd);
+  g_string_free(sock->bulk, TRUE);
+  g_free(sock->buffer);
+  g_free(sock);
+}
+
+static const HildonIMTransportVTable socket_vtable =
+{
+  "socket",
+  socket_send,
+  socket_send_bulk,
+  socket_free
+};
+
+HildonIMTransport *
+hildon_im_transport_socket_new_for_fd (gint fd)
+{
+  HildonIMTransportSocket *sock;
+  GIOChannel *channel;
+
+  g_return_val_if_fail(fd >= 0, NULL);
+
+  sock = g_new0(HildonIMTransportSocket, 1);
+  sock->parent.vtable = &socket_vtable;
+  sock->fd = fd;
+  sock->bulk = g_string_new("");
+  sock->buffer = g_malloc(HILDON_IM_TRANSPORT_PIECE_SIZE);
+
+  channel = g_io_channel_unix_new(fd);
+  sock->watch_id = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                  socket_receive, sock);
+  g_io_channel_unref(channel);
+
+  return &sock->parent;
+}
+
+HildonIMTransport *
+hildon_im_transport_socket_new (const gchar *path)
+{
+  struct sockaddr_un addr;
+  gint fd;
+
+  g_return_val_if_fail(path != NULL, NULL);
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    g_warning("IM socket path too long: %s", path);
+    return NULL;
+  }
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    g_warning("Unable to create the IM socket: %s", g_strerror(errno));
+    return NULL;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+  {
+    g_warning("Unable to connect to the IM socket %s: %s",
+              path, g_strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  return hildon_im_transport_socket_new_for_fd(fd);
+}
+
+/* In-process loopback */
+
+typedef struct _HildonIMTransportLoopback HildonIMTransportLoopback;
+
+struct _HildonIMTransportLoopback
+{
+  HildonIMTransport parent;
+  HildonIMTransportLoopback *peer;
+  GQueue inbox;
+  guint idle_id;
+};
+
+typedef struct
+{
+  HildonIMTransportMessage message;
+  GString *text;
+  HildonIMAtom content;
+} HildonIMLoopbackItem;
+
+static void
+loopback_item_free (HildonIMLoopbackItem *item)
+{
+  if (item->text != NULL)
+    g_string_free(item->text, TRUE);
+  g_free(item);
+}
+
+static gboolean
+loopback_idle (gpointer data)
+{
+  HildonIMTransportLoopback *loop = data;
+
+  loop->idle_id = 0;
+  hildon_im_transport_loopback_dispatch(&loop->parent);
+
+  return FALSE;
+}
+
+static gboolean
+loopback_post (HildonIMTransport *transport, HildonIMLoopbackItem *item)
+{
+  HildonIMTransportLoopback *loop = (HildonIMTransportLoopback *) transport;
+  HildonIMTransportLoopback *peer = loop->peer;
+
+  if (peer == NULL)
+  {
+    loopback_item_free(item);
+    return FALSE;
+  }
+
+  g_queue_push_tail(&peer->inbox, item);
+  if (peer->idle_id == 0)
+  {
+    peer->idle_id = g_idle_add(loopback_idle, peer);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+loopback_send (HildonIMTransport *transport,
+               const HildonIMTransportMessage *message)
+{
+  HildonIMLoopbackItem *item = g_new0(HildonIMLoopbackItem, 1);
+
+  item->message = *message;
+
+  return loopback_post(transport, item);
+}
+
+static gboolean
+loopback_send_bulk (HildonIMTransport *transport,
+                    guint32 window,
+                    HildonIMAtom content,
+                    const gchar *text,
+                    gsize length)
+{
+  HildonIMLoopbackItem *item = g_new0(HildonIMLoopbackItem, 1);
+
+  item->message.window = window;
+  item->message.atom = HILDON_IM_BULK;
+  item->content = content;
+  item->text = g_string_new_len(text, length);
+
+  return loopback_post(transport, item);
+}
+
+static void
+loopback_free (HildonIMTransport *transport)
+{
+  HildonIMTransportLoopback *loop = (HildonIMTransportLoopback *) transport;
+  HildonIMTransportLoopback *peer = loop->peer;
+  HildonIMLoopbackItem *item;
+
+  if (peer != NULL)
+  {
+    peer->peer = NULL;
+  }
+
+  if (loop->idle_id != 0)
+  {
+    g_source_remove(loop->idle_id);
+  }
+
+  while ((item = g_queue_pop_head(&loop->inbox)) != NULL)
+  {
+    loopback_item_free(item);
+  }
+
+  g_free(loop);
+
+  if (peer != NULL)
+  {
+    transport_closed(&peer->parent);
+  }
+}
+
+static const HildonIMTransportVTable loopback_vtable =
+{
+  "loopback",
+  loopback_send,
+  loopback_send_bulk,
+  loopback_free
+};
+
+void
+hildon_im_transport_loopback_new_pair (HildonIMTransport **a,
+                                       HildonIMTransport **b)
+{
+  HildonIMTransportLoopback *first;
+  HildonIMTransportLoopback *second;
+
+  g_return_if_fail(a != NULL && b != NULL);
+
+  first = g_new0(HildonIMTransportLoopback, 1);
+  second = g_new0(HildonIMTransportLoopback, 1);
+
+  first->parent.vtable = &loopback_vtable;
+  second->parent.vtable = &loopback_vtable;
+  g_queue_init(&first->inbox);
+  g_queue_init(&second->inbox);
+  first->peer = second;
+  second->peer = first;
+
+  *a = &first->parent;
+  *b = &second->parent;
+}
+
+guint
+hildon_im_transport_loopback_dispatch (HildonIMTransport *transport)
+{
+  HildonIMTransportLoopback *loop = (HildonIMTransportLoopback *) transport;
+  HildonIMLoopbackItem *item;
+  guint count = 0;
+
+  g_return_val_if_fail(transport != NULL &&
+                       transport->vtable == &loopback_vtable, 0);
+
+  while ((item = g_queue_pop_head(&loop->inbox)) != NULL)
+  {
+    if (item->text != NULL)
+    {
+      transport_deliver_bulk(transport, item->message.window, item->content,
+                             item->text);
+    }
+    else if (transport->receive != NULL)
+    {
+      transport->receive(transport, &item->message, transport->user_data);
+    }
+
+    loopback_item_free(item);
+    count++;
+  }
+
+  return count;
+}
+
+/* Common */
+
+const gchar *
+hildon_im_transport_get_name (HildonIMTransport *transport)
+{
+  g_return_val_if_fail(transport != NULL, NULL);
+
+  return transport->vtable->name;
+}
+
+void
+hildon_im_transport_set_receive_func (HildonIMTransport *transport,
+                                      HildonIMTransportReceiveFunc receive,
+                                      HildonIMTransportBulkFunc bulk,
+                                      gpointer user_data)
+{
+  g_return_if_fail(transport != NULL);
+
+  transport->receive = receive;
+  transport->bulk = bulk;
+  transport->user_data = user_data;
+}
+
+void
+hildon_im_transport_set_closed_func (HildonIMTransport *transport,
+                                     HildonIMTransportClosedFunc closed,
+                                     gpointer user_data)
+{
+  g_return_if_fail(transport != NULL);
+
+  transport->closed = closed;
+  transport->closed_data = user_data;
+}
+
+void
+hildon_im_transport_set_for_display (GdkDisplay *display,
+                                     HildonIMTransport *transport)
+{
+  g_return_if_fail(display != NULL);
+
+  g_object_set_data_full(G_OBJECT(display), HILDON_IM_TRANSPORT_DISPLAY_KEY,
+                         transport,
+                         (GDestroyNotify) hildon_im_transport_free);
+}
+
+HildonIMTransport *
+hildon_im_transport_steal_for_display (GdkDisplay *display)
+{
+  g_return_val_if_fail(display != NULL, NULL);
+
+  return g_object_steal_data(G_OBJECT(display),
+                             HILDON_IM_TRANSPORT_DISPLAY_KEY);
+}
+
+gboolean
+hildon_im_transport_send (HildonIMTransport *transport,
+                          const HildonIMTransportMessage *message)
+{
+  g_return_val_if_fail(transport != NULL, FALSE);
+  g_return_val_if_fail(message != NULL, FALSE);
+
+  return transport->vtable->send(transport, message);
+}
+
+gboolean
+hildon_im_transport_send_bulk (HildonIMTransport *transport,
+                               guint32 window,
+                               HildonIMAtom content,
+                               const gchar *text,
+                               gsize length)
+{
+  g_return_val_if_fail(transport != NULL, FALSE);
+
+  if (transport->vtable->send_bulk == NULL)
+  {
+    return FALSE;
+  }
+
+  return transport->vtable->send_bulk(transport, window, content, text, length);
+}
+
+void
+hildon_im_transport_free (HildonIMTransport *transport)
+{
+  if (transport == NULL)
+    return;
+
+  transport->vtable->free(transport);
+}
@@ -0,0 +1,310 @@
+/**
+   @file: hildon-im-transport.h
+ */
+/*
+ * This file is part of hildon-input-method-framework
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef HILDON_IM_TRANSPORT_H_
+#define HILDON_IM_TRANSPORT_H_
+
+#include <glib.h>
+#include <X11/Xlib.h>
+#include <gdk/gdk.h>
+
+#include "hildon-im-protocol.h"
+
+G_BEGIN_DECLS
+
+/**
+ * HildonIMTransportMessage:
+ * @window: the client window the message is about
+ * @atom: the #HildonIMAtom of the message
+ * @format: the ClientMessage format of the message, 8 or 32
+ * @data: the message data; format 32 data is five 32-bit values
+ *
+ * One protocol message, independent of how it travels. This is also the
+ * record the socket transport puts on the wire.
+ */
+typedef struct
+{
+  guint32 window;
+  guint32 atom;
+  guint32 format;
+  char data[20];
+} HildonIMTransportMessage;
+
+typedef struct _HildonIMTransport HildonIMTransport;
+
+/**
+ * HildonIMTransportReceiveFunc:
+ * @transport: the #HildonIMTransport the message arrived on
+ * @message: the message
+ * @user_data: data given to hildon_im_transport_set_receive_func()
+ *
+ * Called for every message received on a transport.
+ */
+typedef void (*HildonIMTransportReceiveFunc) (HildonIMTransport *transport,
+                                              const HildonIMTransportMessage *message,
+                                              gpointer user_data);
+
+/**
+ * HildonIMTransportBulkFunc:
+ * @transport: the #HildonIMTransport the payload arrived on
+ * @window: the client window the payload is about
+ * @content: the #HildonIMAtom of the message the payload stands for
+ * @text: the payload, nul-terminated
+ * @length: the length of @text in bytes
+ * @user_data: data given to hildon_im_transport_set_receive_func()
+ *
+ * Called once a whole bulk payload was received on a transport.
+ */
+typedef void (*HildonIMTransportBulkFunc) (HildonIMTransport *transport,
+                                           guint32 window,
+                                           HildonIMAtom content,
+                                           const gchar *text,
+                                           gsize length,
+                                           gpointer user_data);
+
+/**
+ * HildonIMTransportClosedFunc:
+ * @transport: the #HildonIMTransport whose peer went away
+ * @user_data: data given to hildon_im_transport_set_closed_func()
+ *
+ * Called once the peer closed the connection; nothing more is received
+ * and sending fails. The function may free @transport.
+ */
+typedef void (*HildonIMTransportClosedFunc) (HildonIMTransport *transport,
+                                             gpointer user_data);
+
+/**
+ * hildon_im_transport_x11_new:
+ * @display: the #GdkDisplay to send on
+ *
+ * Creates a transport sending ClientMessages through the X server.
+ * Messages go to the target window if one is set, otherwise to the
+ * message's own window. Incoming ClientMessages are still received by
+ * window filters, which pass them to hildon_im_transport_x11_decode().
+ *
+ * Returns: a new #HildonIMTransport
+ */
+HildonIMTransport *hildon_im_transport_x11_new (GdkDisplay *display);
+
+/**
+ * hildon_im_transport_x11_thread_new:
+ * @display: the #GdkDisplay whose X server to send to
+ *
+ * Like hildon_im_transport_x11_new(), but sending happens on a thread
+ * of its own through a separate X connection. hildon_im_transport_send()
+ * only queues the message, so a stalled X server or IM cannot block the
+ * caller. Errors from sending to a destroyed window are dropped.
+ *
+ * Returns: a new #HildonIMTransport, or NULL if the library was built
+ * without XCB or the connection failed.
+ */
+HildonIMTransport *hildon_im_transport_x11_thread_new (GdkDisplay *display);
+
+/**
+ * hildon_im_transport_x11_set_target:
+ * @transport: a transport created by hildon_im_transport_x11_new() or
+ * hildon_im_transport_x11_thread_new()
+ * @target: the window to send to, or None
+ *
+ * Sets the window every message is sent to, e.g. the IM window.
+ */
+void hildon_im_transport_x11_set_target (HildonIMTransport *transport,
+                                         Window target);
+
+/**
+ * hildon_im_transport_x11_decode:
+ * @atoms: the table hildon_im_protocol_get_atoms() returned for the display
+ * the event came from
+ * @event: a ClientMessage event
+ * @message: location to store the decoded message
+ *
+ * Returns: TRUE if @event is a protocol message in the format
+ * hildon-im-protocol-schema.h gives for it.
+ */
+gboolean hildon_im_transport_x11_decode (const Atom *atoms,
+                                         const XClientMessageEvent *event,
+                                         HildonIMTransportMessage *message);
+
+/**
+ * hildon_im_transport_x11_encode:
+ * @atoms: the atom table of the display the event goes to
+ * @message: a message
+ * @event: location to store the ClientMessage event
+ *
+ * The reverse of hildon_im_transport_x11_decode(). The event's window
+ * is the message's window.
+ */
+void hildon_im_transport_x11_encode (const Atom *atoms,
+                                     const HildonIMTransportMessage *message,
+                                     XEvent *event);
+
+/**
+ * hildon_im_transport_socket_new:
+ * @path: the path of the Unix domain socket to connect to
+ *
+ * Connects to a peer listening on a SOCK_SEQPACKET Unix domain socket.
+ * Messages are sent as #HildonIMTransportMessage records; bulk payloads
+ * as a #HildonIMBulkMessage record followed by one packet per piece.
+ * Sending never blocks: while the socket is full, packets are queued
+ * until it is writable again, up to a limit past which sending fails.
+ *
+ * Returns: a new #HildonIMTransport, or NULL if the connection failed.
+ */
+HildonIMTransport *hildon_im_transport_socket_new (const gchar *path);
+
+/**
+ * hildon_im_transport_socket_new_for_fd:
+ * @fd: a connected SOCK_SEQPACKET socket, e.g. from accept()
+ *
+ * Creates a socket transport on an existing connection. The transport
+ * owns @fd.
+ *
+ * Returns: a new #HildonIMTransport
+ */
+HildonIMTransport *hildon_im_transport_socket_new_for_fd (gint fd);
+
+/**
+ * hildon_im_transport_loopback_new_pair:
+ * @a: location for the first end
+ * @b: location for the second end
+ *
+ * Creates two in-process transports connected to each other. What is
+ * sent on one end is received on the other from an idle callback, or
+ * right away by hildon_im_transport_loopback_dispatch(). Freeing one end
+ * closes the other. Handing one end to hildon_im_transport_set_for_display()
+ * lets a test play the IM without an IM process; the contexts still
+ * need the X server for the protocol atoms and their client windows.
+ */
+void hildon_im_transport_loopback_new_pair (HildonIMTransport **a,
+                                            HildonIMTransport **b);
+
+/**
+ * hildon_im_transport_loopback_dispatch:
+ * @transport: an end created by hildon_im_transport_loopback_new_pair()
+ *
+ * Delivers everything sent to @transport so far.
+ *
+ * Returns: the number of messages and payloads delivered.
+ */
+guint hildon_im_transport_loopback_dispatch (HildonIMTransport *transport);
+
+/**
+ * hildon_im_transport_get_name:
+ * @transport: a #HildonIMTransport
+ *
+ * Returns: "x11", "x11-thread", "socket" or "loopback".
+ */
+const gchar *hildon_im_transport_get_name (HildonIMTransport *transport);
+
+/**
+ * hildon_im_transport_set_receive_func:
+ * @transport: a #HildonIMTransport
+ * @receive: called for every received message
+ * @bulk: called for every received bulk payload
+ * @user_data: data passed to @receive and @bulk
+ *
+ * Sets where received messages go.
+ */
+void hildon_im_transport_set_receive_func (HildonIMTransport *transport,
+                                           HildonIMTransportReceiveFunc receive,
+                                           HildonIMTransportBulkFunc bulk,
+                                           gpointer user_data);
+
+/**
+ * hildon_im_transport_set_closed_func:
+ * @transport: a #HildonIMTransport
+ * @closed: called when the peer goes away, or NULL
+ * @user_data: data passed to @closed
+ *
+ * Sets what to do when the peer closes the connection. The X11
+ * transports have no connection of their own and never call it.
+ */
+void hildon_im_transport_set_closed_func (HildonIMTransport *transport,
+                                          HildonIMTransportClosedFunc closed,
+                                          gpointer user_data);
+
+/**
+ * hildon_im_transport_set_for_display:
+ * @display: a #GdkDisplay
+ * @transport: a #HildonIMTransport, or NULL
+ *
+ * Leaves @transport on @display for the IM module to pick up, e.g. one
+ * end of a loopback pair. The IM contexts share a single transport, so
+ * they only look at the default display, whatever display their client
+ * windows are on. They take @transport over the next time they send
+ * something, replacing the one they used before, including the one
+ * HILDON_IM_TRANSPORT asks for. @display owns @transport until then.
+ */
+void hildon_im_transport_set_for_display (GdkDisplay *display,
+                                          HildonIMTransport *transport);
+
+/**
+ * hildon_im_transport_steal_for_display:
+ * @display: a #GdkDisplay
+ *
+ * Takes back what hildon_im_transport_set_for_display() set.
+ *
+ * Returns: the transport, owned by the caller now, or NULL
+ */
+HildonIMTransport *hildon_im_transport_steal_for_display (GdkDisplay *display);
+
+/**
+ * hildon_im_transport_send:
+ * @transport: a #HildonIMTransport
+ * @message: the message to send
+ *
+ * Returns: FALSE if the message could not be sent.
+ */
+gboolean hildon_im_transport_send (HildonIMTransport *transport,
+                                   const HildonIMTransportMessage *message);
+
+/**
+ * hildon_im_transport_send_bulk:
+ * @transport: a #HildonIMTransport
+ * @window: the client window the payload is about
+ * @content: the #HildonIMAtom of the message the payload stands for
+ * @text: the payload
+ * @length: the length of @text in bytes
+ *
+ * Sends a text payload of any size in one go.
+ *
+ * Returns: FALSE if the transport has no bulk channel or sending failed;
+ * the caller then has to send the text as messages.
+ */
+gboolean hildon_im_transport_send_bulk (HildonIMTransport *transport,
+                                        guint32 window,
+                                        HildonIMAtom content,
+                                        const gchar *text,
+                                        gsize length);
+
+/**
+ * hildon_im_transport_free:
+ * @transport: a #HildonIMTransport
+ *
+ * Closes @transport. A loopback end stays valid for its peer, which
+ * simply stops receiving.
+ */
+void hildon_im_transport_free (HildonIMTransport *transport);
+
+G_END_DECLS
+
+#endif /* ifndef HILDON_IM_TRANSPORT_H_ */